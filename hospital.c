@@ -2,13 +2,51 @@
 // Created by Daniel and Jun on 2025-01-29.
 //
 // Purpose: To manage a hospital's operations, including keeping patient records,
-// searching for and discharging patients, and managing doctors' weekly schedules,
+// searching for and discharging patients, and managing the doctors' duty roster,
 // using a user-friendly menu-driven interface.
 //
 
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Census analytics kernels: SSE2 and AVX2 where the compiler can target them (picked at run
+// time by what the CPU has), plain C everywhere else or with -DHOSPITAL_NO_SIMD
+#ifndef HOSPITAL_NO_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ANALYTICS_TARGET(isa) __attribute__((target(isa)))
+#define ANALYTICS_HAS_AVX2() __builtin_cpu_supports("avx2")
+#define ANALYTICS_HAS_SSE2() __builtin_cpu_supports("sse2")
+#elif defined(_M_X64)
+#include <immintrin.h>
+#define ANALYTICS_TARGET(isa)
+#define ANALYTICS_HAS_AVX2() 0 // No run-time check here; SSE2 is always there on x64
+#define ANALYTICS_HAS_SSE2() 1
+#endif
+#endif
 
 #define DAYS_IN_WEEK 7
 #define SHIFTS_IN_DAY 3
@@ -16,12 +54,73 @@
 #define DIAGNOSIS_MAX_LENGTH 100
 #define PATIENT_MIN_AGE 1
 #define PATIENT_MAX_AGE 125
+#define FIRST_ROOM_NUMBER 1
+#define LAST_ROOM_NUMBER 2000
+#define ROOM_CAPACITY 2
 #define PATIENT_FILE "patients.dat"
 #define SCHEDULE_FILE "schedule.dat"
 #define BACKUP_FILE "backup.dat"
+#define PATIENT_INDEX_MIN_CAPACITY 64
+#define PATIENT_STORE_MIN_CAPACITY 64
+#define PATIENT_FILE_MAGIC "HOSPDAT"
+#define PATIENT_FILE_VERSION 3
+#define CENSUS_CHUNK_RECORDS 4096
+#define CENSUS_ROUND_CHUNKS 16
+#define CENSUS_RECORD_MIN 5
+#define CENSUS_RECORD_MAX (4 * 5 + NAME_MAX_LENGTH + DIAGNOSIS_MAX_LENGTH)
+#define JOURNAL_FILE "patients.journal"
+#define JOURNAL_MAGIC "HOSPJNL"
+#define JOURNAL_COMPACT_MIN 1024
+#define BACKUP_MAGIC "HOSPBAK"
+#define BACKUP_VERSION 4
+#define BACKUP_PENDING_FILE "backup.pending"
+#define BACKUP_MAX_DELTAS 16
+#define RESTORE_CHUNK_RECORDS 8192
+#define BATCH_LINE_MAX 512
+#define BATCH_MAX_FIELDS 8
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define ARCHIVE_FILE "discharges.dat"
+#define ARCHIVE_INDEX_FILE "discharges.idx"
+#define ARCHIVE_MAGIC "HOSPARC"
+#define ARCHIVE_BLOCK_RECORDS 256
+#define ARCHIVE_RECORD_MAX 192
+#define WARD_COUNT 16
+#define SCHEDULE_FILE_MAGIC "HOSPSCH"
+#define SCHEDULE_FILE_VERSION 2
+#define MAX_WORKERS 64
+#define SERVER_BACKLOG 64
+#define MAX_READERS 128
+#define LOOKUP_RETRIES 64
+#define STORE_SHARD_BITS 3
+#define STORE_SHARDS (1 << STORE_SHARD_BITS)
+#define PARALLEL_MIN_ROWS 16384
+#define ORDER_LEVELS 16
+#define ORDER_NODES_PER_SLAB 1024
+#define DIAGNOSIS_BLOCK_CODES 1024
+#define DIAGNOSIS_MAX_BLOCKS 16384
+#define DIAGNOSIS_CACHE_SLOTS 256
+#define ANALYTICS_DECADES 13
+#define ANALYTICS_BLOCK_ROWS 4096
+#define ANALYTICS_TOP 10
+#define METRICS_FILE "metrics.prom"
+#define METRICS_DUMP_SECONDS 10
+#define METRICS_STRIPES 8
+#define METRICS_BUCKETS 28
+#define BENCHMARK_DIR "hospital-bench.tmp"
+#define BENCHMARK_SIZES "1000,10000,100000,1000000"
+#define BENCHMARK_MAX_PATIENTS 10000000
+#define BENCHMARK_REPEATS 3
+#define BENCHMARK_ID_SEARCHES 100000
+#define BENCHMARK_NAME_SEARCHES 10000
+#define BENCHMARK_DOCTORS 40
+#define BENCHMARK_ROSTER_DAYS 28
+#define BENCHMARK_CHECK_AGES 203 // Not a multiple of 8, so the kernels' scalar tails are checked too
 
 // Structure to store patient information
-// Changed(by Jun): Changed to Linked List
+// The type patients are entered, looked up and journaled as; the live census is kept in the
+// column store below and the files hold PatientRecords or packed chunks. The struct is also
+// the record layout of the oldest patients.dat (a count and raw Patients, see readPatientFile),
+// which is why next is still here: it is unused, it only keeps that layout.
 typedef struct PatientInformation {
     int patientID;
     char name[NAME_MAX_LENGTH];
@@ -31,18 +130,662 @@ typedef struct PatientInformation {
     struct PatientInformation *next;
 } Patient;
 
-// Structure to store doctor's name
+// patients.dat layout (version 3, little-endian):
+// a PatientFileHeader followed by the census as a diagnosis table and chunks (see CensusChunkHeader).
+// Version 2 had no diagnosis table; version 1 held recordCount fixed-width PatientRecords instead.
+// Only fixed-width fields, so 32-bit and 64-bit builds read the same file.
+typedef struct {
+    char magic[8];         // PATIENT_FILE_MAGIC
+    uint32_t version;      // PATIENT_FILE_VERSION
+    uint32_t recordCount;
+    uint32_t recordSize;   // sizeof(PatientRecord)
+    uint32_t checksum;     // fileChecksum() of the chunk headers (version 1: of all the records)
+} PatientFileHeader;
+
+typedef struct {
+    int32_t patientID;
+    int32_t age;
+    int32_t roomNumber;
+    char name[NAME_MAX_LENGTH];
+    char diagnosis[DIAGNOSIS_MAX_LENGTH];
+} PatientRecord;
+
+// A census on file is a diagnosis table, then a run of chunks of CENSUS_CHUNK_RECORDS
+// records (the last one may be short), each a CensusChunkHeader and size packed bytes, so
+// that chunks can be encoded and decoded on separate threads. A packed record is varints:
+// the ID as a zigzag delta from the record before, the age, the room (zigzag), the name
+// length and the name, then the diagnosis as its place in the table. The table is laid out
+// like a chunk whose recordCount records are the distinct diagnoses of the census, each a
+// varint length and the text. The bytes are zero-padded to a multiple of 4.
+// Older files (patients.dat version 2, backups version 3) have no table: a record ends
+// with the diagnosis length and text, or, for values from DIAGNOSIS_MAX_LENGTH up, a
+// back-reference to the record (value - DIAGNOSIS_MAX_LENGTH + 1) places earlier in the
+// chunk with the same diagnosis.
+typedef struct {
+    uint32_t recordCount;
+    uint32_t size;       // Packed bytes that follow
+    uint32_t checksum;   // fileChecksum() of those bytes
+} CensusChunkHeader;
+
+// A census record as decoded from a file, its diagnosis already a dictionary code
+typedef struct {
+    int patientID;
+    int age;
+    int roomNumber;
+    int diagnosisCode;
+    char name[NAME_MAX_LENGTH];
+} CensusRecord;
+
+// patients.journal layout: JOURNAL_MAGIC (8 bytes) followed by entries.
+// Each entry is a JournalEntryHeader and size bytes of payload:
+// a PatientRecord for JOURNAL_ADD, an int32_t ID for JOURNAL_DISCHARGE,
+// a RosterRecord for JOURNAL_ROSTER_ADD and JOURNAL_ROSTER_REMOVE. Older journals may
+// hold JOURNAL_ASSIGN (a JournalAssign for the old weekly schedule).
+// Replaying an entry twice is harmless.
+enum { JOURNAL_ADD = 1, JOURNAL_DISCHARGE = 2, JOURNAL_ASSIGN = 3, JOURNAL_ROSTER_ADD = 4, JOURNAL_ROSTER_REMOVE = 5 };
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;      // Payload bytes that follow the header
+    uint32_t checksum;  // fileChecksum() of the payload
+} JournalEntryHeader;
+
+typedef struct {
+    int32_t day;
+    int32_t shift;
+    char doctorName[NAME_MAX_LENGTH];
+} JournalAssign;
+
+// One doctor on one shift of one ward, as kept in schedule.dat, backups and the journal
+typedef struct {
+    int32_t day;     // Days since 1970-01-01
+    int32_t shift;   // 0 morning, 1 afternoon, 2 evening
+    int32_t ward;    // 1 to WARD_COUNT
+    char doctorName[NAME_MAX_LENGTH];
+} RosterRecord;
+
+// schedule.dat layout (version 2): a ScheduleFileHeader then recordCount RosterRecords.
+// Version 1 was DAYS_IN_WEEK x SHIFTS_IN_DAY DoctorSchedule names with no header.
+typedef struct {
+    char magic[8];         // SCHEDULE_FILE_MAGIC
+    uint32_t version;      // SCHEDULE_FILE_VERSION
+    uint32_t recordCount;
+    uint32_t recordSize;   // sizeof(RosterRecord)
+    uint32_t checksum;     // fileChecksum() of all the records
+} ScheduleFileHeader;
+
+// backup.dat is a full backup (the base of a chain); backup.dat.1, backup.dat.2, ...
+// are incremental backups, each holding only what changed since the one before.
+// Layout: BackupFileHeader, recordCount patients as census chunks, dischargeCount int32_t IDs,
+// then a uint32_t roster size and the whole roster as RosterRecords.
+// Version 3 has no diagnosis table before the chunks; versions 1 and 2 hold recordCount
+// PatientRecords instead of chunks, and version 1 backups also end with the old
+// DAYS_IN_WEEK x SHIFTS_IN_DAY schedule instead of the roster.
+enum { BACKUP_FULL = 1, BACKUP_DELTA = 2 };
+
+typedef struct {
+    char magic[8];            // BACKUP_MAGIC
+    uint32_t version;         // BACKUP_VERSION
+    uint32_t kind;            // BACKUP_FULL or BACKUP_DELTA
+    uint32_t sequence;        // 0 for backup.dat, n for backup.dat.n
+    uint32_t chainID;         // Taken from the base, so deltas of an older chain are ignored
+    uint32_t recordCount;     // Whole census (full) or added/changed patients (delta)
+    uint32_t dischargeCount;  // Patients discharged since the previous backup (delta only)
+    uint32_t recordSize;      // sizeof(PatientRecord)
+    uint32_t checksum;        // fileChecksum() of everything after the header (chunks: their headers)
+} BackupFileHeader;
+
+// Running checksum over one or more blocks of a file
+typedef struct {
+    uint64_t sum1;
+    uint64_t sum2;
+} ChecksumState;
+
+// A read-only view of a whole file (memory-mapped where possible)
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+// Structure to store doctor's name (schedule.dat and backups hold one per shift)
 typedef struct {
     char DoctorName[NAME_MAX_LENGTH];
 } DoctorSchedule;
 
+// Doctor registry: every distinct doctor name is interned once and known by its ID
+// (its position in doctors). ID 0 is NO_DOCTOR. The registry also keeps how many
+// shifts each doctor covers, updated whenever the roster changes.
+#define NO_DOCTOR 0
+
+typedef struct {
+    char name[NAME_MAX_LENGTH];
+    int shifts; // Shifts of the roster this doctor covers
+} DoctorEntry;
+
+typedef struct {
+    DoctorEntry *doctors;
+    int count;
+    int capacity;
+    int *slots;        // Hash of name -> doctor ID (open addressing), -1 marks an empty slot
+    int slotCapacity;
+} DoctorRegistry;
+
+// A word of the diagnosis word index with its posting list: the codes of the diagnoses it
+// appears in, ascending, each stored as a varint of its distance from the code before.
+// New codes are handed out in increasing order, so a new diagnosis almost always appends;
+// only a code reused from the free list is put in its place (see recodeDiagnosisPostings).
+typedef struct {
+    char *word;
+    unsigned char *postings;
+    int size;
+    int capacity;
+    int lastCode; // -1 before the first
+} DiagnosisTerm;
+
+// Diagnosis dictionary: every distinct diagnosis text is interned once and known by its code,
+// which the store keeps per patient so analytics count diagnoses as integers. Texts sit in
+// blocks that never move, so a code turns back into text without a lock; finding or adding
+// a code takes diagnosisLock.
+// The words of each text are indexed as it is added, so a word query finds the codes first
+// and then the patients with those codes (see findPatientsByDiagnosis).
+// Codes no patient has any more are collected with each snapshot and handed out again
+// (see sweepDiagnosisDictionary), so the dictionary follows the census rather than every
+// text ever admitted.
+typedef struct {
+    char (*blocks[DIAGNOSIS_MAX_BLOCKS])[DIAGNOSIS_MAX_LENGTH];
+    int count;         // Codes below count are in use or free
+    int *slots;        // Hash of text -> code (open addressing), -1 marks an empty slot
+    int slotCapacity;
+    int *freeCodes;    // Codes to hand out again, lowest last
+    int freeCount;
+    int freeCapacity;
+
+    DiagnosisTerm *terms;
+    int termCount;
+    int termCapacity;
+    int *termOrder;        // Terms sorted by word, for prefix words
+    int *termSlots;        // Hash of word -> term, -1 marks an empty slot
+    int termSlotCapacity;
+} DiagnosisDictionary;
+
+// Duty roster: any number of doctors per (date, shift, ward) slot, on any dates.
+// The assignments are the data; everything else is indexes kept in a page per week
+// (Sunday to Saturday) that has had assignments, found through a hash of the week, so
+// dates far apart cost a page each and nothing for the weeks between them:
+//   slotFirst     head of each slot's assignment list, a slot being (day, shift, ward)
+//   coveredWards  per (day, shift), a bit for each ward that has a doctor
+//   busy          per doctor, a bit for each (day, shift) of the week the doctor works
+// so who is on, whether a doctor is free and which wards are uncovered are direct lookups.
+typedef struct {
+    int day;
+    int shift;
+    int ward;
+    int doctorID;  // NO_DOCTOR marks a free entry
+    int next;      // Next assignment of the slot (or next free entry), -1 ends the list
+} RosterAssignment;
+
+typedef struct {
+    int week;         // weekStart() of its days
+    int slotFirst[DAYS_IN_WEEK * SHIFTS_IN_DAY * WARD_COUNT];
+    uint32_t coveredWards[DAYS_IN_WEEK * SHIFTS_IN_DAY];
+    uint32_t *busy;   // Per doctor ID below busyDoctors, bit (day of week * SHIFTS_IN_DAY + shift)
+    int busyDoctors;
+} RosterWeek;
+
+typedef struct {
+    RosterAssignment *assignments;
+    int count;        // Entries in use or on the free list
+    int capacity;
+    int freeEntry;    // First free entry, -1 if none
+    int liveCount;    // Assignments actually on the roster
+    RosterWeek *weeks;
+    int weekCount;
+    int weekCapacity;
+    int *weekSlots;   // Hash of week -> page in weeks, -1 marks an empty slot
+    int weekSlotCapacity;
+} Roster;
+
+// Auto-scheduler: fills wards 1 to wards, perShift doctors on every shift, over days
+// days from firstDay. A doctor works at most one shift a day and maxPerWeek shifts in a
+// week (Sunday to Saturday, counting shifts already on the roster). Weeks never share a
+// constraint, so each week is solved on its own, in parallel.
+typedef struct {
+    int firstDay;
+    int days;
+    int wards;
+    int perShift;
+    int maxPerWeek;
+} AutoScheduleRequest;
+
+typedef struct {
+    int day;
+    int shift;
+    int ward;
+    int doctor;  // Index into the solver's doctor list
+} AutoAssignment;
+
+// One week of the auto-scheduler, solved by one worker
+typedef struct {
+    const AutoScheduleRequest *request;
+    const int *doctorIDs;
+    int doctorCount;
+    const uint64_t *available;  // Per doctor, a bit per (day, shift) of the request they can work
+    int availableWords;
+    int firstDay;               // First and last day of this week inside the request
+    int lastDay;
+    AutoAssignment *picks;      // Filled by the worker
+    int pickCount;
+    int missing;                // Doctors still needed in this week after solving
+    int failed;                 // Out of memory
+} ScheduleWeekJob;
+
+// Weeks handed to one worker thread: jobs[first], jobs[first + step], ...
+typedef struct {
+    ScheduleWeekJob *jobs;
+    int count;
+    int first;
+    int step;
+} ScheduleWorker;
+
+#ifdef _WIN32
+typedef HANDLE WorkerThread;
+typedef SRWLOCK StoreLock;
+#define STORE_LOCK_INIT SRWLOCK_INIT
+#else
+typedef pthread_t WorkerThread;
+typedef pthread_rwlock_t StoreLock;
+#define STORE_LOCK_INIT PTHREAD_RWLOCK_INITIALIZER
+#endif
+
+// Counts kept while running commands (a batch file or one server connection)
+typedef struct {
+    int added;
+    int discharged;
+    int searched;
+    int found;
+    int assigned;
+} CommandTotals;
+
+// One client of the load test
+typedef struct {
+    const char *path;
+    int requests;
+    int seed;
+    int completed;
+} LoadTestClient;
+
+#ifdef HOSPITAL_BENCHMARK
+// One benchmarked operation, run count times. prepare(i, line) builds the i-th command
+// line outside the timing (NULL if there is none); only run(i, line) is timed.
+typedef struct {
+    const char *name;
+    int count;
+    void (*prepare)(int, char *);
+    void (*run)(int, char *);
+} BenchmarkStep;
+
+// Census size being benchmarked, and where command output goes (the null device)
+int benchmarkPatients = 0;
+FILE *benchmarkSink = NULL;
+CommandTotals benchmarkTotals;
+#endif
+
+// Pool of fixed-size blocks carved from slabs (see poolAlloc)
+// Freed blocks are chained through their first bytes and handed out again first.
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct {
+    size_t blockSize;  // At least sizeof(PoolBlock)
+    int blocksPerSlab;
+    unsigned char **slabs;
+    int slabCount;
+    int slabCapacity;
+    int carved;        // Blocks handed out from the newest slab so far
+    PoolBlock *freeList;
+} BlockPool;
+
+// Hash index on patientID (open addressing, linear probing)
+typedef struct {
+    int patientID;
+    int row; // Row in the store, -1 marks an empty slot
+} PatientIndexSlot;
+
+// Node of the name index: a trie over case-folded names
+// Children are kept as a sibling list sorted by character, so a walk visits names in order.
+typedef struct {
+    int firstChild;   // -1 if none
+    int nextSibling;  // -1 if none
+    int firstRow;     // First patient whose folded name ends here, -1 if none
+    unsigned char character;
+} NameTrieNode;
+
+// One room in the room index, with its occupants in a doubly linked list of rows
+typedef struct {
+    int roomNumber;
+    int occupants;
+    int firstRow; // -1 if empty
+} RoomEntry;
+
+// The patients of one store with one diagnosis code, in a doubly linked list of rows
+typedef struct {
+    int patients;
+    int firstRow; // -1 if none
+} DiagnosisList;
+
+// Ways to match a name
+enum { NAME_EXACT = 1, NAME_IGNORE_CASE = 2, NAME_PREFIX = 3 };
+
+// Sort orders for patient listings; every order but SORT_NONE has an ordered index (sortBy - 1)
+enum { SORT_NONE = 0, SORT_BY_ID = 1, SORT_BY_ROOM = 2, SORT_BY_NAME = 3, SORT_BY_AGE = 4, SORT_ORDERS = 4 };
+
+// Node of an ordered index: a skip list over the rows of one shard, sorted by key, then ID
+// A node stays where it is while its patient is on file; when a discharge moves a row,
+// only row changes. Towers are 1 to ORDER_LEVELS links high (each level a quarter as full).
+typedef struct OrderNode {
+    uint64_t key; // Packed key (see orderNodeKey), so most steps never touch the rows
+    int row;
+    int height;
+    struct OrderNode *prev;   // Row before in order, NULL for the first
+    struct OrderNode *next[]; // next[0] is the following row in order
+} OrderNode;
+
+// Contiguous patient store (struct of arrays)
+// Hot fields live in their own dense arrays so full-census scans stay in cache;
+// the names are kept apart, and each diagnosis is only its dictionary code.
+// Discharges swap the last row into the hole.
+typedef struct {
+    int *patientIDs;
+    int *ages;
+    int *roomNumbers;
+    char (*names)[NAME_MAX_LENGTH];
+    int *diagnosisCodes; // See DiagnosisDictionary
+    int count;
+    int capacity;
+    int diagnosisCache[DIAGNOSIS_CACHE_SLOTS]; // Code + 1 of a recent diagnosis by text hash, 0 if none
+
+    PatientIndexSlot *index;
+    int indexCapacity; // Always a power of two, at least twice count
+
+    // Name index: each row sits in a doubly linked list hanging off its trie node
+    NameTrieNode *nameNodes;
+    int nameNodeCount;
+    int nameNodeCapacity;
+    int nameNodeFree; // First released node, chained through nextSibling (0 = none, the root is never released)
+    int *nameNode;
+    int *nameNext;
+    int *namePrev;
+
+    // Room index: room number -> RoomEntry (hash of entry numbers, -1 marks an empty slot)
+    RoomEntry *rooms;
+    int roomCount;
+    int roomCapacity;
+    int *roomSlots;
+    int roomSlotCapacity; // Always a power of two, at least twice roomCount
+    int *roomNext;
+    int *roomPrev;
+
+    // Diagnosis lists: the rows with each diagnosis code in a doubly linked list
+    DiagnosisList *diagnosisLists; // By code
+    int diagnosisListCapacity;
+    int *diagnosisNext;
+    int *diagnosisPrev;
+
+    // Ordered indexes, built the first time a listing or range needs them and kept up to
+    // date from then on (see buildOrderIndexes). Bit sortBy - 1 of orderBuilt is set once built.
+    OrderNode *orderHeads[SORT_ORDERS][ORDER_LEVELS];
+    OrderNode **orderNodes[SORT_ORDERS]; // Node of each row
+    atomic_int orderBuilt;
+    uint32_t orderSeed;                  // Tower heights (xorshift)
+    BlockPool orderPools[ORDER_LEVELS];  // Nodes of each height, shared by the indexes
+} PatientStore;
+
+// Lock-free ID lookups. Readers never take a lock:
+//  - a seqlock (the shard's sequence, odd while it changes) tells a reader its copy of a
+//    row may be torn, and it simply reads again; the copy and the writes it may race go
+//    through relaxed atomics (see storeShared);
+//  - the arrays a lookup reads are published together as one StoreView, so a reader always
+//    sees a matching set of pointers and sizes;
+//  - arrays replaced by a resize are retired, not freed: each reader announces the epoch it
+//    entered in its ReaderSlot, and retired memory is only freed once every reader active
+//    when it was retired has left (epoch-based reclamation).
+typedef struct {
+    const PatientIndexSlot *index;
+    int indexCapacity;
+    const int *patientIDs;
+    const int *ages;
+    const int *roomNumbers;
+    const char (*names)[NAME_MAX_LENGTH];
+    const int *diagnosisCodes;
+    int capacity;
+} StoreView;
+
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t epoch; // Epoch the reader entered in, 0 when outside
+    atomic_int taken;                        // Slot owned by a thread
+} ReaderSlot;
+
+typedef struct {
+    void *memory;
+    BlockPool *pool; // Pool it goes back to, NULL for malloc'd memory
+    uint64_t epoch;  // Epoch it was retired in
+} RetiredMemory;
+
+// The census is split into STORE_SHARDS shards by patient ID hash. Each shard is a whole
+// PatientStore (its own index, name trie, room hash and arrays) with its own lock and
+// lookup view, so changes to patients in different shards run side by side.
+// Lock order: storeLock, then shard locks in shard order, then logLock / retireLock / diagnosisLock.
+typedef struct {
+    _Alignas(64) PatientStore patients;
+    StoreLock lock;            // Shared for reads, alone for changes (taken inside storeLock)
+    StoreLock orderLock;       // Taken alone (inside lock) by a reader building an ordered index
+    _Atomic(StoreView *) view; // See StoreView
+    atomic_uint sequence;
+} StoreShard;
+
+// A patient's place in the sharded census
+typedef struct {
+    int shard;
+    int row;
+} PatientRef;
+
+// One end of a range over an ordered index; names match by folded prefix, so a range
+// up to "Sm" takes in "Smith"
+typedef struct {
+    int open;         // No bound at this end
+    int value;        // ID, age or room number
+    const char *name; // For SORT_BY_NAME
+} OrderBound;
+
+// Walks the census in index order, merging the shards (see startOrderCursor)
+typedef struct {
+    const OrderNode *next[STORE_SHARDS]; // Next node of each shard, NULL past its end
+    int sortBy;
+    OrderBound to;
+} OrderCursor;
+
+// Building one ordered index in every shard that lacks it (see buildOrderIndexes)
+typedef struct {
+    int sortBy;
+    int failed;
+} OrderBuildJob;
+
+// Census analytics for the patients in an age range (see analyzeCensus)
+typedef struct {
+    int matched;
+    int decades[ANALYTICS_DECADES]; // 0-9, 10-19, ..., 120 and over
+    int *rooms;                     // Per room, FIRST_ROOM_NUMBER first
+    int otherRooms;                 // Patients in rooms outside FIRST_ROOM_NUMBER..LAST_ROOM_NUMBER
+    int *diagnoses;                 // Per diagnosis code
+    int diagnosisCount;
+} CensusStats;
+
+// Filters a block of ages to [minAge, maxAge]: sets bit i % 8 of passed[i / 8] for every
+// row kept, adds them to decades and returns how many were kept
+typedef int (*AgeFilter)(const int *, int, int, int, unsigned char *, int *);
+
+typedef struct {
+    int minAge;
+    int maxAge;
+    AgeFilter filter;
+    CensusStats parts[STORE_SHARDS]; // One per runParallel part
+} AnalyticsJob;
+
+// A census-wide job split into parts for worker threads (see runParallel)
+typedef struct {
+    void (*run)(int, int, void *); // run(part, parts, context)
+    void *context;
+    int part;
+    int parts;
+} ParallelPart;
+
+// Parallel jobs over the shards: loading a patients file, decoding census chunks from a file
+typedef struct {
+    const CensusRecord *records;
+    uint32_t count;
+    int failed;
+} LoadJob;
+
+typedef struct {
+    const unsigned char *data;  // The chunks as laid out in the file
+    const size_t *offsets;      // Of each chunk header in data
+    int chunks;
+    const int *codes;           // Dictionary code of each place in the diagnosis table, NULL if none
+    uint32_t codeCount;
+    CensusRecord *records;      // Decoded census, CENSUS_CHUNK_RECORDS per chunk
+    int failed;
+} DecodeJob;
+
+// One round of a chunked census write: up to CENSUS_ROUND_CHUNKS chunks, encoded in
+// parallel while a writer thread writes out the round before
+typedef struct {
+    const int *ids;    // Patients to write, or NULL for the whole census in row order
+    const int *places; // Place in the diagnosis table of each dictionary code
+    int total;         // Records in the whole run of chunks
+    int firstChunk;
+    int chunks;
+    unsigned char *data[CENSUS_ROUND_CHUNKS];
+    CensusChunkHeader headers[CENSUS_ROUND_CHUNKS];
+    FILE *file;
+} CensusRound;
+
 // Global variables
-// Changed(by Jun): Changed to Linked List
-Patient *head = NULL; // Head of the list
-int patientCount = 0; // Current patients number
+StoreShard shards[STORE_SHARDS];
+DiagnosisDictionary diagnosisDictionary = {0};
+
+// Doctors and their duty roster
+DoctorRegistry doctorRegistry = {0};
+Roster roster = {.freeEntry = -1};
+
+// Write-ahead journal of changes made since the last snapshot (patients.dat + schedule.dat)
+FILE *journalFile = NULL;
+int journalEntries = 0;
+int snapshotPatients = 0; // Census size when the journal was last emptied
+
+// IDs added or discharged since the last backup, mirrored in backup.pending
+// so the next incremental backup knows what to write. NULL file: next backup is full.
+FILE *backupPendingFile = NULL;
+int *backupChanges = NULL;
+int backupChangeCount = 0;
+int backupChangeCapacity = 0;
+
+// discharges.dat is an append-only history of discharged patients: ARCHIVE_MAGIC (8 bytes),
+// then one variable-length record per discharge:
+//   varint time delta (seconds), zigzag varint ID, varint age, zigzag varint room,
+//   varint name length + name bytes, varint diagnosis length + diagnosis bytes.
+// Records come in blocks of ARCHIVE_BLOCK_RECORDS; the first record of a block stores its
+// absolute time, the rest the delta from the record before. discharges.idx holds one
+// ArchiveIndexEntry per block, so a time range can be found by binary search. Times never
+// go backwards, and the index can always be rebuilt by scanning the archive.
+typedef struct {
+    int64_t firstTime;  // Discharge time of the block's first record
+    uint64_t offset;    // Where the block starts in discharges.dat
+} ArchiveIndexEntry;
+
+// One decoded archive record
+typedef struct {
+    int64_t dischargeTime;
+    Patient patient;
+} ArchiveRecord;
+
+// Operations timed by the metrics (a latency histogram each) and the counters kept beside them.
+// Building with -DHOSPITAL_NO_METRICS leaves all of it out.
+enum {
+    METRIC_LOAD, METRIC_SAVE, METRIC_SNAPSHOT, METRIC_BACKUP, METRIC_RESTORE, METRIC_ADD, METRIC_DISCHARGE,
+    METRIC_SEARCH_ID, METRIC_SEARCH_NAME, METRIC_SEARCH_ROOM, METRIC_SEARCH_RANGE, METRIC_SEARCH_DIAGNOSIS,
+    METRIC_VIEW, METRIC_ANALYTICS, METRIC_COMMAND, METRIC_OPERATIONS
+};
+enum {
+    METRIC_BYTES_READ, METRIC_BYTES_WRITTEN, METRIC_FSYNCS, METRIC_INDEX_PROBES, METRIC_ROWS_VISITED,
+    METRIC_COMMAND_ERRORS, METRIC_JOURNAL_ERRORS, METRIC_COUNTERS
+};
+
+#ifndef HOSPITAL_NO_METRICS
+// One stripe of the metrics. Each thread adds to its own stripe, so threads doing
+// lookups side by side do not fight over the same cache lines.
+typedef struct {
+    _Alignas(64) atomic_ullong counters[METRIC_COUNTERS];
+    atomic_ullong buckets[METRIC_OPERATIONS][METRICS_BUCKETS]; // Up to 2^i microseconds, the last one unbounded
+    atomic_ullong nanoseconds[METRIC_OPERATIONS];              // Total time per operation
+} MetricsStripe;
+#endif
 
-// 2D array for doctor's schedules
-DoctorSchedule schedule[DAYS_IN_WEEK][SHIFTS_IN_DAY];
+// Big reusable buffer for bulk output; rows are formatted here and written in large chunks
+typedef struct {
+    FILE *stream;
+    int length;
+    char data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+// Discharge archive being appended to
+FILE *archiveFile = NULL;
+FILE *archiveIndexFile = NULL;
+int64_t archiveLastTime = 0;
+int archiveBlockRecords = 0; // Records in the newest block (ARCHIVE_BLOCK_RECORDS means start a new one)
+
+// Guards everything commands touch when they run on several threads: roster and doctor
+// changes and whole-census work (snapshots) take it alone, everything else shares it and
+// then takes the shard locks it needs (see StoreShard).
+StoreLock storeLock; // Set up by initStoreLocks
+
+// Guards the journal, the backup change list and the archive, which every shard writes to
+StoreLock logLock = STORE_LOCK_INIT;
+StoreLock diagnosisLock = STORE_LOCK_INIT; // Guards finding and adding diagnosis codes
+atomic_int journalCompactDue = 0; // Set by journalAppend, see compactJournalIfDue
+int journalCompactHeld = 0;       // Set while the benchmark times commands: runCommand leaves a due snapshot to it
+
+// Lock-free lookup state (see StoreView)
+atomic_uint_fast64_t globalEpoch = 1;
+ReaderSlot readerSlots[MAX_READERS];
+_Thread_local int readerSlot = -1;
+StoreLock retireLock = STORE_LOCK_INIT; // Guards the retired list
+RetiredMemory *retiredMemory = NULL;
+int retiredCount = 0;
+int retiredCapacity = 0;
+BlockPool viewPool = {.blockSize = sizeof(StoreView), .blocksPerSlab = 64}; // Guarded by retireLock
+
+// Store and order that buildOrderIndex is sorting rows for (qsort passes no context)
+_Thread_local const PatientStore *orderSortStore = NULL;
+_Thread_local int orderSortBy = SORT_NONE;
+
+// Set by SIGINT/SIGTERM to stop the server; atomic because client threads read it too
+atomic_int serverStopping = 0;
+
+// Set while a batch file runs: journal entries are flushed once at the end, not per entry
+int batchMode = 0;
+
+#ifndef HOSPITAL_NO_METRICS
+// Metrics, summed over the stripes when they are written out
+MetricsStripe metricsStripes[METRICS_STRIPES];
+atomic_int metricsNextStripe = 0;
+_Thread_local int metricsStripe = -1;
+_Atomic(int64_t) metricsLastDump = 0; // time() of the last metrics.prom
+#endif
 
 // Function prototypes
 void displayMenu();
@@ -52,17 +795,307 @@ void searchForPatient();
 void dischargePatient();
 void manageDoctorSchedule();
 void generateReports();
+void printReport(int);
 void saveDataToFile();
 void loadDataFromFile();
 void backupData();
 void restoreData();
 void freeAllPatients();
+int filterAgesScalar(const int *, int, int, int, unsigned char *, int *);
+#ifdef ANALYTICS_TARGET
+int filterAgesSSE2(const int *, int, int, int, unsigned char *, int *);
+int filterAgesAVX2(const int *, int, int, int, unsigned char *, int *);
+#endif
+AgeFilter pickAgeFilter(const char **);
+void analyzeCensusPart(int, int, void *);
+int analyzeCensus(int, int, CensusStats *);
+void freeCensusStats(CensusStats *);
+int topCounts(const int *, int, int *, int);
+void printCensusAnalytics();
 int validatePatientID(int);
 int validatePatientAge(struct PatientInformation *);
+void freePatientStore(PatientStore *);
+void initStoreLocks();
+int shardOf(int);
+PatientStore *shardStore(int);
+int patientCount();
+size_t encodeCensusChunk(const int *, const int *, int, int, unsigned char *);
+int decodeCensusChunk(const CensusChunkHeader *, const unsigned char *, const int *, uint32_t, CensusRecord *);
+unsigned char *encodeDiagnosisTable(const int *, int, int **, CensusChunkHeader *);
+int decodeDiagnosisTable(const CensusChunkHeader *, const unsigned char *, int **);
+void encodeRoundPart(int, int, void *);
+void *writeRound(void *);
+int writeCensusChunks(FILE *, const int *, int, ChecksumState *);
+void decodeChunkPart(int, int, void *);
+int loadCensusChunks(const unsigned char *, size_t, uint32_t, uint32_t, int);
+void loadShardPart(int, int, void *);
+void compactJournalIfDue();
+int findPatientRow(PatientStore *, int);
+int insertPatient(PatientStore *, const Patient *);
+int insertCensusRecord(PatientStore *, const CensusRecord *);
+int removePatient(PatientStore *, int);
+void getPatient(const PatientStore *, int, Patient *);
+void linkNameRow(PatientStore *, int, int);
+void unlinkNameRow(PatientStore *, int);
+int findNameNode(PatientStore *, const char *, int);
+void releaseNameNodes(PatientStore *, const char *);
+int findPatientsByName(PatientStore *, const char *, int, int **);
+int compareFoldedNames(const char *, const char *);
+int findPatientsInShards(const char *, int, PatientRef **);
+int growArray(void **, int *, int, size_t);
+unsigned int hashDoctorName(const char *);
+int findDoctor(const char *, int);
+const char *doctorName(int);
+int findDiagnosis(const char *, int);
+int internDiagnosis(PatientStore *, const char *);
+int internDiagnosisText(const char *);
+void sweepDiagnosisDictionary();
+const char *diagnosisText(int);
+void freeDiagnosisDictionary();
+int isDiagnosisWordChar(unsigned char);
+int nextDiagnosisWord(const char **, char *);
+int findDiagnosisTerm(const char *, int);
+int indexDiagnosisWords(int, const char *);
+unsigned int readPostingDelta(const unsigned char *, int *);
+void writePostingDelta(unsigned char *, int *, unsigned int);
+int recodeDiagnosisPostings(DiagnosisTerm *, const uint64_t *, int);
+void markDiagnosisTerm(const DiagnosisTerm *, uint64_t *);
+void matchDiagnosisWord(const char *, int, uint64_t *);
+int reserveDiagnosisLists(PatientStore *, int);
+void linkDiagnosisRow(PatientStore *, int, int);
+void unlinkDiagnosisRow(PatientStore *, int);
+int comparePatientRefIDs(const void *, const void *);
+int findPatientsByDiagnosis(const char *, PatientRef **);
+int daysFromDate(int, int, int);
+void dateFromDays(int, char *, size_t);
+int parseDay(const char *, int *);
+int weekStart(int);
+void localTime(time_t, struct tm *);
+void currentDayAndShift(int *, int *);
+RosterWeek *findRosterWeek(int, int);
+int validRosterDay(int);
+int rosterAdd(int, int, int, int);
+int rosterRemove(int, int, int, int);
+int rosterSlotFirst(int, int, int);
+uint32_t rosterCoverage(int, int);
+int rosterDoctorBusy(int, int, int);
+void clearRoster();
+void freeRoster();
+int rosterToRecords(RosterRecord **);
+void loadRosterRecords(const RosterRecord *, int);
+int weeklyToRoster(DoctorSchedule (*)[SHIFTS_IN_DAY], RosterRecord **);
+int scheduleDoctor(int, int, int, const char *);
+int unscheduleDoctor(int, int, int, const char *);
+void printRosterWeek(int);
+void printOnDutyNow();
+void printCoverageGaps(int, int);
+int readRosterDay(const char *, int, int *);
+int workerCount();
+int startWorker(WorkerThread *, void *(*)(void *), void *);
+void joinWorker(WorkerThread);
+void *runParallelPart(void *);
+void runParallel(void (*)(int, int, void *), void *, int, int);
+int readAvailability(const char *, const AutoScheduleRequest *, int **, uint64_t **, int *, FILE *);
+int autoScheduleRoster(const AutoScheduleRequest *, const char *, int *, int *, FILE *);
+void solveScheduleWeek(ScheduleWeekJob *);
+void *solveScheduleWeeks(void *);
+void autoScheduleMenu(int);
+int readRosterSlot(int, int *, int *, int *);
+int readScheduleFile();
+int writeScheduleFile(const char *);
+int findRoomEntry(PatientStore *, int, int);
+void linkRoomRow(PatientStore *, int, int);
+void unlinkRoomRow(PatientStore *, int);
+int compareOrderRows(const PatientStore *, int, const PatientStore *, int, int);
+uint64_t orderNodeKey(const PatientStore *, int, int);
+int compareOrderNodes(const PatientStore *, const OrderNode *, const PatientStore *, const OrderNode *, int);
+int compareOrderBound(const PatientStore *, int, int, const OrderBound *);
+int compareOrderSortRows(const void *, const void *);
+int randomOrderHeight(PatientStore *);
+OrderNode *newOrderNode(PatientStore *, int);
+void linkOrderNode(PatientStore *, int, OrderNode *);
+void unlinkOrderNode(PatientStore *, int, OrderNode *);
+void clearOrderIndex(PatientStore *, int);
+int buildOrderIndex(PatientStore *, int);
+void buildOrderPart(int, int, void *);
+int buildOrderIndexes(int);
+int startOrderCursor(OrderCursor *, int, const OrderBound *, const OrderBound *);
+int nextOrderRow(OrderCursor *, PatientRef *);
+int findPatientsInRange(int, const OrderBound *, const OrderBound *, PatientRef **);
+int parseOrderBound(int, const char *, OrderBound *);
+void showRoomOccupants(int);
+void printRoomUsageReport();
+void clearPatientStore(PatientStore *);
+int reservePatientStore(PatientStore *, int);
+int mapFile(const char *, MappedFile *);
+void unmapFile(MappedFile *);
+void checksumUpdate(ChecksumState *, const void *, size_t);
+uint32_t checksumFinish(const ChecksumState *);
+uint32_t fileChecksum(const void *, size_t);
+int writePatientFile(const char *);
+int readPatientFile(const char *);
+void patientToRecord(const PatientStore *, int, PatientRecord *);
+void recordToPatient(const PatientRecord *, Patient *);
+int recordToCensus(const PatientRecord *, CensusRecord *);
+int replaceFile(const char *, const char *);
+int writeSnapshot();
+int replayJournal();
+void openJournal();
+void closeJournal();
+void compactJournal();
+int journalAppend(uint32_t, const void *, uint32_t);
+int journalAddPatient(const Patient *);
+int journalDischarge(int);
+int journalRoster(uint32_t, int, int, int, const char *);
+int admitPatient(const Patient *);
+int dischargePatientByID(int);
+void beginStoreChange(StoreShard *);
+void endStoreChange(StoreShard *);
+void storeShared(int *, int);
+int loadShared(const int *);
+void copyShared(char *, const char *, size_t);
+void publishStoreView(StoreShard *);
+void retireMemory(void *);
+void retireBlock(BlockPool *, void *);
+void *poolAlloc(BlockPool *);
+void poolFree(BlockPool *, void *);
+void poolDestroy(BlockPool *);
+void reclaimMemory(int);
+int enterReader();
+void exitReader(int);
+void releaseReaderSlot();
+int lookupPatient(int, Patient *);
+int compareInts(const void *, const void *);
+int syncFile(FILE *);
+void backupPath(int, char *, size_t);
+int readBackupHeader(int, BackupFileHeader *);
+int readBackupBlock(FILE *, void *, size_t, ChecksumState *);
+int writeBackupFile(int, uint32_t, uint32_t, const int *, int, int);
+int loadBackupFile(int, uint32_t, PatientStore *, RosterRecord **, int *);
+void openBackupPending();
+void resetBackupPending();
+void noteBackupChange(int);
+void renderPatients(FILE *, int, int, int);
+void outputFlush(OutputBuffer *);
+void outputText(OutputBuffer *, const char *, int);
+void outputInt(OutputBuffer *, int, int);
+int parseSortOrder(const char *);
+void closeDataFiles();
+int truncateFile(FILE *, long);
+size_t putVarint(unsigned char *, uint64_t);
+int getVarint(const unsigned char **, const unsigned char *, uint64_t *);
+int decodeArchiveRecord(const unsigned char **, const unsigned char *, int64_t, ArchiveRecord *);
+void openArchive();
+void archiveDischarge(const Patient *);
+void printDischargeReport();
+void printDischargesBetween(time_t, time_t);
+int parseDate(const char *, int, time_t *);
+int runBatch(FILE *);
+int splitBatchLine(char *, char **, int);
+void printBatchRow(FILE *, const PatientStore *, int);
+int runCommand(char *, FILE *, CommandTotals *);
+void acquireLock(StoreLock *, int);
+void releaseLock(StoreLock *, int);
+void lockStore(int);
+void unlockStore(int);
+void lockShards(int);
+void unlockShards(int);
+int runServer(const char *);
+int runLoadTest(const char *, int, int);
+#ifndef _WIN32
+void stopServer(int);
+int sendAll(int, const char *, size_t);
+void *serveClient(void *);
+void *runLoadTestClient(void *);
+#endif
+int parseBatchInt(const char *, int *);
+void copyBatchText(char *, const char *, size_t);
+uint64_t monotonicNanoseconds();
+uint64_t metricsStart();
+void metricsObserve(int, uint64_t);
+void metricsCount(int, uint64_t);
+void writeMetrics(FILE *);
+int writeMetricsFile();
+void dumpMetricsIfDue();
+#ifdef HOSPITAL_BENCHMARK
+int checkAgeFilters();
+int runBenchmark(const char *);
+void runBenchmarkSize(FILE *, int, double *);
+void runBenchmarkStep(FILE *, const BenchmarkStep *, double *);
+void clearBenchmarkFiles();
+int compareDoubles(const void *, const void *);
+int benchmarkPatientID(int);
+int benchmarkPick(int, int);
+void prepareBenchmarkAdd(int, char *);
+void prepareBenchmarkSearchID(int, char *);
+void prepareBenchmarkSearchName(int, char *);
+void prepareBenchmarkDischarge(int, char *);
+void prepareBenchmarkView(int, char *);
+void prepareBenchmarkSortedView(int, char *);
+void prepareBenchmarkRange(int, char *);
+void prepareBenchmarkStats(int, char *);
+void prepareBenchmarkSearchDiagnosis(int, char *);
+void prepareBenchmarkBackup(int, char *);
+void runBenchmarkCommand(int, char *);
+void runBenchmarkTotalReport(int, char *);
+void runBenchmarkDischargeReport(int, char *);
+void runBenchmarkShiftsReport(int, char *);
+void runBenchmarkRoomsReport(int, char *);
+void runBenchmarkSave(int, char *);
+void runBenchmarkLoad(int, char *);
+void runBenchmarkBackup(int, char *);
+void runBenchmarkRestore(int, char *);
+#endif
+
+int main(int argc, char *argv[]) {
+    // hospital --load-test <socket> <clients> <requests>: measure a running server (no data files needed)
+    if (argc == 5 && strcmp(argv[1], "--load-test") == 0) {
+        return runLoadTest(argv[2], atoi(argv[3]), atoi(argv[4]));
+    }
+
+#ifdef HOSPITAL_BENCHMARK
+    // hospital --benchmark [sizes]: time the core operations on generated censuses (own scratch directory)
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+        initStoreLocks();
+        return runBenchmark(argc > 2 ? argv[2] : BENCHMARK_SIZES);
+    }
+#endif
 
-int main() {
     // Load data from file if available
+    initStoreLocks();
     loadDataFromFile();
+    openJournal();
+    openBackupPending();
+    openArchive();
+
+    // hospital --batch [file]: run a command file (or stdin) with no prompts
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        FILE *input = stdin;
+        if (argc > 2 && strcmp(argv[2], "-") != 0) {
+            input = fopen(argv[2], "r");
+            if (input == NULL) {
+                printf("Error: cannot open batch file %s.\n", argv[2]);
+                return 1;
+            }
+        }
+        int errors = runBatch(input);
+        if (input != stdin) {
+            fclose(input);
+        }
+        closeDataFiles();
+        writeMetricsFile();
+        freeAllPatients();
+        return errors > 0;
+    }
+
+    // hospital --serve <socket>: take commands from many terminals at once
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0) {
+        int failed = runServer(argv[2]);
+        closeDataFiles();
+        writeMetricsFile();
+        return failed;
+    }
+
     displayMenu();
     return 0;
 }
@@ -83,8 +1116,15 @@ void displayMenu() {
         printf("6. Save and Exit\n");
         printf("7. Backup Data\n");
         printf("8. Restore Data\n");
+        printf("9. Generate Reports\n");
+        printf("10. Show Metrics\n");
 
-        scanf("%d", &userChoice);
+        if (scanf("%d", &userChoice) == EOF) {
+            // Input ended (e.g. piped keystrokes); every change is already in the journal
+            closeDataFiles();
+            writeMetricsFile();
+            return;
+        }
         // Consume newline left by scanf
         getchar();
 
@@ -112,202 +1152,307 @@ void displayMenu() {
             case 6:
                 saveDataToFile();
                 printf("Data saved successfully.\n");
+                closeDataFiles();
+                writeMetricsFile();
                 freeAllPatients(); // Free memory before exiting
                 exit(0);
 
-            case 7:
+            case 7: {
+                uint64_t started = metricsStart();
                 backupData();
+                metricsObserve(METRIC_BACKUP, started);
                 break;
+            }
 
             case 8:
                 restoreData();
                 break;
 
+            case 9:
+                generateReports();
+                break;
+
+            case 10:
+                writeMetrics(stdout);
+                printf("\n");
+                break;
+
             default:
                 printf("Invalid choice. Please try again.\n");
         }
+        compactJournalIfDue();
+        dumpMetricsIfDue();
     } while (userChoice != 6);
 }
 
 // Function to save patient data and doctor schedule to files
+// Writes a fresh snapshot, which also empties the journal.
 void saveDataToFile() {
-    FILE *patientFile = fopen(PATIENT_FILE, "wb");
-    if (patientFile == NULL) {
+    uint64_t started = metricsStart();
+    if (writeSnapshot() != 0) {
         printf("Error saving patient data.\n");
-        return;
-    }
-
-    // Linked List
-    fwrite(&patientCount, sizeof(int), 1, patientFile);
-
-    Patient *current = head;
-    while (current) {
-        fwrite(current, sizeof(Patient), 1, patientFile);
-        current = current->next;
+    } else {
+        compactJournal();
     }
-
-    fclose(patientFile);
+    metricsObserve(METRIC_SAVE, started);
 }
 
 // Function to load patient data and doctor schedule from files
+// The journal is replayed on top of the snapshot to recover unsaved changes.
 void loadDataFromFile() {
-    FILE *patientFile = fopen(PATIENT_FILE, "rb");
-    if (patientFile != NULL) {
-        fread(&patientCount, sizeof(int), 1, patientFile);
-        for (int i = 0; i < patientCount; i++) {
-            Patient *p = malloc(sizeof(Patient));
-            fread(p, sizeof(Patient), 1, patientFile);
-            p->next = head;
-            head = p;
+    uint64_t started = metricsStart();
+    if (readPatientFile(PATIENT_FILE) != 0) {
+        printf("Error: %s is damaged, starting with no patients.\n", PATIENT_FILE);
+        for (int s = 0; s < STORE_SHARDS; s++) {
+            clearPatientStore(&shards[s].patients);
         }
-        fclose(patientFile);
     }
 
-    FILE *scheduleFile = fopen(SCHEDULE_FILE, "rb");
-    if (scheduleFile != NULL) {
-        fread(schedule, sizeof(DoctorSchedule), DAYS_IN_WEEK * SHIFTS_IN_DAY, scheduleFile);
-        fclose(scheduleFile);
+    if (readScheduleFile() != 0) {
+        printf("Error: %s is damaged, starting with an empty roster.\n", SCHEDULE_FILE);
+        clearRoster();
+    }
+
+    if (replayJournal() != 0) {
+        // Torn tail from a crash mid-write: keep what replayed and start a clean journal
+        printf("Warning: %s ended with an incomplete entry, it was ignored.\n", JOURNAL_FILE);
+        if (writeSnapshot() == 0) {
+            remove(JOURNAL_FILE);
+        }
+    }
+    snapshotPatients = patientCount();
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        publishStoreView(&shards[s]);
     }
+    metricsObserve(METRIC_LOAD, started);
 }
 
 // Function to back up the data
+// Writes an incremental backup with only the patients changed since the last one,
+// or a full backup when there is no chain to extend (or the chain is long enough).
 void backupData() {
-    FILE *backupFile = fopen(BACKUP_FILE, "wb");
-    if (backupFile == NULL) {
-        printf("Error creating backup file.\n");
+    BackupFileHeader base;
+    int deltas = 0;
+    int full = backupPendingFile == NULL || readBackupHeader(0, &base) != 0 || base.kind != BACKUP_FULL ||
+               base.version != BACKUP_VERSION;
+    if (!full) {
+        BackupFileHeader delta;
+        while (readBackupHeader(deltas + 1, &delta) == 0 && delta.chainID == base.chainID) {
+            deltas++;
+        }
+        full = deltas >= BACKUP_MAX_DELTAS || backupChangeCount * 2 > patientCount();
+    }
+
+    if (full) {
+        uint32_t chainID = (uint32_t)time(NULL);
+        if (readBackupHeader(0, &base) == 0 && base.chainID == chainID) {
+            chainID++; // Never reuse the chain ID of the backup being replaced
+        }
+        if (writeBackupFile(0, BACKUP_FULL, chainID, NULL, 0, 0) != 0) {
+            printf("Error creating backup file.\n");
+            return;
+        }
+        resetBackupPending();
+        printf("Data backup successful (full backup, %d patients).\n", patientCount());
         return;
     }
 
-    fwrite(&patientCount, sizeof(int), 1, backupFile);
-    Patient *p = head;
-    while (p) {
-        fwrite(p, sizeof(Patient), 1, backupFile);
-        p = p->next;
+    // Sort the changed IDs so each one is written once
+    int changes = backupChangeCount;
+    int *ids = malloc((size_t)(changes ? changes : 1) * sizeof(int));
+    if (ids == NULL) {
+        printf("Error creating backup file.\n");
+        return;
+    }
+    memcpy(ids, backupChanges, (size_t)changes * sizeof(int));
+    qsort(ids, (size_t)changes, sizeof(int), compareInts);
+    int unique = 0;
+    for (int i = 0; i < changes; i++) {
+        if (unique == 0 || ids[unique - 1] != ids[i]) {
+            ids[unique++] = ids[i];
+        }
     }
 
-    fwrite(schedule, sizeof(DoctorSchedule), DAYS_IN_WEEK * SHIFTS_IN_DAY, backupFile);
-    fclose(backupFile);
+    // Patients still on file are written in full, the rest as discharged IDs
+    int kept = 0;
+    for (int i = 0; i < unique; i++) {
+        if (findPatientRow(shardStore(ids[i]), ids[i]) >= 0) {
+            int id = ids[i];
+            ids[i] = ids[kept];
+            ids[kept++] = id;
+        }
+    }
 
-    printf("Data backup successful.\n");
+    int result = writeBackupFile(deltas + 1, BACKUP_DELTA, base.chainID, ids, kept, unique - kept);
+    free(ids);
+    if (result != 0) {
+        printf("Error creating backup file.\n");
+        return;
+    }
+    resetBackupPending();
+    printf("Data backup successful (incremental backup #%d, %d changes).\n", deltas + 1, unique);
 }
 
 // Function to restore data from backup
+// Any point of the chain can be rebuilt: the full backup plus the first n incremental ones.
 void restoreData() {
-    FILE *backupFile = fopen(BACKUP_FILE, "rb");
-    if (backupFile == NULL) {
+    BackupFileHeader base;
+    if (readBackupHeader(0, &base) != 0) {
         printf("Error: No backup file found.\n");
         return;
     }
 
-    freeAllPatients(); // clears all the records that added after the user's back up.
+    int deltas = 0;
+    BackupFileHeader delta;
+    while (base.kind == BACKUP_FULL && readBackupHeader(deltas + 1, &delta) == 0 && delta.chainID == base.chainID) {
+        deltas++;
+    }
+
+    int point = 0;
+    if (deltas > 0) {
+        printf("Backups available: 0 = full backup, 1 to %d = incremental backups.\n", deltas);
+        printf("Restore up to which backup? ");
+        scanf("%d", &point);
+        getchar();
+        if (point < 0 || point > deltas) {
+            printf("Error: Backup number out of range.\n\n");
+            return;
+        }
+    }
+
+    // Rebuild into separate shards; the live census is only replaced once every file checked out
+    uint64_t started = metricsStart();
+    PatientStore restored[STORE_SHARDS] = {0};
+    RosterRecord *restoredRoster = NULL;
+    int restoredRosterCount = 0;
+    for (int sequence = 0; sequence <= point; sequence++) {
+        if (loadBackupFile(sequence, base.chainID, restored, &restoredRoster, &restoredRosterCount) != 0) {
+            printf("Error: backup #%d is damaged or incomplete, nothing was restored.\n\n", sequence);
+            for (int s = 0; s < STORE_SHARDS; s++) {
+                freePatientStore(&restored[s]);
+            }
+            free(restoredRoster);
+            return;
+        }
+    }
+
+    // clears all the records that added after the user's back up.
+    // The arrays lock-free lookups read are retired, not freed (see StoreView).
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        PatientStore *patients = &shards[s].patients;
+        beginStoreChange(&shards[s]);
+        retireMemory(patients->index);
+        retireMemory(patients->patientIDs);
+        retireMemory(patients->ages);
+        retireMemory(patients->roomNumbers);
+        retireMemory(patients->names);
+        retireMemory(patients->diagnosisCodes);
+        patients->index = NULL;
+        patients->patientIDs = patients->ages = patients->roomNumbers = patients->diagnosisCodes = NULL;
+        patients->names = NULL;
+        freePatientStore(patients);
+        *patients = restored[s];
+        endStoreChange(&shards[s]);
+    }
+    loadRosterRecords(restoredRoster, restoredRosterCount);
+    free(restoredRoster);
+
+    // The restored census replaces everything, so make it the new snapshot
+    if (writeSnapshot() == 0) {
+        compactJournal();
+    }
 
-    fread(&patientCount, sizeof(int), 1, backupFile);
-    for (int i = 0; i < patientCount; i++) {
-        Patient *p = malloc(sizeof(Patient));
-        fread(p, sizeof(Patient), 1, backupFile);
-        p->next = head;
-        head = p;
+    // Only the newest point of a current-format chain can be extended with incremental backups
+    if (point == deltas && base.version == BACKUP_VERSION) {
+        resetBackupPending();
+    } else {
+        if (backupPendingFile != NULL) {
+            fclose(backupPendingFile);
+            backupPendingFile = NULL;
+        }
+        remove(BACKUP_PENDING_FILE);
+        backupChangeCount = 0;
     }
-    fclose(backupFile);
 
+    metricsObserve(METRIC_RESTORE, started);
     printf("Data restored from backup.\n");
 }
 
 // 1. Add a New Patient
 void addNewPatient() {
-  Patient *newPatient = (Patient *)malloc(sizeof(Patient)); // Changed(by Jun): Adding patient using Linked List
-//    if (currentPatientCount >= patientCapacity) {
-//        // If the system is full, reallocate more memory
-//        reallocatePatientMemory();
-//        printf("Memory reallocated. New patient capacity is %d.\n", patientCapacity);
-//    }
-  if (!newPatient) {
-    printf("Memory allocation failed!\n");
-    return;
-  }
-
-  // Get patient details
-  printf("Enter Patient ID: ");
-  scanf("%d", &newPatient->patientID);
-  getchar(); // Consume newline after entering the ID
+    Patient newPatient = {0};
+
+    // Get patient details
+    printf("Enter Patient ID: ");
+    scanf("%d", &newPatient.patientID);
+    getchar(); // Consume newline after entering the ID
 
     // Validate the patient's ID
-    if (validatePatientID(newPatient -> patientID) == 1) {
+    if (validatePatientID(newPatient.patientID) == 1) {
         return;
     }
 
     // Get patient's name
     printf("Enter Patient Name: ");
-    fgets(newPatient-> name, NAME_MAX_LENGTH, stdin);
-    newPatient -> name[strcspn(newPatient -> name, "\n")] = 0;
+    fgets(newPatient.name, NAME_MAX_LENGTH, stdin);
+    newPatient.name[strcspn(newPatient.name, "\n")] = 0;
 
     // Get patient's age
     printf("Enter Patient Age: ");
-    scanf("%d", &newPatient -> age);
+    scanf("%d", &newPatient.age);
     getchar(); // Consume newline
 
     // Validate the patient's age
-    if (validatePatientAge(newPatient) == 1) {
+    if (validatePatientAge(&newPatient) == 1) {
         return;
     }
 
     // Get patient's diagnosis
     printf("Enter Patient Diagnosis: ");
-    fgets(newPatient -> diagnosis, DIAGNOSIS_MAX_LENGTH, stdin);
-    newPatient -> diagnosis[strcspn(newPatient -> diagnosis, "\n")] = 0;
+    fgets(newPatient.diagnosis, DIAGNOSIS_MAX_LENGTH, stdin);
+    newPatient.diagnosis[strcspn(newPatient.diagnosis, "\n")] = 0;
 
     // Get patient's room number
     printf("Enter Room Number: ");
-    scanf("%d", &newPatient -> roomNumber);
+    scanf("%d", &newPatient.roomNumber);
     getchar();
 
-    // Save the new patient record in the array
-//    patients[currentPatientCount] = newPatient;
-//    currentPatientCount++;
-    newPatient->next = head; // Changed(by Jun): Adding new patient in the head of the list
-    head = newPatient;
-    patientCount++;
+    // Save the new patient record in the store
+    int failed = admitPatient(&newPatient);
+    if (failed == 2) {
+        printf("Error: The patient could not be recorded and was not added.\n\n");
+        return;
+    } else if (failed) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
 
-    printf("%s Added!\n\n", newPatient -> name);
+    printf("%s Added!\n\n", newPatient.name);
 }
 
 // 2. View all Patients on File
 void viewAllPatients() {
-    if (head == NULL) {
+    if (patientCount() == 0) {
         printf("No patients found!\n\n");
         return;
     }
 
-    printf("%-12s %-20s %-6s %-30s %-12s\n", "Patient ID", "Name", "Age", "Diagnosis", "Room Number");
-
-    // Scan the Linked List
-    Patient *current = head;
-    while (current != NULL) {
-      printf("%-12d %-20s %-6d %-30s %-12d\n",
-             current->patientID,
-             current->name,
-             current->age,
-             current->diagnosis,
-             current->roomNumber);
-      current = current->next; // To the next node
+    // Optional slice: "offset limit [id|name|age|room]", e.g. "100 50 room"; Enter shows everything
+    char options[64];
+    char sortName[16] = "";
+    int offset = 0, limit = 0;
+    printf("Enter start row, number of rows and sort (id/name/age/room), or press Enter for all: ");
+    if (fgets(options, sizeof(options), stdin) != NULL) {
+        sscanf(options, "%d %d %15s", &offset, &limit, sortName);
     }
-    printf("\n");
 
-//    for (int i = 0; i < currentPatientCount; i++) {
-//        printf("%-12d %-20s %-6d %-30s %-12d\n",
-//               patients[i].patientID,
-//               patients[i].name,
-//               patients[i].age,
-//               patients[i].diagnosis,
-//               patients[i].roomNumber);
-//    }
-//    printf("\n");
+    renderPatients(stdout, offset, limit, parseSortOrder(sortName));
+    printf("\n");
 }
 
 // 3. Search for a Patient
-// Changed(by Jun): From for-loop to while(current) for scanning the Linked List
 void searchForPatient() {
-    if (head == NULL) {
+    if (patientCount() == 0) {
       printf("Error: No patients found!\n");
       return;
     }
@@ -315,7 +1460,8 @@ void searchForPatient() {
     int userChoice, id;
     char name[NAME_MAX_LENGTH];
 
-    printf("Search by:\n1. ID\n2. Name\nChoice: ");
+    printf("Search by:\n1. ID\n2. Name\n3. Name (any case)\n4. Name starting with\n5. Room number\n"
+           "6. Range of IDs, names, ages or rooms\n7. Diagnosis words\nChoice: ");
     scanf("%d", &userChoice);
     getchar();
 
@@ -324,39 +1470,106 @@ void searchForPatient() {
       scanf("%d", &id);
       getchar();
 
-      Patient *current = head;
-      while (current) {
-        if (current->patientID == id) {
-          printf("Found Patient: %s (ID: %d, Age: %d, Diagnosis: %s, Room: %d)\n",
-                 current->name,
-                 current->patientID,
-                 current->age,
-                 current->diagnosis,
-                 current->roomNumber);
-          return;
-        }
-        current = current->next;
+      Patient patient;
+      uint64_t started = metricsStart();
+      int missing = lookupPatient(id, &patient);
+      metricsObserve(METRIC_SEARCH_ID, started);
+      if (!missing) {
+        printf("Found Patient: %s (ID: %d, Age: %d, Diagnosis: %s, Room: %d)\n",
+               patient.name,
+               patient.patientID,
+               patient.age,
+               patient.diagnosis,
+               patient.roomNumber);
+        return;
       }
         printf("Patients with ID %d not found.\n", id);
-    } else if (userChoice == 2) {
-      printf("Enter Patient Name: ");
+    } else if (userChoice >= 2 && userChoice <= 4) {
+      printf(userChoice == 4 ? "Enter the start of the name: " : "Enter Patient Name: ");
       fgets(name, NAME_MAX_LENGTH, stdin);
       name[strcspn(name, "\n")] = 0;
 
-      Patient *current = head;
-      while (current) {
-        if (strcmp(current->name, name) == 0) {
-          printf("Found Patinet: %s (ID: %d, Age: %d, Diagnosis: %s, Room: %d)\n",
-                 current->name,
-                 current->patientID,
-                 current->age,
-                 current->diagnosis,
-                 current->roomNumber);
-          return;
-        }
-        current = current->next;
+      PatientRef *refs;
+      int mode = userChoice == 2 ? NAME_EXACT : userChoice == 3 ? NAME_IGNORE_CASE : NAME_PREFIX;
+      int found = findPatientsInShards(name, mode, &refs);
+      for (int i = 0; i < found; i++) {
+        const PatientStore *patients = &shards[refs[i].shard].patients;
+        int row = refs[i].row;
+        printf("Found Patient: %s (ID: %d, Age: %d, Diagnosis: %s, Room: %d)\n",
+               patients->names[row],
+               patients->patientIDs[row],
+               patients->ages[row],
+               diagnosisText(patients->diagnosisCodes[row]),
+               patients->roomNumbers[row]);
+      }
+      free(refs);
+      if (found > 1) {
+        printf("%d patients found.\n", found);
+      } else if (found <= 0) {
+        printf("Patients with Name %s not found.\n", name);
+      }
+    } else if (userChoice == 5) {
+      printf("Enter Room Number: ");
+      scanf("%d", &id);
+      getchar();
+      showRoomOccupants(id);
+    } else if (userChoice == 6) {
+      // e.g. "age 65 -" for every patient aged 65 or more, in age order
+      char line[64], key[16] = "", low[NAME_MAX_LENGTH] = "-", high[NAME_MAX_LENGTH] = "-";
+      printf("Enter id/name/age/room, then from and to (- for no limit): ");
+      if (fgets(line, sizeof(line), stdin) != NULL) {
+        sscanf(line, "%15s %19s %19s", key, low, high);
+      }
+
+      int sortBy = parseSortOrder(key);
+      OrderBound from, to;
+      if (sortBy == SORT_NONE || parseOrderBound(sortBy, low, &from) != 0 || parseOrderBound(sortBy, high, &to) != 0) {
+        printf("Invalid range.\n");
+        return;
+      }
+      PatientRef *refs;
+      int found = findPatientsInRange(sortBy, &from, &to, &refs);
+      for (int i = 0; i < found; i++) {
+        const PatientStore *patients = &shards[refs[i].shard].patients;
+        int row = refs[i].row;
+        printf("Found Patient: %s (ID: %d, Age: %d, Diagnosis: %s, Room: %d)\n",
+               patients->names[row],
+               patients->patientIDs[row],
+               patients->ages[row],
+               diagnosisText(patients->diagnosisCodes[row]),
+               patients->roomNumbers[row]);
+      }
+      free(refs);
+      if (found < 0) {
+        printf("Memory allocation failed!\n");
+      } else {
+        printf("%d patients found.\n", found);
+      }
+    } else if (userChoice == 7) {
+      // e.g. "chest pain OR angina", or "pneum*" for pneumonia, pneumothorax, ...
+      char words[DIAGNOSIS_MAX_LENGTH];
+      printf("Enter diagnosis words (all must appear; OR between alternatives; word* for a prefix): ");
+      fgets(words, DIAGNOSIS_MAX_LENGTH, stdin);
+      words[strcspn(words, "\n")] = 0;
+
+      PatientRef *refs;
+      int found = findPatientsByDiagnosis(words, &refs);
+      for (int i = 0; i < found; i++) {
+        const PatientStore *patients = &shards[refs[i].shard].patients;
+        int row = refs[i].row;
+        printf("Found Patient: %s (ID: %d, Age: %d, Diagnosis: %s, Room: %d)\n",
+               patients->names[row],
+               patients->patientIDs[row],
+               patients->ages[row],
+               diagnosisText(patients->diagnosisCodes[row]),
+               patients->roomNumbers[row]);
+      }
+      free(refs);
+      if (found < 0) {
+        printf("Memory allocation failed!\n");
+      } else {
+        printf("%d patients found.\n", found);
       }
-      printf("Patients with Name %s not found.\n", name);
     } else {
       printf("Invalid choice.\n");
     }
@@ -364,7 +1577,7 @@ void searchForPatient() {
 
 // 4. Discharge a Patient by ID
 void dischargePatient() {
-    if (head == NULL) {
+    if (patientCount() == 0) {
         printf("No patients found!\n\n");
         return;
     }
@@ -374,95 +1587,726 @@ void dischargePatient() {
     scanf("%d", &id);
     getchar();
 
-    Patient *current = head, *prev = NULL;
-
-    while (current) {
-        if (current->patientID == id) {
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                head = current->next;
-            }
-            free(current);
-            patientCount--;
-            printf("Patient #%d has been discharged.\n\n", id);
-            return;
-        }
-        prev = current;
-        current = current->next;
+    int failed = dischargePatientByID(id);
+    if (failed == 0) {
+        printf("Patient #%d has been discharged.\n\n", id);
+        return;
+    } else if (failed == 2) {
+        printf("Error: The discharge could not be recorded, patient #%d is still on file.\n\n", id);
+        return;
     }
     printf("Patient with ID %d not found.\n\n", id);
 }
 
-// 5. Manage Doctors' Weekly Schedules
+// 5. Manage the Doctors' Duty Roster
 void manageDoctorSchedule() {
     int userChoice;
-    printf("What would you like to do with the doctors' schedule?\n");
+    printf("What would you like to do with the doctors' roster?\n");
     printf("1. Assign a doctor to a shift\n");
-    printf("2. Display the full weekly schedule\n");
+    printf("2. Display the roster for a week\n");
+    printf("3. Remove a doctor from a shift\n");
+    printf("4. Show who is on duty now\n");
+    printf("5. Check if a doctor is free\n");
+    printf("6. Show wards with no doctor\n");
+    printf("7. Fill the roster automatically\n");
     scanf("%d", &userChoice);
     getchar(); // Consume newline
 
+    char* shifts[] = {"morning", "afternoon", "evening"};
+    int today, shiftNow;
+    currentDayAndShift(&today, &shiftNow);
+
     switch (userChoice) {
-        case 1: {
-            int dayOfWeek;
-            int shift;
+        case 1:
+        case 3: {
+            int day, shift, ward;
             char doctorName[NAME_MAX_LENGTH];
+            char date[16];
 
-            printf("Enter Day: (0 for Sunday, 1 for Monday, 2 for Tuesday...) ");
-            scanf("%d", &dayOfWeek);
-            getchar(); // Consume newline
-
-            if (dayOfWeek < 0 || dayOfWeek > 6) {
-                printf("Error: Day of week out of range.\n\n");
+            if (readRosterSlot(today, &day, &shift, &ward) != 0) {
                 break;
             }
-
-            printf("Enter Shift: (0 for morning, 1 for afternoon, 2 for evening) ");
-            scanf("%d", &shift);
-            getchar(); // Consume newline
-
-            if (shift < 0 || shift > 2) {
-                printf("Error: Shift out of range.\n\n");
+            printf("Enter the doctor's name: ");
+            fgets(doctorName, NAME_MAX_LENGTH, stdin);
+            doctorName[strcspn(doctorName, "\n")] = 0;
+            if (doctorName[0] == 0) {
+                printf("Error: A doctor's name is needed.\n\n");
                 break;
             }
 
+            dateFromDays(day, date, sizeof(date));
+            if (userChoice == 3) {
+                int result = unscheduleDoctor(day, shift, ward, doctorName);
+                if (result == 2) {
+                    printf("Error: The change could not be recorded, the roster was not changed.\n\n");
+                } else if (result != 0) {
+                    printf("Doctor %s is not on the %s shift of ward %d on %s.\n\n", doctorName, shifts[shift], ward, date);
+                } else {
+                    printf("Doctor %s has been removed from the %s shift of ward %d on %s\n\n", doctorName, shifts[shift], ward, date);
+                }
+                break;
+            }
+            int result = scheduleDoctor(day, shift, ward, doctorName);
+            if (result == 1) {
+                printf("Error: Doctor %s already works the %s shift on %s.\n\n", doctorName, shifts[shift], date);
+            } else if (result == 3) {
+                printf("Error: The change could not be recorded, the roster was not changed.\n\n");
+            } else if (result != 0) {
+                printf("Error: Out of memory, the roster was not changed.\n\n");
+            } else {
+                printf("Doctor %s has been added to the %s shift of ward %d on %s\n\n", doctorName, shifts[shift], ward, date);
+            }
+            break;
+        }
+        case 2: {
+            int day;
+            if (readRosterDay("Enter the first day of the week (YYYY-MM-DD, Enter for this week): ", weekStart(today), &day) == 0) {
+                printRosterWeek(day);
+            }
+            break;
+        }
+        case 4:
+            printOnDutyNow();
+            break;
+        case 5: {
+            int day, shift;
+            char doctorName[NAME_MAX_LENGTH];
             printf("Enter the doctor's name: ");
             fgets(doctorName, NAME_MAX_LENGTH, stdin);
             doctorName[strcspn(doctorName, "\n")] = 0;
-
-            strcpy(schedule[dayOfWeek][shift].DoctorName, doctorName);
-            printf("Doctor %s has been added to the schedule on day %d, shift %d\n\n",
-                   doctorName,
-                   dayOfWeek,
-                   shift);
+            if (readRosterSlot(today, &day, &shift, NULL) != 0) {
+                break;
+            }
+            int doctorID = findDoctor(doctorName, 0);
+            int busy = doctorID > NO_DOCTOR && rosterDoctorBusy(doctorID, day, shift);
+            printf("Doctor %s is %s on that shift.\n\n", doctorName, busy ? "working" : "free");
             break;
         }
-        case 2: {
-            char* daysOfWeek[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
-            char* shifts[] = {"Morning", "Afternoon", "Evening"};
-
-            printf("Doctor Weekly Schedule:\n");
-            printf("%-12s %-12s %-30s\n", "Day", "Shift", "Doctor Name");
-
-            for (int day = 0; day <= 6; day++) {
-                for (int shift = 0; shift <= 2; shift++) {
-                    printf("%-12s %-12s %-30s\n",
-                           daysOfWeek[day],
-                           shifts[shift],
-                           strlen(schedule[day][shift].DoctorName) > 0 ? schedule[day][shift].DoctorName : "No doctor assigned");
-                }
+        case 6: {
+            int first, last;
+            if (readRosterDay("Enter start date (YYYY-MM-DD, Enter for today): ", today, &first) == 0 &&
+                readRosterDay("Enter end date (YYYY-MM-DD, Enter for a week later): ", first + DAYS_IN_WEEK - 1, &last) == 0) {
+                printCoverageGaps(first, last);
             }
-            printf("\n");
             break;
         }
+        case 7:
+            autoScheduleMenu(today);
+            break;
         default:
             printf("Error: Invalid choice. Please try again.\n\n");
             break;
     }
 }
 
-// Helper function to display one patient's record
+// Helper function to ask for a date, with a default for an empty answer
+int readRosterDay(const char *prompt, int defaultDay, int *day) {
+    char text[32];
+    printf("%s", prompt);
+    if (fgets(text, sizeof(text), stdin) == NULL) {
+        return 1;
+    }
+    text[strcspn(text, "\n")] = 0;
+    if (text[0] == 0) {
+        *day = defaultDay;
+        return 0;
+    }
+    if (parseDay(text, day) != 0) {
+        printf("Error: Dates must look like 2025-01-29.\n\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Helper function to ask for the parts of a roster slot (NULL skips a part)
+int readRosterSlot(int today, int *day, int *shift, int *ward) {
+    if (day != NULL && readRosterDay("Enter Date: (YYYY-MM-DD, Enter for today) ", today, day) != 0) {
+        return 1;
+    }
+    if (shift != NULL) {
+        printf("Enter Shift: (0 for morning, 1 for afternoon, 2 for evening) ");
+        scanf("%d", shift);
+        getchar(); // Consume newline
+        if (*shift < 0 || *shift >= SHIFTS_IN_DAY) {
+            printf("Error: Shift out of range.\n\n");
+            return 1;
+        }
+    }
+    if (ward != NULL) {
+        printf("Enter Ward: (1 to %d) ", WARD_COUNT);
+        scanf("%d", ward);
+        getchar(); // Consume newline
+        if (*ward < 1 || *ward > WARD_COUNT) {
+            printf("Error: Ward out of range.\n\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to print a week of the roster, starting from firstDay
+void printRosterWeek(int firstDay) {
+    char* daysOfWeek[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+    char* shifts[] = {"Morning", "Afternoon", "Evening"};
+
+    printf("Doctor Roster:\n");
+    printf("%-12s %-10s %-12s %-6s %-30s\n", "Day", "Date", "Shift", "Ward", "Doctor Name");
+    for (int day = firstDay; day < firstDay + DAYS_IN_WEEK; day++) {
+        char date[16];
+        dateFromDays(day, date, sizeof(date));
+        for (int shift = 0; shift < SHIFTS_IN_DAY; shift++) {
+            uint32_t covered = rosterCoverage(day, shift);
+            if (covered == 0) {
+                printf("%-12s %-10s %-12s %-6s %-30s\n", daysOfWeek[day - weekStart(day)], date, shifts[shift], "-",
+                       "No doctor assigned");
+                continue;
+            }
+            for (int ward = 1; ward <= WARD_COUNT; ward++) {
+                if (!(covered & (1u << (ward - 1)))) {
+                    continue;
+                }
+                for (int entry = rosterSlotFirst(day, shift, ward); entry >= 0; entry = roster.assignments[entry].next) {
+                    printf("%-12s %-10s %-12s %-6d %-30s\n", daysOfWeek[day - weekStart(day)], date, shifts[shift], ward,
+                           doctorName(roster.assignments[entry].doctorID));
+                }
+            }
+        }
+    }
+    printf("\n");
+}
+
+// Function to list the doctors on the shift running now, ward by ward
+void printOnDutyNow() {
+    char* shifts[] = {"morning", "afternoon", "evening"};
+    char date[16];
+    int day, shift;
+    currentDayAndShift(&day, &shift);
+    dateFromDays(day, date, sizeof(date));
+
+    uint32_t covered = rosterCoverage(day, shift);
+    printf("On duty now (%s shift of %s):\n", shifts[shift], date);
+    if (covered == 0) {
+        printf("No doctor is on duty.\n\n");
+        return;
+    }
+    for (int ward = 1; ward <= WARD_COUNT; ward++) {
+        if (!(covered & (1u << (ward - 1)))) {
+            continue;
+        }
+        printf("Ward %d:", ward);
+        for (int entry = rosterSlotFirst(day, shift, ward); entry >= 0; entry = roster.assignments[entry].next) {
+            printf(" %s", doctorName(roster.assignments[entry].doctorID));
+        }
+        printf("\n");
+    }
+    printf("\n");
+}
+
+// Function to list the wards left without a doctor, shift by shift, from first to last
+void printCoverageGaps(int first, int last) {
+    char* shifts[] = {"Morning", "Afternoon", "Evening"};
+    uint32_t allWards = WARD_COUNT >= 32 ? 0xffffffffu : (1u << WARD_COUNT) - 1;
+    int gaps = 0;
+
+    printf("Wards with no doctor:\n");
+    for (int day = first; day <= last; day++) {
+        char date[16];
+        dateFromDays(day, date, sizeof(date));
+        for (int shift = 0; shift < SHIFTS_IN_DAY; shift++) {
+            uint32_t missing = ~rosterCoverage(day, shift) & allWards;
+            if (missing == 0) {
+                continue;
+            }
+            printf("%-10s %-12s", date, shifts[shift]);
+            if (missing == allWards) {
+                printf(" all wards");
+            } else {
+                for (int ward = 1; ward <= WARD_COUNT; ward++) {
+                    if (missing & (1u << (ward - 1))) {
+                        printf(" %d", ward);
+                    }
+                }
+            }
+            printf("\n");
+            gaps++;
+        }
+    }
+    printf(gaps == 0 ? "Every ward is covered.\n\n" : "\n");
+}
+
+// Function to ask for the auto-scheduler's settings and run it
+void autoScheduleMenu(int today) {
+    AutoScheduleRequest request;
+    char path[256];
+
+    printf("Enter availability file (Enter for every registered doctor, always available): ");
+    if (fgets(path, sizeof(path), stdin) == NULL) {
+        return;
+    }
+    path[strcspn(path, "\n")] = 0;
+    if (readRosterDay("Enter first date (YYYY-MM-DD, Enter for today): ", today, &request.firstDay) != 0) {
+        return;
+    }
+    printf("Enter number of days: ");
+    scanf("%d", &request.days);
+    printf("Enter number of wards to cover (1 to %d): ", WARD_COUNT);
+    scanf("%d", &request.wards);
+    printf("Enter doctors needed on each shift of a ward: ");
+    scanf("%d", &request.perShift);
+    printf("Enter the most shifts a doctor works in a week: ");
+    scanf("%d", &request.maxPerWeek);
+    getchar(); // Consume newline
+
+    int added, missing;
+    if (autoScheduleRoster(&request, path, &added, &missing, stdout) != 0) {
+        printf("\n");
+        return;
+    }
+    printf("%d assignment(s) added to the roster.\n", added);
+    if (missing > 0) {
+        printf("%d doctor shift(s) could not be filled; see \"Show wards with no doctor\".\n", missing);
+    }
+    printf("\n");
+}
+
+// Helper functions to run workers on POSIX threads or Windows threads
+int workerCount() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count < 1 ? 1 : count > MAX_WORKERS ? MAX_WORKERS : count;
+}
+
+#ifdef _WIN32
+typedef struct {
+    void *(*run)(void *);
+    void *argument;
+} WorkerStart;
+
+DWORD WINAPI workerMain(LPVOID parameter) {
+    WorkerStart start = *(WorkerStart *)parameter;
+    free(parameter);
+    start.run(start.argument);
+    return 0;
+}
+#endif
+
+int startWorker(WorkerThread *thread, void *(*run)(void *), void *argument) {
+#ifdef _WIN32
+    WorkerStart *start = malloc(sizeof(WorkerStart));
+    if (start == NULL) {
+        return 1;
+    }
+    start->run = run;
+    start->argument = argument;
+    *thread = CreateThread(NULL, 0, workerMain, start, 0, NULL);
+    if (*thread == NULL) {
+        free(start);
+        return 1;
+    }
+    return 0;
+#else
+    return pthread_create(thread, NULL, run, argument) != 0;
+#endif
+}
+
+void joinWorker(WorkerThread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void *runParallelPart(void *argument) {
+    ParallelPart *part = argument;
+    part->run(part->part, part->parts, part->context);
+    return NULL;
+}
+
+// Function to run a census-wide job in parts on worker threads, run(part, parts, context)
+// Jobs over fewer than PARALLEL_MIN_ROWS rows run on this thread alone, where starting
+// threads would cost more than they save. At most maxParts parts are used.
+void runParallel(void (*run)(int, int, void *), void *context, int rows, int maxParts) {
+    int parts = rows < PARALLEL_MIN_ROWS ? 1 : workerCount();
+    if (parts > maxParts) {
+        parts = maxParts;
+    }
+    ParallelPart work[MAX_WORKERS];
+    WorkerThread handles[MAX_WORKERS];
+    int running = 0;
+    for (int p = 0; p < parts; p++) {
+        work[p].run = run;
+        work[p].context = context;
+        work[p].part = p;
+        work[p].parts = parts;
+    }
+    for (int p = 1; p < parts && startWorker(&handles[p], runParallelPart, &work[p]) == 0; p++) {
+        running++;
+    }
+    // This thread takes the first part, and the part of any worker that could not start
+    run(0, parts, context);
+    for (int p = running + 1; p < parts; p++) {
+        run(p, parts, context);
+    }
+    for (int p = 1; p <= running; p++) {
+        joinWorker(handles[p]);
+    }
+}
+
+// Function to read an availability file for the auto-scheduler
+// One entry per line, comma-separated like batch files:
+//   doctor,<name>                        (the doctor can be scheduled)
+//   off,<name>,<YYYY-MM-DD>[,<shift>]     (not available that day, or only that shift)
+// Without a file every registered doctor is available for every shift.
+// Problems are reported to out. Returns the number of doctors, or -1 if the file cannot be used.
+int readAvailability(const char *path, const AutoScheduleRequest *request, int **doctorIDsOut,
+                     uint64_t **availableOut, int *wordsOut, FILE *out) {
+    int words = (request->days * SHIFTS_IN_DAY + 63) / 64;
+    int count = 0, capacity = 0;
+    int *doctorIDs = NULL;
+    FILE *file = NULL;
+
+    if (path[0] == 0) {
+        for (int id = 1; id < doctorRegistry.count; id++) {
+            if (growArray((void **)&doctorIDs, &capacity, count + 1, sizeof(int)) != 0) {
+                free(doctorIDs);
+                return -1;
+            }
+            doctorIDs[count++] = id;
+        }
+    } else {
+        file = fopen(path, "r");
+        if (file == NULL) {
+            fprintf(out, "Error: Cannot open %s.\n", path);
+            return -1;
+        }
+    }
+
+    // First pass: the doctors (every later "off" line refers to one of them)
+    char line[BATCH_LINE_MAX];
+    char *fields[BATCH_MAX_FIELDS];
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '#' || splitBatchLine(line, fields, BATCH_MAX_FIELDS) != 2 ||
+            strcmp(fields[0], "doctor") != 0) {
+            continue;
+        }
+        char name[NAME_MAX_LENGTH];
+        copyBatchText(name, fields[1], NAME_MAX_LENGTH);
+        int doctorID = findDoctor(name, 1);
+        if (doctorID <= NO_DOCTOR || growArray((void **)&doctorIDs, &capacity, count + 1, sizeof(int)) != 0) {
+            fclose(file);
+            free(doctorIDs);
+            return -1;
+        }
+        doctorIDs[count++] = doctorID;
+    }
+
+    uint64_t *available = malloc((size_t)(count ? count : 1) * words * sizeof(uint64_t));
+    if (available == NULL) {
+        if (file != NULL) fclose(file);
+        free(doctorIDs);
+        return -1;
+    }
+    memset(available, 0xff, (size_t)count * words * sizeof(uint64_t));
+
+    // Second pass: the time off
+    int lineNumber = 0, errors = 0;
+    if (file != NULL) {
+        rewind(file);
+    }
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '#') {
+            continue;
+        }
+        int fieldCount = splitBatchLine(line, fields, BATCH_MAX_FIELDS);
+        if (strcmp(fields[0], "doctor") == 0 && fieldCount == 2) {
+            continue;
+        }
+        char name[NAME_MAX_LENGTH];
+        int day, shift = -1, doctor = -1;
+        if (strcmp(fields[0], "off") == 0 && (fieldCount == 3 || fieldCount == 4) && parseDay(fields[2], &day) == 0 &&
+            (fieldCount == 3 || (parseBatchInt(fields[3], &shift) == 0 && shift >= 0 && shift < SHIFTS_IN_DAY))) {
+            copyBatchText(name, fields[1], NAME_MAX_LENGTH);
+            int doctorID = findDoctor(name, 0);
+            for (int i = 0; doctorID > NO_DOCTOR && i < count; i++) {
+                if (doctorIDs[i] == doctorID) {
+                    doctor = i;
+                }
+            }
+        }
+        if (doctor < 0) {
+            fprintf(out, "Line %d of %s skipped.\n", lineNumber, path);
+            errors++;
+            continue;
+        }
+        if (day < request->firstDay || day >= request->firstDay + request->days) {
+            continue;
+        }
+        for (int s = shift < 0 ? 0 : shift; s <= (shift < 0 ? SHIFTS_IN_DAY - 1 : shift); s++) {
+            int bit = (day - request->firstDay) * SHIFTS_IN_DAY + s;
+            available[(size_t)doctor * words + bit / 64] &= ~(1ull << (bit % 64));
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    *doctorIDsOut = doctorIDs;
+    *availableOut = available;
+    *wordsOut = words;
+    return count;
+}
+
+// Function to solve one week of the auto-scheduler (runs on a worker thread)
+// Only reads shared data; the picks go to the job and are applied by the caller.
+// Greedy first: shifts with the fewest available doctors are filled first, each
+// time by the eligible doctor with the fewest shifts that week. Then a local search
+// fills what is left: a doctor blocked only by one of this week's picks hands that
+// pick to another eligible doctor and takes the open shift instead.
+void solveScheduleWeek(ScheduleWeekJob *job) {
+    const AutoScheduleRequest *request = job->request;
+    int doctors = job->doctorCount;
+    int days = job->lastDay - job->firstDay + 1;
+    int slots = days * SHIFTS_IN_DAY * request->wards;
+    int *load = calloc((size_t)(doctors ? doctors : 1), sizeof(int));
+    unsigned char *busyDays = calloc((size_t)(doctors ? doctors : 1), 1);  // Bit per weekday: already working
+    unsigned char *pickedDays = calloc((size_t)(doctors ? doctors : 1), 1); // Bit per weekday: working by a pick
+    int *need = malloc((size_t)slots * sizeof(int));
+    int *order = malloc((size_t)days * SHIFTS_IN_DAY * sizeof(int));
+    int *candidates = malloc((size_t)days * SHIFTS_IN_DAY * sizeof(int));
+    job->picks = malloc((size_t)(slots * request->perShift + 1) * sizeof(AutoAssignment));
+    job->pickCount = 0;
+    job->missing = 0;
+    if (load == NULL || busyDays == NULL || pickedDays == NULL || need == NULL || order == NULL ||
+        candidates == NULL || job->picks == NULL) {
+        job->failed = 1;
+        goto done;
+    }
+
+    // What the roster already holds this week
+    int week = weekStart(job->firstDay);
+    for (int i = 0; i < doctors; i++) {
+        for (int day = 0; day < DAYS_IN_WEEK; day++) {
+            for (int shift = 0; shift < SHIFTS_IN_DAY; shift++) {
+                if (rosterDoctorBusy(job->doctorIDs[i], week + day, shift)) {
+                    load[i]++;
+                    busyDays[i] |= (unsigned char)(1u << day);
+                }
+            }
+        }
+    }
+    for (int d = 0; d < days; d++) {
+        for (int shift = 0; shift < SHIFTS_IN_DAY; shift++) {
+            for (int ward = 1; ward <= request->wards; ward++) {
+                int onShift = 0;
+                for (int entry = rosterSlotFirst(job->firstDay + d, shift, ward); entry >= 0; entry = roster.assignments[entry].next) {
+                    onShift++;
+                }
+                need[(d * SHIFTS_IN_DAY + shift) * request->wards + ward - 1] =
+                    onShift < request->perShift ? request->perShift - onShift : 0;
+            }
+        }
+    }
+
+    // Hardest shifts first: the fewest doctors available (insertion sort, at most 21 entries)
+    int dayShifts = days * SHIFTS_IN_DAY;
+    for (int i = 0; i < dayShifts; i++) {
+        int bit = (job->firstDay - request->firstDay) * SHIFTS_IN_DAY + i;
+        candidates[i] = 0;
+        for (int doctor = 0; doctor < doctors; doctor++) {
+            candidates[i] += (int)((job->available[(size_t)doctor * job->availableWords + bit / 64] >> (bit % 64)) & 1);
+        }
+        int j = i;
+        while (j > 0 && candidates[order[j - 1]] > candidates[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int o = 0; o < dayShifts; o++) {
+            int d = order[o] / SHIFTS_IN_DAY, shift = order[o] % SHIFTS_IN_DAY;
+            int weekday = job->firstDay + d - week;
+            int bit = (job->firstDay - request->firstDay + d) * SHIFTS_IN_DAY + shift;
+            for (int ward = 1; ward <= request->wards; ward++) {
+                int *slotNeed = &need[order[o] * request->wards + ward - 1];
+                while (*slotNeed > 0) {
+                    int best = -1;
+                    if (pass == 0) {
+                        // Greedy: the least loaded eligible doctor (start the scan at a different doctor each shift)
+                        for (int k = 0; k < doctors; k++) {
+                            int doctor = (k + o * 7 + ward) % doctors;
+                            if (((job->available[(size_t)doctor * job->availableWords + bit / 64] >> (bit % 64)) & 1) &&
+                                !((busyDays[doctor] | pickedDays[doctor]) & (1u << weekday)) &&
+                                load[doctor] < request->maxPerWeek && (best < 0 || load[doctor] < load[best])) {
+                                best = doctor;
+                            }
+                        }
+                    } else {
+                        // Local search: move one of this week's picks to a free doctor to make room
+                        for (int p = 0; best < 0 && p < job->pickCount; p++) {
+                            AutoAssignment *pick = &job->picks[p];
+                            int doctor = pick->doctor;
+                            int pickWeekday = pick->day - week;
+                            if (!((job->available[(size_t)doctor * job->availableWords + bit / 64] >> (bit % 64)) & 1) ||
+                                (busyDays[doctor] & (1u << weekday)) ||
+                                ((pickedDays[doctor] & (1u << weekday)) && pickWeekday != weekday) ||
+                                (pick->day == job->firstDay + d && pick->shift == shift)) {
+                                continue;
+                            }
+                            int pickBit = (pick->day - request->firstDay) * SHIFTS_IN_DAY + pick->shift;
+                            for (int other = 0; other < doctors; other++) {
+                                if (other != doctor &&
+                                    ((job->available[(size_t)other * job->availableWords + pickBit / 64] >> (pickBit % 64)) & 1) &&
+                                    !((busyDays[other] | pickedDays[other]) & (1u << pickWeekday)) &&
+                                    load[other] < request->maxPerWeek) {
+                                    pick->doctor = other;
+                                    pickedDays[other] |= (unsigned char)(1u << pickWeekday);
+                                    load[other]++;
+                                    pickedDays[doctor] &= (unsigned char)~(1u << pickWeekday);
+                                    load[doctor]--;
+                                    best = doctor;
+                                    break;
+                                }
+                            }
+                        }
+                    }
+                    if (best < 0) {
+                        break;
+                    }
+                    AutoAssignment *pick = &job->picks[job->pickCount++];
+                    pick->day = job->firstDay + d;
+                    pick->shift = shift;
+                    pick->ward = ward;
+                    pick->doctor = best;
+                    pickedDays[best] |= (unsigned char)(1u << weekday);
+                    load[best]++;
+                    (*slotNeed)--;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < slots; i++) {
+        job->missing += need[i];
+    }
+
+done:
+    free(load);
+    free(busyDays);
+    free(pickedDays);
+    free(need);
+    free(order);
+    free(candidates);
+}
+
+// Worker thread body: solve every step-th week starting from first
+void *solveScheduleWeeks(void *argument) {
+    ScheduleWorker *worker = argument;
+    for (int i = worker->first; i < worker->count; i += worker->step) {
+        solveScheduleWeek(&worker->jobs[i]);
+    }
+    return NULL;
+}
+
+// Function to fill the roster automatically (see AutoScheduleRequest)
+// The weeks are solved in parallel; the picks are then added like hand-made assignments,
+// so they are journaled and counted in the shift report.
+// Returns 1 (after writing why to out) if nothing could be scheduled.
+int autoScheduleRoster(const AutoScheduleRequest *request, const char *availabilityPath, int *added, int *missing,
+                       FILE *out) {
+    *added = 0;
+    *missing = 0;
+    if (request->days < 1 || request->days > 3660 || request->wards < 1 || request->wards > WARD_COUNT ||
+        request->perShift < 1 || request->maxPerWeek < 1) {
+        fprintf(out, "Error: Days must be 1 to 3660, wards 1 to %d, and the other numbers at least 1.\n", WARD_COUNT);
+        return 1;
+    }
+
+    int *doctorIDs, words;
+    uint64_t *available;
+    int doctors = readAvailability(availabilityPath, request, &doctorIDs, &available, &words, out);
+    if (doctors <= 0) {
+        if (doctors == 0) {
+            free(doctorIDs);
+            free(available);
+        }
+        fprintf(out, "Error: No doctors to schedule.\n");
+        return 1;
+    }
+    int lastDay = request->firstDay + request->days - 1;
+    int weeks = (weekStart(lastDay) - weekStart(request->firstDay)) / DAYS_IN_WEEK + 1;
+    ScheduleWeekJob *jobs = calloc((size_t)weeks, sizeof(ScheduleWeekJob));
+    if (jobs == NULL) {
+        free(doctorIDs);
+        free(available);
+        fprintf(out, "Error: Out of memory.\n");
+        return 1;
+    }
+    for (int w = 0; w < weeks; w++) {
+        int first = weekStart(request->firstDay) + w * DAYS_IN_WEEK;
+        jobs[w].request = request;
+        jobs[w].doctorIDs = doctorIDs;
+        jobs[w].doctorCount = doctors;
+        jobs[w].available = available;
+        jobs[w].availableWords = words;
+        jobs[w].firstDay = first < request->firstDay ? request->firstDay : first;
+        jobs[w].lastDay = first + DAYS_IN_WEEK - 1 > lastDay ? lastDay : first + DAYS_IN_WEEK - 1;
+    }
+
+    int threads = workerCount() < weeks ? workerCount() : weeks;
+    ScheduleWorker workers[MAX_WORKERS];
+    WorkerThread handles[MAX_WORKERS];
+    int running = 0;
+    for (int t = 0; t < threads; t++) {
+        workers[t].jobs = jobs;
+        workers[t].count = weeks;
+        workers[t].first = t;
+        workers[t].step = threads;
+    }
+    for (int t = 1; t < threads && startWorker(&handles[t], solveScheduleWeeks, &workers[t]) == 0; t++) {
+        running++;
+    }
+    // This thread takes the first share, and the share of any worker that could not start
+    solveScheduleWeeks(&workers[0]);
+    for (int t = running + 1; t < threads; t++) {
+        solveScheduleWeeks(&workers[t]);
+    }
+    for (int t = 1; t <= running; t++) {
+        joinWorker(handles[t]);
+    }
+
+    int failed = 0;
+    for (int w = 0; w < weeks; w++) {
+        failed |= jobs[w].failed;
+        *missing += jobs[w].missing;
+        for (int p = 0; p < jobs[w].pickCount; p++) {
+            const AutoAssignment *pick = &jobs[w].picks[p];
+            if (scheduleDoctor(pick->day, pick->shift, pick->ward, doctorName(doctorIDs[pick->doctor])) == 0) {
+                (*added)++;
+            }
+        }
+        free(jobs[w].picks);
+    }
+    free(jobs);
+    free(doctorIDs);
+    free(available);
+    if (failed) {
+        fprintf(out, "Error: Out of memory, part of the roster was not filled.\n");
+    }
+    return 0;
+}
+
+// Helper function to display one patient's record
 void displayOnePatientDetails(Patient *patient) {
     if (patient == NULL) return;
     printf("Patient ID: %d, Name: %s, Age: %d, Diagnosis: %s, Room Number: %d\n",
@@ -473,15 +2317,12 @@ void displayOnePatientDetails(Patient *patient) {
            patient -> roomNumber);
 }
 
-// fixed validatePatientID (Linked List)
+// fixed validatePatientID (Hash index lookup instead of a list walk)
 int validatePatientID(int newPatientID) {
-    Patient *current = head;
-    while (current != NULL) {
-      if (current -> patientID == newPatientID) {
-        printf("Error: Patient #&d already exists.\n\n", newPatientID);
+    Patient existing;
+    if (lookupPatient(newPatientID, &existing) == 0) {
+        printf("Error: Patient #%d already exists.\n\n", newPatientID);
         return 1;
-      }
-      current = current -> next;
     }
     return 0;
 }
@@ -495,64 +2336,5668 @@ int validatePatientAge(struct PatientInformation *patient) {
     return 0;
 }
 
+// Function to release the whole census (and the doctors and roster)
 void freeAllPatients() {
-    Patient *current = head;
-    while (current != NULL) {
-        Patient *temp = current;
-        current = current->next;
-        free(temp);
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        freePatientStore(&shards[s].patients);
+        retireBlock(&viewPool, atomic_exchange(&shards[s].view, NULL));
     }
-    head = NULL;
-    patientCount = 0;
+    reclaimMemory(1); // Also releases the view pool
+    freeRoster();
+    free(doctorRegistry.doctors);
+    free(doctorRegistry.slots);
+    memset(&doctorRegistry, 0, sizeof(doctorRegistry));
+    freeDiagnosisDictionary();
 }
 
+// Function to release a store's memory
+void freePatientStore(PatientStore *patients) {
+    free(patients->patientIDs);
+    free(patients->ages);
+    free(patients->roomNumbers);
+    free(patients->names);
+    free(patients->diagnosisCodes);
+    free(patients->index);
+    free(patients->nameNodes);
+    free(patients->nameNode);
+    free(patients->nameNext);
+    free(patients->namePrev);
+    free(patients->rooms);
+    free(patients->roomSlots);
+    free(patients->roomNext);
+    free(patients->roomPrev);
+    free(patients->diagnosisLists);
+    free(patients->diagnosisNext);
+    free(patients->diagnosisPrev);
+    for (int k = 0; k < SORT_ORDERS; k++) {
+        free(patients->orderNodes[k]);
+    }
+    for (int level = 0; level < ORDER_LEVELS; level++) {
+        poolDestroy(&patients->orderPools[level]);
+    }
+    memset(patients, 0, sizeof(*patients));
+}
 
-void generateReports() {
-    int choice;
-    printf("REPORTING MENU: \n");
-    printf("1. Total number of patients\n");
-    printf("2. List of discharged patients (not tracked yet)\n");
-    printf("3. Total shifts covered by each doctor(in a week)\n");
-    printf("4. Room usage report\n");
-    printf("5. Back to main menu\n");
-    scanf("%d", &choice);
-    getchar();
+// Helper function to hash a patient ID into the index (Fibonacci hashing)
+unsigned int hashPatientID(int patientID) {
+    return (unsigned int)patientID * 2654435769u;
+}
 
-    switch (choice) {
-        case 1:
-            printf("Total number of current patients: %d\n", patientCount);
-        break;
+// Helper function to pick a patient's shard
+// Uses the top bits of the ID hash; the index inside the shard uses the low bits.
+int shardOf(int patientID) {
+    return (int)(hashPatientID(patientID) >> (32 - STORE_SHARD_BITS));
+}
 
-        case 3: {
-            int doctorShifts[100] = {0};
-            char doctorNames[100][NAME_MAX_LENGTH];
-            int count = 0;
-            for (int i = 0; i < DAYS_IN_WEEK; i++) {
-                for (int j = 0; j < SHIFTS_IN_DAY; j++) {
-                    char *name = schedule[i][j].DoctorName;
-                    if (strlen(name) == 0) continue;
-                    int found = 0;
-                    for (int k = 0; k < count; k++) {
-                        if (strcmp(doctorNames[k], name) == 0) {
-                            doctorShifts[k]++;
-                            found = 1;
-                            break;
-                        }
-                    }
-                    if (!found) {
-                        strcpy(doctorNames[count], name);
-                        doctorShifts[count++] = 1;
-                    }
+PatientStore *shardStore(int patientID) {
+    return &shards[shardOf(patientID)].patients;
+}
+
+// Function to count the patients on file in every shard
+int patientCount() {
+    int count = 0;
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        count += shards[s].patients.count;
+    }
+    return count;
+}
+
+// Function to set up storeLock and the shard locks (once, before anything touches the census)
+// With glibc, waiting changes go ahead of new lookups, so a steady stream of listings cannot
+// hold changes off forever (read locks are never taken twice by one thread, see runCommand).
+void initStoreLocks() {
+#ifdef _WIN32
+    InitializeSRWLock(&storeLock);
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        InitializeSRWLock(&shards[s].lock);
+        InitializeSRWLock(&shards[s].orderLock);
+    }
+#else
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&storeLock, &attributes);
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        pthread_rwlock_init(&shards[s].lock, &attributes);
+        pthread_rwlock_init(&shards[s].orderLock, NULL);
+    }
+    pthread_rwlockattr_destroy(&attributes);
+#endif
+}
+
+// Helper function to find the index slot for an ID (either its slot or the empty slot where it would go)
+PatientIndexSlot *findIndexSlot(PatientStore *patients, int patientID) {
+    unsigned int mask = (unsigned int)patients->indexCapacity - 1;
+    unsigned int i = hashPatientID(patientID) & mask;
+    uint64_t probes = 1;
+    while (patients->index[i].row >= 0 && patients->index[i].patientID != patientID) {
+        i = (i + 1) & mask;
+        probes++;
+    }
+    metricsCount(METRIC_INDEX_PROBES, probes);
+    return &patients->index[i];
+}
+
+// Helper function to rebuild the index with a new (power of two) capacity
+int resizePatientIndex(PatientStore *patients, int newCapacity) {
+    int oldCapacity = patients->indexCapacity;
+    PatientIndexSlot *oldIndex = patients->index;
+
+    PatientIndexSlot *newIndex = malloc((size_t)newCapacity * sizeof(PatientIndexSlot));
+    if (newIndex == NULL) {
+        return 1;
+    }
+    memset(newIndex, 0xff, (size_t)newCapacity * sizeof(PatientIndexSlot)); // row = -1
+    patients->index = newIndex;
+    patients->indexCapacity = newCapacity;
+
+    for (int i = 0; i < oldCapacity; i++) {
+        if (oldIndex[i].row >= 0) {
+            *findIndexSlot(patients, oldIndex[i].patientID) = oldIndex[i];
+        }
+    }
+    retireMemory(oldIndex); // A lock-free lookup may still be reading it
+    return 0;
+}
+
+// Helper function to move a column that lock-free lookups read into a bigger array
+// The old array is retired rather than freed (see StoreView).
+int growLookupColumn(void **column, size_t oldSize, size_t newSize) {
+    void *grown = malloc(newSize);
+    if (grown == NULL) {
+        return 1;
+    }
+    if (*column != NULL) {
+        memcpy(grown, *column, oldSize);
+    }
+    retireMemory(*column);
+    *column = grown;
+    return 0;
+}
+
+// Helper function to resize every column of the store together
+int resizePatientStore(PatientStore *patients, int newCapacity) {
+    size_t oldRows = (size_t)(patients->capacity < newCapacity ? patients->capacity : newCapacity);
+    if (growLookupColumn((void **)&patients->patientIDs, oldRows * sizeof(int), (size_t)newCapacity * sizeof(int)) != 0 ||
+        growLookupColumn((void **)&patients->ages, oldRows * sizeof(int), (size_t)newCapacity * sizeof(int)) != 0 ||
+        growLookupColumn((void **)&patients->roomNumbers, oldRows * sizeof(int), (size_t)newCapacity * sizeof(int)) != 0 ||
+        growLookupColumn((void **)&patients->names, oldRows * NAME_MAX_LENGTH, (size_t)newCapacity * NAME_MAX_LENGTH) != 0 ||
+        growLookupColumn((void **)&patients->diagnosisCodes, oldRows * sizeof(int), (size_t)newCapacity * sizeof(int)) != 0) {
+        return 1;
+    }
+
+    int *nameNode = realloc(patients->nameNode, (size_t)newCapacity * sizeof(int));
+    if (nameNode == NULL) return 1;
+    patients->nameNode = nameNode;
+
+    int *nameNext = realloc(patients->nameNext, (size_t)newCapacity * sizeof(int));
+    if (nameNext == NULL) return 1;
+    patients->nameNext = nameNext;
+
+    int *namePrev = realloc(patients->namePrev, (size_t)newCapacity * sizeof(int));
+    if (namePrev == NULL) return 1;
+    patients->namePrev = namePrev;
+
+    int *roomNext = realloc(patients->roomNext, (size_t)newCapacity * sizeof(int));
+    if (roomNext == NULL) return 1;
+    patients->roomNext = roomNext;
+
+    int *roomPrev = realloc(patients->roomPrev, (size_t)newCapacity * sizeof(int));
+    if (roomPrev == NULL) return 1;
+    patients->roomPrev = roomPrev;
+
+    int *diagnosisNext = realloc(patients->diagnosisNext, (size_t)newCapacity * sizeof(int));
+    if (diagnosisNext == NULL) return 1;
+    patients->diagnosisNext = diagnosisNext;
+
+    int *diagnosisPrev = realloc(patients->diagnosisPrev, (size_t)newCapacity * sizeof(int));
+    if (diagnosisPrev == NULL) return 1;
+    patients->diagnosisPrev = diagnosisPrev;
+
+    for (int k = 0; k < SORT_ORDERS; k++) {
+        if (patients->orderNodes[k] != NULL) {
+            OrderNode **orderNodes = realloc(patients->orderNodes[k], (size_t)newCapacity * sizeof(OrderNode *));
+            if (orderNodes == NULL) return 1;
+            patients->orderNodes[k] = orderNodes;
+        }
+    }
+
+    patients->capacity = newCapacity;
+    return 0;
+}
+
+// Function to look up a patient's row by ID in O(1), -1 if not on file
+int findPatientRow(PatientStore *patients, int patientID) {
+    if (patients->count == 0) {
+        return -1;
+    }
+    return findIndexSlot(patients, patientID)->row;
+}
+
+// Function to append a patient to the store and index it
+// Returns 1 if the ID is already taken or memory runs out.
+int insertPatient(PatientStore *patients, const Patient *patient) {
+    if (findPatientRow(patients, patient->patientID) >= 0) {
+        return 1; // Before the diagnosis is interned, so a refused add leaves the dictionary alone
+    }
+    char diagnosis[DIAGNOSIS_MAX_LENGTH];
+    memcpy(diagnosis, patient->diagnosis, DIAGNOSIS_MAX_LENGTH);
+    diagnosis[DIAGNOSIS_MAX_LENGTH - 1] = 0;
+    CensusRecord record = {patient->patientID, patient->age, patient->roomNumber, internDiagnosis(patients, diagnosis), ""};
+    memcpy(record.name, patient->name, NAME_MAX_LENGTH);
+    return record.diagnosisCode < 0 || insertCensusRecord(patients, &record) != 0;
+}
+
+// Function to append a patient whose diagnosis is already a dictionary code (see insertPatient)
+int insertCensusRecord(PatientStore *patients, const CensusRecord *patient) {
+    if (patients->count == patients->capacity && reservePatientStore(patients, patients->count + 1) != 0) {
+        return 1;
+    }
+    PatientIndexSlot *slot = findIndexSlot(patients, patient->patientID);
+    if (slot->row >= 0) {
+        return 1;
+    }
+    int code = patient->diagnosisCode;
+    int room = findRoomEntry(patients, patient->roomNumber, 1);
+    if (room < 0 || reserveDiagnosisLists(patients, code) != 0) {
+        return 1;
+    }
+    // Ordered indexes that are built get a node each (see buildOrderIndexes)
+    OrderNode *orderNodes[SORT_ORDERS] = {NULL};
+    int built = atomic_load_explicit(&patients->orderBuilt, memory_order_relaxed);
+    for (int k = 0; k < SORT_ORDERS; k++) {
+        if ((built >> k & 1) && (orderNodes[k] = newOrderNode(patients, randomOrderHeight(patients))) == NULL) {
+            while (--k >= 0) {
+                if (orderNodes[k] != NULL) {
+                    poolFree(&patients->orderPools[orderNodes[k]->height - 1], orderNodes[k]);
                 }
             }
-            printf("Doctor shift Summary:\n");
-            for (int i = 0; i < count; i++) {
-                printf("%s: %d shift\n", doctorNames[i], doctorShifts[i]);
+            return 1;
+        }
+    }
+    // The name's trie nodes come last, so no failure after them can leave an empty branch
+    int node = findNameNode(patients, patient->name, 1);
+    if (node < 0) {
+        releaseNameNodes(patients, patient->name); // Any part of the branch that was added
+        for (int k = 0; k < SORT_ORDERS; k++) {
+            if (orderNodes[k] != NULL) {
+                poolFree(&patients->orderPools[orderNodes[k]->height - 1], orderNodes[k]);
             }
-            break;
         }
-        default:
-            printf("Feature not implemented yet or invalid choice.\n");
-        break;
+        return 1;
+    }
+
+    // Lock-free lookups may be reading this row and the index (see storeShared)
+    int row = patients->count++;
+    char name[NAME_MAX_LENGTH];
+    memcpy(name, patient->name, NAME_MAX_LENGTH);
+    name[NAME_MAX_LENGTH - 1] = 0;
+    storeShared(&patients->patientIDs[row], patient->patientID);
+    storeShared(&patients->ages[row], patient->age);
+    storeShared(&patients->roomNumbers[row], patient->roomNumber);
+    copyShared(patients->names[row], name, NAME_MAX_LENGTH);
+    storeShared(&patients->diagnosisCodes[row], code);
+    linkNameRow(patients, row, node);
+    linkRoomRow(patients, row, room);
+    linkDiagnosisRow(patients, row, code);
+    for (int k = 0; k < SORT_ORDERS; k++) {
+        if (orderNodes[k] != NULL) {
+            orderNodes[k]->row = row;
+            linkOrderNode(patients, k + 1, orderNodes[k]);
+        }
     }
-}
\ No newline at end of file
+
+    storeShared(&slot->patientID, patient->patientID);
+    storeShared(&slot->row, row);
+    return 0;
+}
+
+// Function to remove a patient by ID in O(1) (the last row is moved into the hole)
+// Returns 1 if the ID is not on file.
+int removePatient(PatientStore *patients, int patientID) {
+    if (patients->count == 0) {
+        return 1;
+    }
+    PatientIndexSlot *slot = findIndexSlot(patients, patientID);
+    if (slot->row < 0) {
+        return 1;
+    }
+
+    int row = slot->row;
+    int last = --patients->count;
+    int built = atomic_load_explicit(&patients->orderBuilt, memory_order_relaxed);
+    for (int k = 0; k < SORT_ORDERS; k++) {
+        if (built >> k & 1) {
+            OrderNode *node = patients->orderNodes[k][row];
+            unlinkOrderNode(patients, k + 1, node);
+            poolFree(&patients->orderPools[node->height - 1], node);
+        }
+    }
+    unlinkNameRow(patients, row);
+    unlinkRoomRow(patients, row);
+    unlinkDiagnosisRow(patients, row);
+    if (patients->nameNodes[patients->nameNode[row]].firstRow < 0) {
+        releaseNameNodes(patients, patients->names[row]); // Nobody else on file has this name
+    }
+    if (row != last) {
+        int node = patients->nameNode[last];
+        int room = findRoomEntry(patients, patients->roomNumbers[last], 0);
+        unlinkNameRow(patients, last);
+        unlinkRoomRow(patients, last);
+        unlinkDiagnosisRow(patients, last);
+        storeShared(&patients->patientIDs[row], patients->patientIDs[last]);
+        storeShared(&patients->ages[row], patients->ages[last]);
+        storeShared(&patients->roomNumbers[row], patients->roomNumbers[last]);
+        copyShared(patients->names[row], patients->names[last], NAME_MAX_LENGTH);
+        storeShared(&patients->diagnosisCodes[row], patients->diagnosisCodes[last]);
+        linkNameRow(patients, row, node);
+        linkRoomRow(patients, row, room);
+        linkDiagnosisRow(patients, row, patients->diagnosisCodes[row]);
+        for (int k = 0; k < SORT_ORDERS; k++) {
+            if (built >> k & 1) {
+                patients->orderNodes[k][row] = patients->orderNodes[k][last];
+                patients->orderNodes[k][row]->row = row;
+            }
+        }
+        storeShared(&findIndexSlot(patients, patients->patientIDs[row])->row, row);
+    }
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    unsigned int mask = (unsigned int)patients->indexCapacity - 1;
+    unsigned int hole = (unsigned int)(slot - patients->index);
+    unsigned int i = (hole + 1) & mask;
+    while (patients->index[i].row >= 0) {
+        unsigned int home = hashPatientID(patients->index[i].patientID) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            storeShared(&patients->index[hole].patientID, patients->index[i].patientID);
+            storeShared(&patients->index[hole].row, patients->index[i].row);
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+    storeShared(&patients->index[hole].row, -1);
+    return 0;
+}
+
+// Function to copy one row of the store into a Patient record
+void getPatient(const PatientStore *patients, int row, Patient *patient) {
+    patient->patientID = patients->patientIDs[row];
+    patient->age = patients->ages[row];
+    patient->roomNumber = patients->roomNumbers[row];
+    memcpy(patient->name, patients->names[row], NAME_MAX_LENGTH);
+    strcpy(patient->diagnosis, diagnosisText(patients->diagnosisCodes[row]));
+    patient->next = NULL;
+}
+
+// Function to make room for at least count patients (store columns and index)
+// Growing in one step avoids repeated reallocs when the final size is known.
+int reservePatientStore(PatientStore *patients, int count) {
+    if (count > patients->capacity) {
+        int newCapacity = patients->capacity ? patients->capacity : PATIENT_STORE_MIN_CAPACITY;
+        while (newCapacity < count) {
+            newCapacity *= 2;
+        }
+        if (resizePatientStore(patients, newCapacity) != 0) {
+            return 1;
+        }
+    }
+    // Size the index for the whole store capacity so it stays at most half full
+    if (patients->capacity * 2 > patients->indexCapacity) {
+        int newCapacity = patients->indexCapacity ? patients->indexCapacity : PATIENT_INDEX_MIN_CAPACITY;
+        while (newCapacity < patients->capacity * 2) {
+            newCapacity *= 2;
+        }
+        if (resizePatientIndex(patients, newCapacity) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to empty the store but keep its memory for reuse
+void clearPatientStore(PatientStore *patients) {
+    for (int k = 0; k < SORT_ORDERS; k++) {
+        clearOrderIndex(patients, k + 1);
+    }
+    patients->count = 0;
+    patients->nameNodeCount = 0;
+    patients->nameNodeFree = 0;
+    patients->roomCount = 0;
+    if (patients->roomSlots != NULL) {
+        memset(patients->roomSlots, 0xff, (size_t)patients->roomSlotCapacity * sizeof(int));
+    }
+    for (int code = 0; code < patients->diagnosisListCapacity; code++) {
+        patients->diagnosisLists[code] = (DiagnosisList){0, -1};
+    }
+    if (patients->index != NULL) {
+        memset(patients->index, 0xff, (size_t)patients->indexCapacity * sizeof(PatientIndexSlot));
+    }
+}
+
+
+// Helper function to fold a name character for case-insensitive matching (ASCII)
+unsigned char foldNameChar(char c) {
+    return (unsigned char)(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+}
+
+// Helper function to add a trie node, -1 if memory runs out
+// Nodes released by releaseNameNodes are reused first, so under steady admissions and
+// discharges the trie stays as big as the set of names on file.
+int newNameNode(PatientStore *patients, unsigned char character) {
+    int added = patients->nameNodeFree;
+    if (added > 0) {
+        patients->nameNodeFree = patients->nameNodes[added].nextSibling;
+    } else if (growArray((void **)&patients->nameNodes, &patients->nameNodeCapacity,
+                         patients->nameNodeCount + 1, sizeof(NameTrieNode)) != 0) {
+        return -1;
+    } else {
+        added = patients->nameNodeCount++;
+    }
+    NameTrieNode *node = &patients->nameNodes[added];
+    node->firstChild = -1;
+    node->nextSibling = -1;
+    node->firstRow = -1;
+    node->character = character;
+    return added;
+}
+
+// Helper function to release the trie nodes only a discharged name was using
+// Empty leaves are unlinked from the bottom up and chained for newNameNode to reuse.
+// A name only partly in the trie (an insert that ran out of memory) releases the part there is.
+void releaseNameNodes(PatientStore *patients, const char *name) {
+    if (patients->nameNodeCount == 0) {
+        return; // Not even the root was allocated
+    }
+    NameTrieNode *nodes = patients->nameNodes;
+    int path[NAME_MAX_LENGTH + 1];
+    int depth = 0;
+    path[0] = 0;
+    for (const char *c = name; *c != 0 && depth < NAME_MAX_LENGTH; c++) {
+        unsigned char character = foldNameChar(*c);
+        int child = nodes[path[depth]].firstChild;
+        while (child >= 0 && nodes[child].character != character) {
+            child = nodes[child].nextSibling;
+        }
+        if (child < 0) {
+            break;
+        }
+        path[++depth] = child;
+    }
+
+    while (depth > 0 && nodes[path[depth]].firstRow < 0 && nodes[path[depth]].firstChild < 0) {
+        int node = path[depth--];
+        int *link = &nodes[path[depth]].firstChild;
+        while (*link != node) {
+            link = &nodes[*link].nextSibling;
+        }
+        *link = nodes[node].nextSibling;
+        nodes[node].nextSibling = patients->nameNodeFree;
+        patients->nameNodeFree = node;
+    }
+}
+
+// Function to find the trie node for a (folded) name or prefix
+// With create set, missing nodes are added (only insertPatient does that). Returns -1 if absent.
+int findNameNode(PatientStore *patients, const char *name, int create) {
+    if (patients->nameNodeCount == 0 && (!create || newNameNode(patients, 0) < 0)) {
+        return -1;
+    }
+
+    int node = 0; // Root
+    for (const char *c = name; *c != 0; c++) {
+        unsigned char character = foldNameChar(*c);
+        int previous = -1;
+        int child = patients->nameNodes[node].firstChild;
+        while (child >= 0 && patients->nameNodes[child].character < character) {
+            previous = child;
+            child = patients->nameNodes[child].nextSibling;
+        }
+        if (child < 0 || patients->nameNodes[child].character != character) {
+            if (!create) {
+                return -1;
+            }
+            int added = newNameNode(patients, character);
+            if (added < 0) {
+                return -1;
+            }
+            patients->nameNodes[added].nextSibling = child;
+            if (previous >= 0) {
+                patients->nameNodes[previous].nextSibling = added;
+            } else {
+                patients->nameNodes[node].firstChild = added;
+            }
+            child = added;
+        }
+        node = child;
+    }
+    return node;
+}
+
+// Helper function to put a row at the front of its name node's list
+void linkNameRow(PatientStore *patients, int row, int node) {
+    int first = patients->nameNodes[node].firstRow;
+    patients->nameNode[row] = node;
+    patients->namePrev[row] = -1;
+    patients->nameNext[row] = first;
+    if (first >= 0) {
+        patients->namePrev[first] = row;
+    }
+    patients->nameNodes[node].firstRow = row;
+}
+
+// Helper function to take a row out of its name node's list
+void unlinkNameRow(PatientStore *patients, int row) {
+    int previous = patients->namePrev[row], next = patients->nameNext[row];
+    if (previous >= 0) {
+        patients->nameNext[previous] = next;
+    } else {
+        patients->nameNodes[patients->nameNode[row]].firstRow = next;
+    }
+    if (next >= 0) {
+        patients->namePrev[next] = previous;
+    }
+}
+
+// Helper function to append every row under a trie node (in name order) to a growable array
+int collectNameRows(const PatientStore *patients, int node, int **rows, int *count, int *capacity) {
+    for (int row = patients->nameNodes[node].firstRow; row >= 0; row = patients->nameNext[row]) {
+        if (growArray((void **)rows, capacity, *count + 1, sizeof(int)) != 0) {
+            return 1;
+        }
+        (*rows)[(*count)++] = row;
+    }
+    for (int child = patients->nameNodes[node].firstChild; child >= 0; child = patients->nameNodes[child].nextSibling) {
+        if (collectNameRows(patients, child, rows, count, capacity) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to find every patient matching a name
+// NAME_EXACT matches the name as typed, NAME_IGNORE_CASE ignores case, NAME_PREFIX finds
+// names starting with the text (any case). The matching rows are returned in *rowsOut
+// (caller frees); the result is the number of rows, or -1 if memory ran out.
+int findPatientsByName(PatientStore *patients, const char *name, int mode, int **rowsOut) {
+    int *rows = NULL;
+    int count = 0, capacity = 0;
+    *rowsOut = NULL;
+
+    int node = findNameNode(patients, name, 0);
+    if (node < 0) {
+        return 0;
+    }
+
+    if (mode == NAME_PREFIX) {
+        if (collectNameRows(patients, node, &rows, &count, &capacity) != 0) {
+            free(rows);
+            return -1;
+        }
+    } else {
+        for (int row = patients->nameNodes[node].firstRow; row >= 0; row = patients->nameNext[row]) {
+            if (mode == NAME_EXACT && strcmp(patients->names[row], name) != 0) {
+                continue;
+            }
+            if (growArray((void **)&rows, &capacity, count + 1, sizeof(int)) != 0) {
+                free(rows);
+                return -1;
+            }
+            rows[count++] = row;
+        }
+    }
+    *rowsOut = rows;
+    return count;
+}
+
+// Helper function to compare two names the way the trie orders them (case-folded)
+int compareFoldedNames(const char *a, const char *b) {
+    while (*a != 0 && foldNameChar(*a) == foldNameChar(*b)) {
+        a++;
+        b++;
+    }
+    return (int)foldNameChar(*a) - (int)foldNameChar(*b);
+}
+
+// Function to find every patient matching a name in all the shards (modes as findPatientsByName)
+// Each shard's matches come in trie order and the shards are merged by folded name, so a
+// prefix search still lists names in order. Returns the number of matches, their places in
+// *refsOut (caller frees), or -1 if memory ran out.
+int findPatientsInShards(const char *name, int mode, PatientRef **refsOut) {
+    uint64_t started = metricsStart();
+    int *rows[STORE_SHARDS];
+    int found[STORE_SHARDS], next[STORE_SHARDS];
+    int total = 0;
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        found[s] = findPatientsByName(&shards[s].patients, name, mode, &rows[s]);
+        next[s] = 0;
+        total = total < 0 || found[s] < 0 ? -1 : total + found[s];
+    }
+
+    PatientRef *refs = total > 0 ? malloc((size_t)total * sizeof(PatientRef)) : NULL;
+    if (total > 0 && refs == NULL) {
+        total = -1;
+    }
+    for (int i = 0; i < total; i++) {
+        int best = -1;
+        for (int s = 0; s < STORE_SHARDS; s++) {
+            if (next[s] < found[s] &&
+                (best < 0 || compareFoldedNames(shards[s].patients.names[rows[s][next[s]]],
+                                                shards[best].patients.names[rows[best][next[best]]]) < 0)) {
+                best = s;
+            }
+        }
+        refs[i].shard = best;
+        refs[i].row = rows[best][next[best]++];
+    }
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        free(rows[s]);
+    }
+    *refsOut = refs;
+    metricsCount(METRIC_ROWS_VISITED, total > 0 ? (uint64_t)total : 0);
+    metricsObserve(METRIC_SEARCH_NAME, started);
+    return total;
+}
+
+// Helper function to grow a dynamic array (doubling) so it holds at least needed elements
+int growArray(void **array, int *capacity, int needed, size_t elementSize) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    int newCapacity = *capacity ? *capacity : PATIENT_STORE_MIN_CAPACITY;
+    while (newCapacity < needed) {
+        newCapacity *= 2;
+    }
+    void *grown = realloc(*array, (size_t)newCapacity * elementSize);
+    if (grown == NULL) {
+        return 1;
+    }
+    *array = grown;
+    *capacity = newCapacity;
+    return 0;
+}
+
+// Helper function to hash a doctor's name (FNV-1a)
+unsigned int hashDoctorName(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to find a doctor's ID in the registry
+// An empty name is NO_DOCTOR. With create set, an unknown name is registered.
+// Returns -1 if absent (or out of memory).
+int findDoctor(const char *name, int create) {
+    DoctorRegistry *registry = &doctorRegistry;
+    if (name[0] == 0) {
+        return NO_DOCTOR;
+    }
+    if (registry->slotCapacity > 0) {
+        unsigned int mask = (unsigned int)registry->slotCapacity - 1;
+        for (unsigned int i = hashDoctorName(name) & mask;; i = (i + 1) & mask) {
+            int id = registry->slots[i];
+            if (id < 0) {
+                break;
+            }
+            if (strcmp(registry->doctors[id].name, name) == 0) {
+                return id;
+            }
+        }
+    }
+    // Entry 0 stands for NO_DOCTOR, so the first real doctor gets ID 1
+    int first = registry->count == 0;
+    if (!create || growArray((void **)&registry->doctors, &registry->capacity,
+                             registry->count + 1 + first, sizeof(DoctorEntry)) != 0) {
+        return -1;
+    }
+    if (first) {
+        memset(&registry->doctors[0], 0, sizeof(DoctorEntry));
+        registry->count = 1;
+    }
+
+    // Keep the hash at most half full; rebuilding it only needs the names
+    if ((registry->count + 1) * 2 > registry->slotCapacity) {
+        int newCapacity = registry->slotCapacity ? registry->slotCapacity * 2 : PATIENT_INDEX_MIN_CAPACITY;
+        int *slots = malloc((size_t)newCapacity * sizeof(int));
+        if (slots == NULL) {
+            return -1;
+        }
+        memset(slots, 0xff, (size_t)newCapacity * sizeof(int));
+        free(registry->slots);
+        registry->slots = slots;
+        registry->slotCapacity = newCapacity;
+        for (int id = 1; id < registry->count; id++) {
+            unsigned int i = hashDoctorName(registry->doctors[id].name) & (unsigned int)(newCapacity - 1);
+            while (slots[i] >= 0) {
+                i = (i + 1) & (unsigned int)(newCapacity - 1);
+            }
+            slots[i] = id;
+        }
+    }
+
+    int id = registry->count++;
+    size_t length = strnlen(name, NAME_MAX_LENGTH - 1);
+    memcpy(registry->doctors[id].name, name, length);
+    registry->doctors[id].name[length] = 0;
+    registry->doctors[id].shifts = 0;
+    unsigned int mask = (unsigned int)registry->slotCapacity - 1;
+    unsigned int i = hashDoctorName(registry->doctors[id].name) & mask;
+    while (registry->slots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    registry->slots[i] = id;
+    return id;
+}
+
+// Helper function to get the name behind a doctor ID ("" for NO_DOCTOR)
+const char *doctorName(int doctorID) {
+    return doctorID == NO_DOCTOR ? "" : doctorRegistry.doctors[doctorID].name;
+}
+
+// Function to find a diagnosis code in the dictionary (caller holds diagnosisLock)
+// With create set (diagnosisLock held alone), an unknown text is added.
+// Returns -1 if absent (or out of memory).
+int findDiagnosis(const char *text, int create) {
+    DiagnosisDictionary *dictionary = &diagnosisDictionary;
+    unsigned int hash = hashDoctorName(text); // Same FNV-1a as doctor names
+    if (dictionary->slotCapacity > 0) {
+        unsigned int mask = (unsigned int)dictionary->slotCapacity - 1;
+        for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+            int code = dictionary->slots[i];
+            if (code < 0) {
+                break;
+            }
+            if (strcmp(diagnosisText(code), text) == 0) {
+                return code;
+            }
+        }
+    }
+    // A free code is reused before a new one is handed out
+    int reused = dictionary->freeCount > 0;
+    int code = reused ? dictionary->freeCodes[dictionary->freeCount - 1] : dictionary->count;
+    int block = code / DIAGNOSIS_BLOCK_CODES;
+    if (!create || block == DIAGNOSIS_MAX_BLOCKS) {
+        return -1;
+    }
+    if (dictionary->blocks[block] == NULL &&
+        (dictionary->blocks[block] = malloc((size_t)DIAGNOSIS_BLOCK_CODES * DIAGNOSIS_MAX_LENGTH)) == NULL) {
+        return -1;
+    }
+
+    // Keep the hash at most half full of codes in use; rebuilding it only needs the texts
+    if ((dictionary->count - dictionary->freeCount + 1) * 2 > dictionary->slotCapacity) {
+        int newCapacity = dictionary->slotCapacity ? dictionary->slotCapacity * 2 : PATIENT_INDEX_MIN_CAPACITY;
+        int *slots = malloc((size_t)newCapacity * sizeof(int));
+        if (slots == NULL) {
+            return -1;
+        }
+        memset(slots, 0xff, (size_t)newCapacity * sizeof(int));
+        for (int old = 0; old < dictionary->slotCapacity; old++) {
+            if (dictionary->slots[old] < 0) {
+                continue;
+            }
+            unsigned int i = hashDoctorName(diagnosisText(dictionary->slots[old])) & (unsigned int)(newCapacity - 1);
+            while (slots[i] >= 0) {
+                i = (i + 1) & (unsigned int)(newCapacity - 1);
+            }
+            slots[i] = dictionary->slots[old];
+        }
+        free(dictionary->slots);
+        dictionary->slots = slots;
+        dictionary->slotCapacity = newCapacity;
+    }
+
+    // A reused code's old text may still be being copied by a lock-free lookup, which then
+    // throws the copy away (see lookupPatient); the writes are shared ones for the same reason
+    char stored[DIAGNOSIS_MAX_LENGTH] = {0};
+    memcpy(stored, text, strnlen(text, DIAGNOSIS_MAX_LENGTH - 1));
+    char *copy = dictionary->blocks[block][code % DIAGNOSIS_BLOCK_CODES];
+    copyShared(copy, stored, DIAGNOSIS_MAX_LENGTH);
+    // The code is taken even if its words cannot all be indexed, so a half-indexed code is
+    // never handed out for another text; the next sweep gives it back
+    if (reused) {
+        dictionary->freeCount--;
+    } else {
+        dictionary->count++;
+    }
+    if (indexDiagnosisWords(code, stored) != 0) {
+        return -1;
+    }
+    unsigned int mask = (unsigned int)dictionary->slotCapacity - 1;
+    unsigned int i = hash & mask;
+    while (dictionary->slots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    dictionary->slots[i] = code;
+    return code;
+}
+
+// Function to get the code of a diagnosis, adding it to the dictionary if new (-1 if out of memory)
+// Each store remembers the codes it used last by text hash, so most admissions take no lock;
+// a miss looks the text up under the shared lock and only adds it under the lock alone.
+int internDiagnosis(PatientStore *patients, const char *text) {
+    int *cached = &patients->diagnosisCache[hashDoctorName(text) % DIAGNOSIS_CACHE_SLOTS];
+    if (*cached > 0 && strcmp(diagnosisText(*cached - 1), text) == 0) {
+        return *cached - 1;
+    }
+    int code = internDiagnosisText(text);
+    if (code >= 0) {
+        *cached = code + 1;
+    }
+    return code;
+}
+
+// Function to get the code of a diagnosis with no store's cache at hand (see internDiagnosis)
+int internDiagnosisText(const char *text) {
+    acquireLock(&diagnosisLock, 0);
+    int code = findDiagnosis(text, 0);
+    releaseLock(&diagnosisLock, 0);
+    if (code < 0) {
+        acquireLock(&diagnosisLock, 1);
+        code = findDiagnosis(text, 1);
+        releaseLock(&diagnosisLock, 1);
+    }
+    return code;
+}
+
+// Helper function to get the text behind a diagnosis code (no lock needed, see DiagnosisDictionary)
+const char *diagnosisText(int code) {
+    return diagnosisDictionary.blocks[code / DIAGNOSIS_BLOCK_CODES][code % DIAGNOSIS_BLOCK_CODES];
+}
+
+// Function to release the diagnosis dictionary (no store may hold codes any more)
+void freeDiagnosisDictionary() {
+    for (int block = 0; block < DIAGNOSIS_MAX_BLOCKS && diagnosisDictionary.blocks[block] != NULL; block++) {
+        free(diagnosisDictionary.blocks[block]);
+    }
+    free(diagnosisDictionary.slots);
+    free(diagnosisDictionary.freeCodes);
+    for (int t = 0; t < diagnosisDictionary.termCount; t++) {
+        free(diagnosisDictionary.terms[t].word);
+        free(diagnosisDictionary.terms[t].postings);
+    }
+    free(diagnosisDictionary.terms);
+    free(diagnosisDictionary.termOrder);
+    free(diagnosisDictionary.termSlots);
+    memset(&diagnosisDictionary, 0, sizeof(diagnosisDictionary));
+}
+
+// Helper function to tell whether a character belongs in a diagnosis word (ASCII letter or digit)
+int isDiagnosisWordChar(unsigned char c) {
+    return (c >= '0' && c <= '9') || (foldNameChar((char)c) >= 'a' && foldNameChar((char)c) <= 'z');
+}
+
+// Helper function to read the next word of a diagnosis: a run of letters and digits, lowercased
+// Returns its length (0 at the end of the text) and moves *text past it.
+int nextDiagnosisWord(const char **text, char *word) {
+    const unsigned char *c = (const unsigned char *)*text;
+    while (*c != 0 && !isDiagnosisWordChar(*c)) {
+        c++;
+    }
+    int length = 0;
+    for (; *c != 0 && isDiagnosisWordChar(*c); c++) {
+        if (length < DIAGNOSIS_MAX_LENGTH - 1) {
+            word[length++] = (char)foldNameChar((char)*c);
+        }
+    }
+    word[length] = 0;
+    *text = (const char *)c;
+    return length;
+}
+
+// Function to find a word in the diagnosis word index (caller holds diagnosisLock)
+// With create set (diagnosisLock held alone), an unknown word is added with no codes.
+// Returns the term, or -1 if absent (or out of memory).
+int findDiagnosisTerm(const char *word, int create) {
+    DiagnosisDictionary *dictionary = &diagnosisDictionary;
+    unsigned int hash = hashDoctorName(word);
+    if (dictionary->termSlotCapacity > 0) {
+        unsigned int mask = (unsigned int)dictionary->termSlotCapacity - 1;
+        for (unsigned int i = hash & mask; dictionary->termSlots[i] >= 0; i = (i + 1) & mask) {
+            if (strcmp(dictionary->terms[dictionary->termSlots[i]].word, word) == 0) {
+                return dictionary->termSlots[i];
+            }
+        }
+    }
+    if (!create) {
+        return -1;
+    }
+
+    int term = dictionary->termCount;
+    int orderCapacity = dictionary->termCapacity;
+    if (growArray((void **)&dictionary->terms, &dictionary->termCapacity, term + 1, sizeof(DiagnosisTerm)) != 0 ||
+        growArray((void **)&dictionary->termOrder, &orderCapacity, dictionary->termCapacity, sizeof(int)) != 0) {
+        return -1;
+    }
+    if ((term + 1) * 2 > dictionary->termSlotCapacity) {
+        int newCapacity = dictionary->termSlotCapacity ? dictionary->termSlotCapacity * 2 : PATIENT_INDEX_MIN_CAPACITY;
+        int *slots = malloc((size_t)newCapacity * sizeof(int));
+        if (slots == NULL) {
+            return -1;
+        }
+        memset(slots, 0xff, (size_t)newCapacity * sizeof(int));
+        free(dictionary->termSlots);
+        dictionary->termSlots = slots;
+        dictionary->termSlotCapacity = newCapacity;
+        for (int old = 0; old < term; old++) {
+            unsigned int i = hashDoctorName(dictionary->terms[old].word) & (unsigned int)(newCapacity - 1);
+            while (slots[i] >= 0) {
+                i = (i + 1) & (unsigned int)(newCapacity - 1);
+            }
+            slots[i] = old;
+        }
+    }
+    char *copy = malloc(strlen(word) + 1);
+    if (copy == NULL) {
+        return -1;
+    }
+    strcpy(copy, word);
+    dictionary->terms[term] = (DiagnosisTerm){copy, NULL, 0, 0, -1};
+
+    // Words are added far less often than looked up, so the sorted order is kept by insertion
+    int low = 0, high = term;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (strcmp(dictionary->terms[dictionary->termOrder[middle]].word, word) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    memmove(dictionary->termOrder + low + 1, dictionary->termOrder + low, (size_t)(term - low) * sizeof(int));
+    dictionary->termOrder[low] = term;
+    unsigned int mask = (unsigned int)dictionary->termSlotCapacity - 1;
+    unsigned int i = hash & mask;
+    while (dictionary->termSlots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    dictionary->termSlots[i] = term;
+    dictionary->termCount++;
+    return term;
+}
+
+// Function to add a new diagnosis code to the posting list of every word of its text
+// (diagnosisLock held alone). Returns 1 if memory runs out.
+int indexDiagnosisWords(int code, const char *text) {
+    char word[DIAGNOSIS_MAX_LENGTH];
+    while (nextDiagnosisWord(&text, word) > 0) {
+        int t = findDiagnosisTerm(word, 1);
+        if (t < 0) {
+            return 1;
+        }
+        DiagnosisTerm *term = &diagnosisDictionary.terms[t];
+        if (term->lastCode == code) {
+            continue; // Word seen before in this text
+        }
+        if (term->lastCode > code) {
+            // A reused code: it goes in its place in the list (nothing if the word was seen before)
+            if (recodeDiagnosisPostings(term, NULL, code) != 0) {
+                return 1;
+            }
+            continue;
+        }
+        if (growArray((void **)&term->postings, &term->capacity, term->size + 5, 1) != 0) {
+            return 1;
+        }
+        writePostingDelta(term->postings, &term->size, (unsigned int)(code - term->lastCode));
+        term->lastCode = code;
+    }
+    return 0;
+}
+
+// Helper functions to read and write one varint distance of a posting list, moving *at past it
+unsigned int readPostingDelta(const unsigned char *postings, int *at) {
+    unsigned int delta = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char byte = postings[(*at)++];
+        delta |= (unsigned int)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return delta;
+        }
+    }
+}
+
+void writePostingDelta(unsigned char *postings, int *at, unsigned int delta) {
+    for (; delta >= 0x80; delta >>= 7) {
+        postings[(*at)++] = (unsigned char)(delta | 0x80);
+    }
+    postings[(*at)++] = (unsigned char)delta;
+}
+
+// Function to rewrite a word's posting list in place, keeping the codes set in keep (every
+// code with keep NULL) and adding insert in its place unless it is -1 or already there.
+// Dropping codes never lengthens the list; the list is first moved up by the most one insert
+// can add, so the rewrite never overtakes what is still to be read. Returns 1 if memory runs out.
+int recodeDiagnosisPostings(DiagnosisTerm *term, const uint64_t *keep, int insert) {
+    int gap = insert >= 0 ? 5 : 0;
+    if (growArray((void **)&term->postings, &term->capacity, term->size + gap, 1) != 0) {
+        return 1;
+    }
+    if (gap > 0) {
+        memmove(term->postings + gap, term->postings, (size_t)term->size);
+    }
+    int end = term->size + gap, size = 0, code = -1, last = -1;
+    for (int at = gap; at < end; ) {
+        code += (int)readPostingDelta(term->postings, &at);
+        if (insert >= 0 && insert <= code) {
+            if (insert < code) {
+                writePostingDelta(term->postings, &size, (unsigned int)(insert - last));
+                last = insert;
+            }
+            insert = -1;
+        }
+        if (keep == NULL || (keep[code / 64] >> (code % 64) & 1)) {
+            writePostingDelta(term->postings, &size, (unsigned int)(code - last));
+            last = code;
+        }
+    }
+    if (insert >= 0) {
+        writePostingDelta(term->postings, &size, (unsigned int)(insert - last));
+        last = insert;
+    }
+    term->size = size;
+    term->lastCode = last;
+    return 0;
+}
+
+// Function to give the diagnosis codes no patient has any more back to the dictionary
+// (storeLock held alone, between commands; compactJournalIfDue runs it with each snapshot).
+// Their words drop out of the word index, and words left with no codes are forgotten; unused
+// codes at the end are dropped from the count and the rest go on the free list. Their texts
+// stay put, as a lock-free lookup may still be copying one (see lookupPatient).
+void sweepDiagnosisDictionary() {
+    DiagnosisDictionary *dictionary = &diagnosisDictionary;
+    uint64_t *used = calloc((size_t)(dictionary->count + 63) / 64 + 1, sizeof(uint64_t));
+    if (used == NULL) {
+        return; // Tried again with the next snapshot
+    }
+    acquireLock(&diagnosisLock, 1);
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        const PatientStore *patients = &shards[s].patients;
+        int codes = patients->diagnosisListCapacity < dictionary->count ? patients->diagnosisListCapacity : dictionary->count;
+        for (int code = 0; code < codes; code++) {
+            if (patients->diagnosisLists[code].patients > 0) {
+                used[code / 64] |= (uint64_t)1 << (code % 64);
+            }
+        }
+    }
+    int count = dictionary->count, unused = 0;
+    while (count > 0 && !(used[(count - 1) / 64] >> ((count - 1) % 64) & 1)) {
+        count--;
+    }
+    for (int code = 0; code < count; code++) {
+        unused += !(used[code / 64] >> (code % 64) & 1);
+    }
+    // Free codes are never in use, so the same number of them means nothing new to give back
+    if ((count == dictionary->count && unused == dictionary->freeCount) ||
+        growArray((void **)&dictionary->freeCodes, &dictionary->freeCapacity, unused, sizeof(int)) != 0) {
+        releaseLock(&diagnosisLock, 1);
+        free(used);
+        return;
+    }
+
+    dictionary->freeCount = 0;
+    for (int code = count - 1; code >= 0; code--) {
+        if (!(used[code / 64] >> (code % 64) & 1)) {
+            dictionary->freeCodes[dictionary->freeCount++] = code;
+        }
+    }
+    dictionary->count = count;
+    memset(dictionary->slots, 0xff, (size_t)dictionary->slotCapacity * sizeof(int));
+    unsigned int mask = (unsigned int)dictionary->slotCapacity - 1;
+    for (int code = 0; code < count; code++) {
+        if (used[code / 64] >> (code % 64) & 1) {
+            unsigned int i = hashDoctorName(diagnosisText(code)) & mask;
+            while (dictionary->slots[i] >= 0) {
+                i = (i + 1) & mask;
+            }
+            dictionary->slots[i] = code;
+        }
+    }
+
+    // The word index: dropping codes needs no memory, dropping words needs a map of the moves
+    for (int t = 0; t < dictionary->termCount; t++) {
+        recodeDiagnosisPostings(&dictionary->terms[t], used, -1);
+    }
+    int *moved = malloc((size_t)(dictionary->termCount ? dictionary->termCount : 1) * sizeof(int));
+    if (moved != NULL) {
+        int kept = 0, ordered = 0;
+        for (int t = 0; t < dictionary->termCount; t++) {
+            if (dictionary->terms[t].size > 0) {
+                moved[t] = kept;
+                dictionary->terms[kept++] = dictionary->terms[t];
+            } else {
+                moved[t] = -1;
+                free(dictionary->terms[t].word);
+                free(dictionary->terms[t].postings);
+            }
+        }
+        for (int i = 0; i < dictionary->termCount; i++) {
+            if (moved[dictionary->termOrder[i]] >= 0) {
+                dictionary->termOrder[ordered++] = moved[dictionary->termOrder[i]];
+            }
+        }
+        dictionary->termCount = kept;
+        memset(dictionary->termSlots, 0xff, (size_t)dictionary->termSlotCapacity * sizeof(int));
+        unsigned int termMask = (unsigned int)dictionary->termSlotCapacity - 1;
+        for (int t = 0; t < kept; t++) {
+            unsigned int i = hashDoctorName(dictionary->terms[t].word) & termMask;
+            while (dictionary->termSlots[i] >= 0) {
+                i = (i + 1) & termMask;
+            }
+            dictionary->termSlots[i] = t;
+        }
+        free(moved);
+    }
+    releaseLock(&diagnosisLock, 1);
+    free(used);
+
+    // The stores forget the codes they cached, and lists far past the codes left shrink
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        PatientStore *patients = &shards[s].patients;
+        memset(patients->diagnosisCache, 0, sizeof(patients->diagnosisCache));
+        int capacity = count > PATIENT_STORE_MIN_CAPACITY ? count : PATIENT_STORE_MIN_CAPACITY;
+        if (patients->diagnosisListCapacity > 2 * capacity) {
+            DiagnosisList *lists = realloc(patients->diagnosisLists, (size_t)capacity * sizeof(DiagnosisList));
+            if (lists != NULL) {
+                patients->diagnosisLists = lists;
+                patients->diagnosisListCapacity = capacity;
+            }
+        }
+    }
+}
+
+// Helper function to set the bit of every code in a word's posting list
+void markDiagnosisTerm(const DiagnosisTerm *term, uint64_t *bits) {
+    int code = -1;
+    for (int i = 0; i < term->size; ) {
+        code += (int)readPostingDelta(term->postings, &i);
+        bits[code / 64] |= (uint64_t)1 << (code % 64);
+    }
+}
+
+// Helper function to set the bits of the codes of a word, or of every word starting with it
+void matchDiagnosisWord(const char *word, int prefix, uint64_t *bits) {
+    const DiagnosisDictionary *dictionary = &diagnosisDictionary;
+    if (!prefix) {
+        int term = findDiagnosisTerm(word, 0);
+        if (term >= 0) {
+            markDiagnosisTerm(&dictionary->terms[term], bits);
+        }
+        return;
+    }
+    size_t length = strlen(word);
+    int low = 0, high = dictionary->termCount;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (strcmp(dictionary->terms[dictionary->termOrder[middle]].word, word) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (; low < dictionary->termCount && strncmp(dictionary->terms[dictionary->termOrder[low]].word, word, length) == 0; low++) {
+        markDiagnosisTerm(&dictionary->terms[dictionary->termOrder[low]], bits);
+    }
+}
+
+// Helper function for qsort: order patient places by patient ID
+int comparePatientRefIDs(const void *a, const void *b) {
+    const PatientRef *x = a, *y = b;
+    int idX = shards[x->shard].patients.patientIDs[x->row];
+    int idY = shards[y->shard].patients.patientIDs[y->row];
+    return (idX > idY) - (idX < idY);
+}
+
+// Function to find every patient whose diagnosis matches a word query, in ID order
+// Words must all appear (in any case and order); "OR" between words starts another set of
+// words, any of which may match instead, and a word ending in '*' matches any word starting
+// with it: "chest pain OR angina" or "pneum*". Each word is one bitmap of the diagnosis codes
+// it appears in, ANDed within a set and ORed across sets; the patients then come straight
+// from the shards' lists for each matching code. Callers hold the shard locks (shared).
+// Returns the number of matches, their places in *refsOut (caller frees), or -1 if memory ran out.
+int findPatientsByDiagnosis(const char *query, PatientRef **refsOut) {
+    uint64_t started = metricsStart();
+    *refsOut = NULL;
+    acquireLock(&diagnosisLock, 0);
+    int words = (diagnosisDictionary.count + 63) / 64;
+    uint64_t *matched = calloc((size_t)words + 1, sizeof(uint64_t));
+    uint64_t *group = calloc((size_t)words + 1, sizeof(uint64_t));
+    uint64_t *term = calloc((size_t)words + 1, sizeof(uint64_t));
+    if (matched == NULL || group == NULL || term == NULL) {
+        releaseLock(&diagnosisLock, 0);
+        free(matched);
+        free(group);
+        free(term);
+        return -1;
+    }
+
+    char piece[DIAGNOSIS_MAX_LENGTH], word[DIAGNOSIS_MAX_LENGTH];
+    int terms = 0; // Words in the current set so far
+    const char *next = query;
+    for (;;) {
+        int length = 0;
+        while (*next == ' ' || *next == '\t') {
+            next++;
+        }
+        while (*next != 0 && *next != ' ' && *next != '\t') {
+            if (length < DIAGNOSIS_MAX_LENGTH - 1) {
+                piece[length++] = *next;
+            }
+            next++;
+        }
+        piece[length] = 0;
+        if (length == 0 || strcmp(piece, "OR") == 0) {
+            for (int w = 0; w < words && terms > 0; w++) {
+                matched[w] |= group[w];
+            }
+            terms = 0;
+            if (length == 0) {
+                break;
+            }
+            continue;
+        }
+        // A piece like "covid-19" is the words "covid" and "19", as in the diagnoses
+        int prefix = piece[length - 1] == '*';
+        char following[DIAGNOSIS_MAX_LENGTH];
+        const char *text = piece;
+        int more = nextDiagnosisWord(&text, word) > 0;
+        while (more) {
+            more = nextDiagnosisWord(&text, following) > 0;
+            memset(term, 0, (size_t)words * sizeof(uint64_t));
+            matchDiagnosisWord(word, prefix && !more, term);
+            for (int w = 0; w < words; w++) {
+                group[w] = terms == 0 ? term[w] : group[w] & term[w];
+            }
+            terms++;
+            memcpy(word, following, sizeof(word));
+        }
+    }
+    releaseLock(&diagnosisLock, 0);
+    free(group);
+    free(term);
+
+    // Few matches in a shard are picked off its lists; many are found in one pass down its
+    // code column instead, which also leaves them in row order and so quicker to sort by ID
+    PatientRef *refs = NULL;
+    int count = 0, capacity = 0;
+    for (int s = 0; s < STORE_SHARDS && count >= 0; s++) {
+        const PatientStore *patients = &shards[s].patients;
+        int codes = patients->diagnosisListCapacity < words * 64 ? patients->diagnosisListCapacity : words * 64;
+        int hits = 0;
+        for (int code = 0; code < codes; code++) {
+            if (matched[code / 64] >> (code % 64) & 1) {
+                hits += patients->diagnosisLists[code].patients;
+            }
+        }
+        if (growArray((void **)&refs, &capacity, count + hits, sizeof(PatientRef)) != 0) {
+            count = -1;
+        } else if (hits > patients->count / 8) {
+            for (int row = 0; row < patients->count; row++) {
+                int code = patients->diagnosisCodes[row];
+                if (matched[code / 64] >> (code % 64) & 1) {
+                    refs[count++] = (PatientRef){s, row};
+                }
+            }
+        } else {
+            for (int code = 0; code < codes; code++) {
+                if (!(matched[code / 64] >> (code % 64) & 1)) {
+                    continue;
+                }
+                for (int row = patients->diagnosisLists[code].firstRow; row >= 0; row = patients->diagnosisNext[row]) {
+                    refs[count++] = (PatientRef){s, row};
+                }
+            }
+        }
+    }
+    free(matched);
+    if (count < 0) {
+        free(refs);
+        return -1;
+    }
+    if (count > 1) {
+        qsort(refs, (size_t)count, sizeof(PatientRef), comparePatientRefIDs);
+    }
+    *refsOut = refs;
+    metricsCount(METRIC_ROWS_VISITED, (uint64_t)count);
+    metricsObserve(METRIC_SEARCH_DIAGNOSIS, started);
+    return count;
+}
+
+// Helper functions to convert between calendar dates and days since 1970-01-01
+// (proleptic Gregorian calendar, no time zones involved)
+int daysFromDate(int year, int month, int day) {
+    year -= month <= 2;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+void dateFromDays(int days, char *text, size_t size) {
+    days += 719468;
+    int era = (days >= 0 ? days : days - 146096) / 146097;
+    int dayOfEra = days - era * 146097;
+    int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int monthIndex = (5 * dayOfYear + 2) / 153;
+    int day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    int month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    snprintf(text, size, "%04d-%02d-%02d", yearOfEra + era * 400 + (month <= 2), month, day);
+}
+
+// Helper function to read a date (YYYY-MM-DD) as days since 1970-01-01
+// Returns 1 if the text is not a valid date.
+int parseDay(const char *text, int *days) {
+    int year, month, day;
+    char given[32], check[32];
+    if (sscanf(text, "%d-%d-%d", &year, &month, &day) != 3 || year < 1900 || year > 9999) {
+        return 1;
+    }
+    *days = daysFromDate(year, month, day);
+    snprintf(given, sizeof(given), "%04d-%02d-%02d", year, month, day);
+    dateFromDays(*days, check, sizeof(check));
+    return strcmp(given, check) != 0; // Rejects dates like 2025-02-30
+}
+
+// Helper function to find the Sunday starting the week of a day
+int weekStart(int days) {
+    int weekday = ((days + 4) % DAYS_IN_WEEK + DAYS_IN_WEEK) % DAYS_IN_WEEK; // 1970-01-01 was a Thursday
+    return days - weekday;
+}
+
+// Helper function to break a time into local date and time fields
+// localtime() shares one buffer between threads, and server clients ask for the time at once.
+void localTime(time_t when, struct tm *local) {
+#ifdef _WIN32
+    if (localtime_s(local, &when) != 0) {
+#else
+    if (localtime_r(&when, local) == NULL) {
+#endif
+        memset(local, 0, sizeof(*local));
+        local->tm_year = 70; // 1970-01-01 for a time the C library cannot convert
+        local->tm_mday = 1;
+    }
+}
+
+// Helper function to find today's date and the shift running now
+// Shifts: morning 06:00-14:00, afternoon 14:00-22:00, evening 22:00-06:00 (it belongs to the day it starts).
+void currentDayAndShift(int *days, int *shift) {
+    struct tm local;
+    localTime(time(NULL), &local);
+    *days = daysFromDate(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+    if (local.tm_hour < 6) {
+        (*days)--;
+        *shift = 2;
+    } else {
+        *shift = local.tm_hour < 14 ? 0 : local.tm_hour < 22 ? 1 : 2;
+    }
+}
+
+// Function to find the roster's page for the week of a day
+// With create set, a missing page is added with empty indexes. Returns NULL if absent
+// (or out of memory); lookups never create, so they only read the roster.
+RosterWeek *findRosterWeek(int day, int create) {
+    int week = weekStart(day);
+    unsigned int hash = hashPatientID(week);
+    if (roster.weekSlotCapacity > 0) {
+        unsigned int mask = (unsigned int)roster.weekSlotCapacity - 1;
+        for (unsigned int i = hash & mask; roster.weekSlots[i] >= 0; i = (i + 1) & mask) {
+            if (roster.weeks[roster.weekSlots[i]].week == week) {
+                return &roster.weeks[roster.weekSlots[i]];
+            }
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    int page = roster.weekCount;
+    if (growArray((void **)&roster.weeks, &roster.weekCapacity, page + 1, sizeof(RosterWeek)) != 0) {
+        return NULL;
+    }
+    if ((page + 1) * 2 > roster.weekSlotCapacity) {
+        int newCapacity = roster.weekSlotCapacity ? roster.weekSlotCapacity * 2 : PATIENT_INDEX_MIN_CAPACITY;
+        int *slots = malloc((size_t)newCapacity * sizeof(int));
+        if (slots == NULL) {
+            return NULL;
+        }
+        memset(slots, 0xff, (size_t)newCapacity * sizeof(int));
+        free(roster.weekSlots);
+        roster.weekSlots = slots;
+        roster.weekSlotCapacity = newCapacity;
+        for (int old = 0; old < page; old++) {
+            unsigned int i = hashPatientID(roster.weeks[old].week) & (unsigned int)(newCapacity - 1);
+            while (slots[i] >= 0) {
+                i = (i + 1) & (unsigned int)(newCapacity - 1);
+            }
+            slots[i] = old;
+        }
+    }
+
+    RosterWeek *added = &roster.weeks[page];
+    memset(added, 0, sizeof(*added));
+    added->week = week;
+    memset(added->slotFirst, 0xff, sizeof(added->slotFirst));
+    unsigned int mask = (unsigned int)roster.weekSlotCapacity - 1;
+    unsigned int i = hash & mask;
+    while (roster.weekSlots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    roster.weekSlots[i] = page;
+    roster.weekCount++;
+    return added;
+}
+
+// Helper function to check a day read from a file against the dates parseDay accepts
+int validRosterDay(int day) {
+    return day >= daysFromDate(1900, 1, 1) && day <= daysFromDate(9999, 12, 31);
+}
+
+// Function to put a doctor on a shift of a ward
+// Returns 0 if added, 1 if the doctor already works that shift (in any ward), 2 if out of memory.
+int rosterAdd(int day, int shift, int ward, int doctorID) {
+    RosterWeek *week = findRosterWeek(day, 1);
+    if (week == NULL) {
+        return 2;
+    }
+    if (doctorID >= week->busyDoctors) {
+        int oldCount = week->busyDoctors;
+        if (growArray((void **)&week->busy, &week->busyDoctors, doctorID + 1, sizeof(uint32_t)) != 0) {
+            return 2;
+        }
+        memset(week->busy + oldCount, 0, (size_t)(week->busyDoctors - oldCount) * sizeof(uint32_t));
+    }
+    if (rosterDoctorBusy(doctorID, day, shift)) {
+        return 1;
+    }
+    int entry = roster.freeEntry;
+    if (entry >= 0) {
+        roster.freeEntry = roster.assignments[entry].next;
+    } else {
+        if (growArray((void **)&roster.assignments, &roster.capacity, roster.count + 1, sizeof(RosterAssignment)) != 0) {
+            return 2;
+        }
+        entry = roster.count++;
+    }
+
+    int dayShift = (day - week->week) * SHIFTS_IN_DAY + shift;
+    int slot = dayShift * WARD_COUNT + ward - 1;
+    RosterAssignment *assignment = &roster.assignments[entry];
+    assignment->day = day;
+    assignment->shift = shift;
+    assignment->ward = ward;
+    assignment->doctorID = doctorID;
+    assignment->next = week->slotFirst[slot];
+    week->slotFirst[slot] = entry;
+    week->coveredWards[dayShift] |= 1u << (ward - 1);
+    week->busy[doctorID] |= 1u << dayShift;
+    doctorRegistry.doctors[doctorID].shifts++;
+    roster.liveCount++;
+    return 0;
+}
+
+// Function to take a doctor off a shift of a ward
+// Returns 1 if the doctor was not on it.
+int rosterRemove(int day, int shift, int ward, int doctorID) {
+    RosterWeek *week = findRosterWeek(day, 0);
+    if (week == NULL) {
+        return 1;
+    }
+    int dayShift = (day - week->week) * SHIFTS_IN_DAY + shift;
+    int slot = dayShift * WARD_COUNT + ward - 1;
+    int *link = &week->slotFirst[slot];
+    while (*link >= 0 && roster.assignments[*link].doctorID != doctorID) {
+        link = &roster.assignments[*link].next;
+    }
+    if (*link < 0) {
+        return 1;
+    }
+
+    int entry = *link;
+    *link = roster.assignments[entry].next;
+    roster.assignments[entry].doctorID = NO_DOCTOR;
+    roster.assignments[entry].next = roster.freeEntry;
+    roster.freeEntry = entry;
+    if (week->slotFirst[slot] < 0) {
+        week->coveredWards[dayShift] &= ~(1u << (ward - 1));
+    }
+    week->busy[doctorID] &= ~(1u << dayShift);
+    doctorRegistry.doctors[doctorID].shifts--;
+    roster.liveCount--;
+    return 0;
+}
+
+// Helper functions to look up the roster (the week's page, then direct index reads)
+// First assignment of a slot, -1 if nobody is on it
+int rosterSlotFirst(int day, int shift, int ward) {
+    const RosterWeek *week = findRosterWeek(day, 0);
+    if (week == NULL) {
+        return -1;
+    }
+    return week->slotFirst[((day - week->week) * SHIFTS_IN_DAY + shift) * WARD_COUNT + ward - 1];
+}
+
+// Bit (ward - 1) is set for each ward with a doctor on that shift
+uint32_t rosterCoverage(int day, int shift) {
+    const RosterWeek *week = findRosterWeek(day, 0);
+    if (week == NULL) {
+        return 0;
+    }
+    return week->coveredWards[(day - week->week) * SHIFTS_IN_DAY + shift];
+}
+
+// 1 if the doctor works that shift in some ward
+int rosterDoctorBusy(int doctorID, int day, int shift) {
+    const RosterWeek *week = findRosterWeek(day, 0);
+    if (week == NULL || doctorID >= week->busyDoctors) {
+        return 0;
+    }
+    return (week->busy[doctorID] >> ((day - week->week) * SHIFTS_IN_DAY + shift)) & 1;
+}
+
+// Function to empty the roster (the doctors stay registered)
+void clearRoster() {
+    for (int i = 0; i < roster.count; i++) {
+        if (roster.assignments[i].doctorID != NO_DOCTOR) {
+            rosterRemove(roster.assignments[i].day, roster.assignments[i].shift,
+                         roster.assignments[i].ward, roster.assignments[i].doctorID);
+        }
+    }
+    roster.count = 0;
+    roster.freeEntry = -1;
+    // The pages go too, so a roster that is loaded again keeps none for weeks it no longer has
+    for (int page = 0; page < roster.weekCount; page++) {
+        free(roster.weeks[page].busy);
+    }
+    roster.weekCount = 0;
+    if (roster.weekSlotCapacity > 0) {
+        memset(roster.weekSlots, 0xff, (size_t)roster.weekSlotCapacity * sizeof(int));
+    }
+}
+
+// Function to release the roster's memory
+void freeRoster() {
+    for (int page = 0; page < roster.weekCount; page++) {
+        free(roster.weeks[page].busy);
+    }
+    free(roster.assignments);
+    free(roster.weeks);
+    free(roster.weekSlots);
+    memset(&roster, 0, sizeof(roster));
+    roster.freeEntry = -1;
+}
+
+// Function to copy the roster out as RosterRecords (for files)
+// Returns the number of records, or -1 if out of memory.
+int rosterToRecords(RosterRecord **recordsOut) {
+    RosterRecord *records = calloc((size_t)(roster.liveCount ? roster.liveCount : 1), sizeof(RosterRecord));
+    if (records == NULL) {
+        return -1;
+    }
+    int count = 0;
+    for (int i = 0; i < roster.count; i++) {
+        const RosterAssignment *assignment = &roster.assignments[i];
+        if (assignment->doctorID != NO_DOCTOR) {
+            records[count].day = assignment->day;
+            records[count].shift = assignment->shift;
+            records[count].ward = assignment->ward;
+            strcpy(records[count].doctorName, doctorName(assignment->doctorID));
+            count++;
+        }
+    }
+    *recordsOut = records;
+    return count;
+}
+
+// Function to replace the roster with the given records (records out of range are skipped)
+void loadRosterRecords(const RosterRecord *records, int count) {
+    clearRoster();
+    for (int i = 0; i < count; i++) {
+        char name[NAME_MAX_LENGTH];
+        memcpy(name, records[i].doctorName, NAME_MAX_LENGTH);
+        name[NAME_MAX_LENGTH - 1] = 0;
+        int doctorID = findDoctor(name, 1);
+        if (doctorID > NO_DOCTOR && validRosterDay(records[i].day) && records[i].shift >= 0 &&
+            records[i].shift < SHIFTS_IN_DAY && records[i].ward >= 1 && records[i].ward <= WARD_COUNT) {
+            rosterAdd(records[i].day, records[i].shift, records[i].ward, doctorID);
+        }
+    }
+}
+
+// Function to turn an old weekly schedule into roster records
+// It had no dates or wards, so it becomes the current week's roster for ward 1.
+// Returns the number of records, or -1 if out of memory.
+int weeklyToRoster(DoctorSchedule (*names)[SHIFTS_IN_DAY], RosterRecord **recordsOut) {
+    RosterRecord *records = calloc(DAYS_IN_WEEK * SHIFTS_IN_DAY, sizeof(RosterRecord));
+    if (records == NULL) {
+        return -1;
+    }
+    int today, shiftNow, count = 0;
+    currentDayAndShift(&today, &shiftNow);
+    for (int day = 0; day < DAYS_IN_WEEK; day++) {
+        for (int shift = 0; shift < SHIFTS_IN_DAY; shift++) {
+            names[day][shift].DoctorName[NAME_MAX_LENGTH - 1] = 0;
+            if (names[day][shift].DoctorName[0] != 0) {
+                records[count].day = weekStart(today) + day;
+                records[count].shift = shift;
+                records[count].ward = 1;
+                strcpy(records[count].doctorName, names[day][shift].DoctorName);
+                count++;
+            }
+        }
+    }
+    *recordsOut = records;
+    return count;
+}
+
+// Function to find a room's entry in the room index
+// With create set, an unknown room gets an empty entry. Returns -1 if absent (or out of memory).
+int findRoomEntry(PatientStore *patients, int roomNumber, int create) {
+    if (patients->roomSlotCapacity > 0) {
+        unsigned int mask = (unsigned int)patients->roomSlotCapacity - 1;
+        for (unsigned int i = hashPatientID(roomNumber) & mask;; i = (i + 1) & mask) {
+            int entry = patients->roomSlots[i];
+            if (entry < 0) {
+                break;
+            }
+            if (patients->rooms[entry].roomNumber == roomNumber) {
+                return entry;
+            }
+        }
+    }
+    if (!create || growArray((void **)&patients->rooms, &patients->roomCapacity,
+                             patients->roomCount + 1, sizeof(RoomEntry)) != 0) {
+        return -1;
+    }
+
+    // Keep the hash at most half full; rebuilding it only needs the room numbers
+    if ((patients->roomCount + 1) * 2 > patients->roomSlotCapacity) {
+        int newCapacity = patients->roomSlotCapacity ? patients->roomSlotCapacity * 2 : PATIENT_INDEX_MIN_CAPACITY;
+        int *slots = malloc((size_t)newCapacity * sizeof(int));
+        if (slots == NULL) {
+            return -1;
+        }
+        memset(slots, 0xff, (size_t)newCapacity * sizeof(int));
+        free(patients->roomSlots);
+        patients->roomSlots = slots;
+        patients->roomSlotCapacity = newCapacity;
+        for (int entry = 0; entry < patients->roomCount; entry++) {
+            unsigned int i = hashPatientID(patients->rooms[entry].roomNumber) & (unsigned int)(newCapacity - 1);
+            while (slots[i] >= 0) {
+                i = (i + 1) & (unsigned int)(newCapacity - 1);
+            }
+            slots[i] = entry;
+        }
+    }
+
+    int entry = patients->roomCount++;
+    patients->rooms[entry].roomNumber = roomNumber;
+    patients->rooms[entry].occupants = 0;
+    patients->rooms[entry].firstRow = -1;
+    unsigned int mask = (unsigned int)patients->roomSlotCapacity - 1;
+    unsigned int i = hashPatientID(roomNumber) & mask;
+    while (patients->roomSlots[i] >= 0) {
+        i = (i + 1) & mask;
+    }
+    patients->roomSlots[i] = entry;
+    return entry;
+}
+
+// Helper function to put a row at the front of its room's list
+void linkRoomRow(PatientStore *patients, int row, int entry) {
+    RoomEntry *room = &patients->rooms[entry];
+    patients->roomPrev[row] = -1;
+    patients->roomNext[row] = room->firstRow;
+    if (room->firstRow >= 0) {
+        patients->roomPrev[room->firstRow] = row;
+    }
+    room->firstRow = row;
+    room->occupants++;
+}
+
+// Helper function to take a row out of its room's list
+void unlinkRoomRow(PatientStore *patients, int row) {
+    RoomEntry *room = &patients->rooms[findRoomEntry(patients, patients->roomNumbers[row], 0)];
+    int previous = patients->roomPrev[row], next = patients->roomNext[row];
+    if (previous >= 0) {
+        patients->roomNext[previous] = next;
+    } else {
+        room->firstRow = next;
+    }
+    if (next >= 0) {
+        patients->roomPrev[next] = previous;
+    }
+    room->occupants--;
+}
+
+// Helper function to make room for the list of a diagnosis code (new lists start empty)
+int reserveDiagnosisLists(PatientStore *patients, int code) {
+    int oldCapacity = patients->diagnosisListCapacity;
+    if (growArray((void **)&patients->diagnosisLists, &patients->diagnosisListCapacity, code + 1, sizeof(DiagnosisList)) != 0) {
+        return 1;
+    }
+    for (int added = oldCapacity; added < patients->diagnosisListCapacity; added++) {
+        patients->diagnosisLists[added] = (DiagnosisList){0, -1};
+    }
+    return 0;
+}
+
+// Helper function to put a row at the front of its diagnosis code's list
+void linkDiagnosisRow(PatientStore *patients, int row, int code) {
+    DiagnosisList *list = &patients->diagnosisLists[code];
+    patients->diagnosisPrev[row] = -1;
+    patients->diagnosisNext[row] = list->firstRow;
+    if (list->firstRow >= 0) {
+        patients->diagnosisPrev[list->firstRow] = row;
+    }
+    list->firstRow = row;
+    list->patients++;
+}
+
+// Helper function to take a row out of its diagnosis code's list
+void unlinkDiagnosisRow(PatientStore *patients, int row) {
+    DiagnosisList *list = &patients->diagnosisLists[patients->diagnosisCodes[row]];
+    int previous = patients->diagnosisPrev[row], next = patients->diagnosisNext[row];
+    if (previous >= 0) {
+        patients->diagnosisNext[previous] = next;
+    } else {
+        list->firstRow = next;
+    }
+    if (next >= 0) {
+        patients->diagnosisPrev[next] = previous;
+    }
+    list->patients--;
+}
+
+// Helper function to compare two rows in the order of an ordered index (key, then patient ID)
+// The rows may belong to different shards.
+int compareOrderRows(const PatientStore *a, int rowA, const PatientStore *b, int rowB, int sortBy) {
+    int order = 0;
+    if (sortBy == SORT_BY_NAME) {
+        order = compareFoldedNames(a->names[rowA], b->names[rowB]);
+    } else if (sortBy == SORT_BY_ROOM) {
+        order = (a->roomNumbers[rowA] > b->roomNumbers[rowB]) - (a->roomNumbers[rowA] < b->roomNumbers[rowB]);
+    } else if (sortBy == SORT_BY_AGE) {
+        order = (a->ages[rowA] > b->ages[rowB]) - (a->ages[rowA] < b->ages[rowB]);
+    }
+    if (order == 0) {
+        order = (a->patientIDs[rowA] > b->patientIDs[rowB]) - (a->patientIDs[rowA] < b->patientIDs[rowB]);
+    }
+    return order;
+}
+
+// Helper function to pack a row's place in an order into 64 bits
+// Numbers: key, then ID, both offset to sort unsigned. Names: the first 4 folded characters
+// only, so equal packed names still need compareOrderRows.
+uint64_t orderNodeKey(const PatientStore *patients, int row, int sortBy) {
+    if (sortBy == SORT_BY_NAME) {
+        const char *name = patients->names[row];
+        uint64_t key = 0;
+        for (int i = 0, ended = 0; i < 4; i++) {
+            ended |= name[i] == 0;
+            key = key << 8 | (ended ? 0 : foldNameChar(name[i]));
+        }
+        return key << 32;
+    }
+    int key = sortBy == SORT_BY_ROOM ? patients->roomNumbers[row] :
+              sortBy == SORT_BY_AGE ? patients->ages[row] : patients->patientIDs[row];
+    return (uint64_t)((uint32_t)key ^ 0x80000000u) << 32 | ((uint32_t)patients->patientIDs[row] ^ 0x80000000u);
+}
+
+// Helper function to compare two nodes of an ordered index (possibly from different shards)
+int compareOrderNodes(const PatientStore *a, const OrderNode *x, const PatientStore *b, const OrderNode *y, int sortBy) {
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return sortBy == SORT_BY_NAME ? compareOrderRows(a, x->row, b, y->row, sortBy) : 0;
+}
+
+// Helper function to compare a row's key with one end of a range (see OrderBound)
+int compareOrderBound(const PatientStore *patients, int row, int sortBy, const OrderBound *bound) {
+    if (sortBy == SORT_BY_NAME) {
+        const char *name = patients->names[row], *text = bound->name;
+        while (*text != 0 && foldNameChar(*name) == foldNameChar(*text)) {
+            name++;
+            text++;
+        }
+        return *text == 0 ? 0 : (int)foldNameChar(*name) - (int)foldNameChar(*text);
+    }
+    int key = sortBy == SORT_BY_ROOM ? patients->roomNumbers[row] :
+              sortBy == SORT_BY_AGE ? patients->ages[row] : patients->patientIDs[row];
+    return (key > bound->value) - (key < bound->value);
+}
+
+// Helper function to compare rows for qsort while an ordered index is built
+int compareOrderSortRows(const void *a, const void *b) {
+    return compareOrderRows(orderSortStore, *(const int *)a, orderSortStore, *(const int *)b, orderSortBy);
+}
+
+// Helper function to pick the height of a new tower: 1, then each further level 1 time in 4
+int randomOrderHeight(PatientStore *patients) {
+    uint32_t x = patients->orderSeed ? patients->orderSeed : 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    patients->orderSeed = x;
+    int height = 1;
+    while (height < ORDER_LEVELS && (x & 3) == 0) {
+        height++;
+        x >>= 2;
+    }
+    return height;
+}
+
+// Helper function to take an ordered index node of the given height from the store's pools
+// Taller towers are rarer, so their slabs are smaller. Returns NULL if memory runs out.
+OrderNode *newOrderNode(PatientStore *patients, int height) {
+    BlockPool *pool = &patients->orderPools[height - 1];
+    if (pool->blockSize == 0) {
+        int perSlab = ORDER_NODES_PER_SLAB >> (2 * (height - 1));
+        pool->blockSize = sizeof(OrderNode) + (size_t)height * sizeof(OrderNode *);
+        pool->blocksPerSlab = perSlab > 16 ? perSlab : 16;
+    }
+    OrderNode *node = poolAlloc(pool);
+    if (node != NULL) {
+        node->height = height;
+    }
+    return node;
+}
+
+// Helper function to put a node (its row already filled in) into an ordered index
+// links is the current node's array of next links, starting with the heads.
+void linkOrderNode(PatientStore *patients, int sortBy, OrderNode *node) {
+    OrderNode **links = patients->orderHeads[sortBy - 1];
+    OrderNode *before = NULL; // Node whose links these are, NULL for the heads
+    node->key = orderNodeKey(patients, node->row, sortBy);
+    for (int level = ORDER_LEVELS - 1; level >= 0; level--) {
+        while (links[level] != NULL && compareOrderNodes(patients, links[level], patients, node, sortBy) < 0) {
+            before = links[level];
+            links = before->next;
+        }
+        if (level < node->height) {
+            node->next[level] = links[level];
+            links[level] = node;
+        }
+    }
+    node->prev = before;
+    if (node->next[0] != NULL) {
+        node->next[0]->prev = node;
+    }
+    patients->orderNodes[sortBy - 1][node->row] = node;
+}
+
+// Helper function to take a node out of an ordered index (it is not freed)
+// No search: the node before it at each level is the nearest earlier tower that tall, found
+// by walking back along level 0 (a few steps on average, since 3 towers in 4 are 1 high).
+void unlinkOrderNode(PatientStore *patients, int sortBy, OrderNode *node) {
+    OrderNode **heads = patients->orderHeads[sortBy - 1];
+    OrderNode *before = node->prev;
+    for (int level = 0; level < node->height; level++) {
+        while (before != NULL && before->height <= level) {
+            before = before->prev;
+        }
+        (before != NULL ? before->next : heads)[level] = node->next[level];
+    }
+    if (node->next[0] != NULL) {
+        node->next[0]->prev = node->prev;
+    }
+}
+
+// Helper function to empty an ordered index, giving its nodes back to the pools
+void clearOrderIndex(PatientStore *patients, int sortBy) {
+    OrderNode **heads = patients->orderHeads[sortBy - 1];
+    for (OrderNode *node = heads[0], *next; node != NULL; node = next) {
+        next = node->next[0];
+        poolFree(&patients->orderPools[node->height - 1], node);
+    }
+    memset(heads, 0, ORDER_LEVELS * sizeof(OrderNode *));
+    atomic_fetch_and(&patients->orderBuilt, ~(1 << (sortBy - 1)));
+}
+
+// Function to build an ordered index of a store from scratch
+// The rows are sorted once and every level is linked from front to back, with no searching.
+// Returns 1 if memory runs out (the index is then left unbuilt).
+int buildOrderIndex(PatientStore *patients, int sortBy) {
+    int capacity = patients->capacity > 0 ? patients->capacity : 1;
+    OrderNode **nodes = realloc(patients->orderNodes[sortBy - 1], (size_t)capacity * sizeof(OrderNode *));
+    int *rows = malloc((size_t)(patients->count > 0 ? patients->count : 1) * sizeof(int));
+    if (nodes != NULL) {
+        patients->orderNodes[sortBy - 1] = nodes;
+    }
+    if (nodes == NULL || rows == NULL) {
+        free(rows);
+        return 1;
+    }
+    for (int row = 0; row < patients->count; row++) {
+        rows[row] = row;
+    }
+    orderSortStore = patients;
+    orderSortBy = sortBy;
+    qsort(rows, (size_t)patients->count, sizeof(int), compareOrderSortRows);
+
+    OrderNode **heads = patients->orderHeads[sortBy - 1];
+    OrderNode **tails[ORDER_LEVELS]; // Link to fill in next at each level
+    for (int level = 0; level < ORDER_LEVELS; level++) {
+        heads[level] = NULL;
+        tails[level] = &heads[level];
+    }
+    int failed = 0;
+    OrderNode *previous = NULL;
+    for (int i = 0; i < patients->count && !failed; i++) {
+        OrderNode *node = newOrderNode(patients, randomOrderHeight(patients));
+        if (node == NULL) {
+            failed = 1;
+            break;
+        }
+        node->row = rows[i];
+        node->key = orderNodeKey(patients, rows[i], sortBy);
+        node->prev = previous;
+        previous = node;
+        nodes[rows[i]] = node;
+        for (int level = 0; level < node->height; level++) {
+            *tails[level] = node;
+            tails[level] = &node->next[level];
+        }
+    }
+    for (int level = 0; level < ORDER_LEVELS; level++) {
+        *tails[level] = NULL;
+    }
+    free(rows);
+    if (failed) {
+        clearOrderIndex(patients, sortBy);
+        return 1;
+    }
+    atomic_fetch_or_explicit(&patients->orderBuilt, 1 << (sortBy - 1), memory_order_release);
+    return 0;
+}
+
+// Helper function for runParallel: build an ordered index in every parts-th shard lacking it
+void buildOrderPart(int part, int parts, void *context) {
+    OrderBuildJob *job = context;
+    int bit = 1 << (job->sortBy - 1);
+    for (int s = part; s < STORE_SHARDS; s += parts) {
+        StoreShard *shard = &shards[s];
+        if (atomic_load_explicit(&shard->patients.orderBuilt, memory_order_acquire) & bit) {
+            continue;
+        }
+        acquireLock(&shard->orderLock, 1);
+        if (!(atomic_load(&shard->patients.orderBuilt) & bit) && buildOrderIndex(&shard->patients, job->sortBy) != 0) {
+            job->failed = 1;
+        }
+        releaseLock(&shard->orderLock, 1);
+    }
+}
+
+// Function to make sure every shard has an ordered index (callers hold the shard locks, shared)
+// The first listing in an order builds it, side by side across the shards; from then on
+// admissions and discharges keep it up to date. Returns 1 if memory ran out.
+int buildOrderIndexes(int sortBy) {
+    int bit = 1 << (sortBy - 1);
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        if (!(atomic_load_explicit(&shards[s].patients.orderBuilt, memory_order_acquire) & bit)) {
+            OrderBuildJob job = {sortBy, 0};
+            runParallel(buildOrderPart, &job, patientCount(), STORE_SHARDS);
+            return job.failed;
+        }
+    }
+    return 0;
+}
+
+// Function to start walking the census in an order, from the first patient at or after from
+// Every shard's index is searched down to its starting node; nextOrderRow then merges them.
+// Returns 1 if an index could not be built.
+int startOrderCursor(OrderCursor *cursor, int sortBy, const OrderBound *from, const OrderBound *to) {
+    if (buildOrderIndexes(sortBy) != 0) {
+        return 1;
+    }
+    cursor->sortBy = sortBy;
+    cursor->to = *to;
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        const PatientStore *patients = &shards[s].patients;
+        OrderNode *const *links = patients->orderHeads[sortBy - 1];
+        for (int level = ORDER_LEVELS - 1; level >= 0 && !from->open; level--) {
+            while (links[level] != NULL && compareOrderBound(patients, links[level]->row, sortBy, from) < 0) {
+                links = links[level]->next;
+            }
+        }
+        cursor->next[s] = links[0];
+    }
+    return 0;
+}
+
+// Function to take the next patient of an ordered walk, 0 once past the end of the range
+int nextOrderRow(OrderCursor *cursor, PatientRef *ref) {
+    int best = -1;
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        if (cursor->next[s] != NULL &&
+            (best < 0 || compareOrderNodes(&shards[s].patients, cursor->next[s],
+                                           &shards[best].patients, cursor->next[best], cursor->sortBy) < 0)) {
+            best = s;
+        }
+    }
+    if (best < 0 ||
+        (!cursor->to.open && compareOrderBound(&shards[best].patients, cursor->next[best]->row, cursor->sortBy, &cursor->to) > 0)) {
+        return 0;
+    }
+    ref->shard = best;
+    ref->row = cursor->next[best]->row;
+    cursor->next[best] = cursor->next[best]->next[0];
+    return 1;
+}
+
+// Function to find every patient whose key is in [from, to], in order
+// The places are returned in *refsOut (caller frees); the result is their number, or -1 if
+// memory ran out.
+int findPatientsInRange(int sortBy, const OrderBound *from, const OrderBound *to, PatientRef **refsOut) {
+    uint64_t started = metricsStart();
+    PatientRef *refs = NULL;
+    int count = 0, capacity = 0;
+    *refsOut = NULL;
+
+    OrderCursor cursor;
+    if (startOrderCursor(&cursor, sortBy, from, to) != 0) {
+        return -1;
+    }
+    PatientRef ref;
+    while (nextOrderRow(&cursor, &ref)) {
+        if (growArray((void **)&refs, &capacity, count + 1, sizeof(PatientRef)) != 0) {
+            free(refs);
+            return -1;
+        }
+        refs[count++] = ref;
+    }
+    *refsOut = refs;
+    metricsCount(METRIC_ROWS_VISITED, (uint64_t)count);
+    metricsObserve(METRIC_SEARCH_RANGE, started);
+    return count;
+}
+
+// Helper function to read one end of a range ("" or "-" leaves that end open)
+// Returns 1 for a bad number.
+int parseOrderBound(int sortBy, const char *text, OrderBound *bound) {
+    bound->open = text[0] == 0 || strcmp(text, "-") == 0;
+    bound->value = 0;
+    bound->name = text;
+    return !bound->open && sortBy != SORT_BY_NAME && parseBatchInt(text, &bound->value) != 0;
+}
+
+// Function to map a whole file read-only
+// Returns 1 if the file cannot be opened. An empty file maps to data == NULL.
+int mapFile(const char *path, MappedFile *mapped) {
+    memset(mapped, 0, sizeof(*mapped));
+#ifdef _WIN32
+    mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(mapped->file, &size);
+    mapped->size = (size_t)size.QuadPart;
+    if (mapped->size > 0) {
+        mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapped->mapping != NULL) {
+            mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+        if (mapped->data == NULL) {
+            unmapFile(mapped);
+            return 1;
+        }
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return 1;
+    }
+    mapped->size = (size_t)info.st_size;
+    if (mapped->size > 0) {
+        void *data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return 1;
+        }
+        posix_madvise(data, mapped->size, POSIX_MADV_SEQUENTIAL);
+        mapped->data = data;
+    }
+    close(fd); // The mapping stays valid after the descriptor is closed
+#endif
+    return 0;
+}
+
+// Function to release a mapping made by mapFile
+void unmapFile(MappedFile *mapped) {
+#ifdef _WIN32
+    if (mapped->data != NULL) UnmapViewOfFile(mapped->data);
+    if (mapped->mapping != NULL) CloseHandle(mapped->mapping);
+    if (mapped->file != NULL && mapped->file != INVALID_HANDLE_VALUE) CloseHandle(mapped->file);
+#else
+    if (mapped->data != NULL) munmap((void *)mapped->data, mapped->size);
+#endif
+    memset(mapped, 0, sizeof(*mapped));
+}
+
+// Helper functions to checksum records (Fletcher-style over 32-bit words)
+// Sizes must be a multiple of 4; the running sums catch both changed and reordered words.
+// Feeding blocks to checksumUpdate gives the same result as one fileChecksum call.
+void checksumUpdate(ChecksumState *state, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t word;
+        memcpy(&word, bytes + i, 4);
+        state->sum1 += word;
+        state->sum2 += state->sum1;
+    }
+}
+
+uint32_t checksumFinish(const ChecksumState *state) {
+    return (uint32_t)(state->sum1 ^ (state->sum1 >> 32) ^ (state->sum2 << 7) ^ (state->sum2 >> 25));
+}
+
+uint32_t fileChecksum(const void *data, size_t size) {
+    ChecksumState state = {0};
+    checksumUpdate(&state, data, size);
+    return checksumFinish(&state);
+}
+
+// Function to write the whole census to a versioned patients file
+// The census is written as chunks; the header is rewritten at the end with the checksum.
+int writePatientFile(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return 1;
+    }
+
+    int total = patientCount();
+    PatientFileHeader header = {0};
+    memcpy(header.magic, PATIENT_FILE_MAGIC, sizeof(header.magic));
+    header.version = PATIENT_FILE_VERSION;
+    header.recordCount = (uint32_t)total;
+    header.recordSize = sizeof(PatientRecord);
+    fwrite(&header, sizeof(header), 1, file);
+
+    ChecksumState checksum = {0};
+    if (writeCensusChunks(file, NULL, total, &checksum) != 0) {
+        fclose(file);
+        return 1;
+    }
+
+    header.checksum = checksumFinish(&checksum);
+    metricsCount(METRIC_BYTES_WRITTEN, (uint64_t)ftell(file));
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+
+    int failed = ferror(file) | syncFile(file);
+    failed |= fclose(file);
+    return failed != 0;
+}
+
+// Function to load the census from a patients file
+// Files are mapped and validated (length and checksums) before any row is added.
+// Version 1 files (fixed-width records) are still read.
+// Files from before the header existed (count + raw Patient structs) are still accepted.
+// Returns 0 if loaded or the file does not exist, 1 if the file is damaged.
+int readPatientFile(const char *path) {
+    MappedFile mapped;
+    if (mapFile(path, &mapped) != 0) {
+        return 0;
+    }
+    metricsCount(METRIC_BYTES_READ, mapped.size);
+
+    int result = 1;
+    const PatientFileHeader *header = (const PatientFileHeader *)mapped.data;
+    if (mapped.size >= sizeof(PatientFileHeader) &&
+        memcmp(header->magic, PATIENT_FILE_MAGIC, sizeof(header->magic)) == 0) {
+        const PatientRecord *records = (const PatientRecord *)(mapped.data + sizeof(PatientFileHeader));
+        size_t bytes = (size_t)header->recordCount * sizeof(PatientRecord);
+
+        if ((header->version == PATIENT_FILE_VERSION || header->version == 2) &&
+            header->recordSize == sizeof(PatientRecord) &&
+            header->recordCount <= INT32_MAX / 2) {
+            result = loadCensusChunks(mapped.data + sizeof(PatientFileHeader), mapped.size - sizeof(PatientFileHeader),
+                                      header->recordCount, header->checksum, header->version == PATIENT_FILE_VERSION);
+        } else if (header->version == 1 &&
+                   header->recordSize == sizeof(PatientRecord) &&
+                   header->recordCount <= INT32_MAX / 2 &&
+                   mapped.size - sizeof(PatientFileHeader) == bytes &&
+                   fileChecksum(records, bytes) == header->checksum) {
+            // Every shard loads its own patients on its own thread
+            CensusRecord *census = malloc((size_t)(header->recordCount ? header->recordCount : 1) * sizeof(CensusRecord));
+            int failed = census == NULL;
+            for (uint32_t i = 0; !failed && i < header->recordCount; i++) {
+                failed = recordToCensus(&records[i], &census[i]);
+            }
+            if (!failed) {
+                LoadJob job = {census, header->recordCount, 0};
+                runParallel(loadShardPart, &job, (int)header->recordCount, STORE_SHARDS);
+                failed = job.failed;
+            }
+            free(census);
+            result = failed;
+        }
+    } else if (mapped.size >= sizeof(int)) {
+        // Old format: int count, then count Patient structs as laid out in memory
+        int count;
+        memcpy(&count, mapped.data, sizeof(int));
+        if (count >= 0 && (size_t)count == (mapped.size - sizeof(int)) / sizeof(Patient)) {
+            Patient patient;
+            for (int i = 0; i < count; i++) {
+                memcpy(&patient, mapped.data + sizeof(int) + (size_t)i * sizeof(Patient), sizeof(Patient));
+                insertPatient(shardStore(patient.patientID), &patient);
+            }
+            result = 0;
+        }
+    } else if (mapped.size == 0) {
+        result = 0;
+    }
+
+    unmapFile(&mapped);
+    return result;
+}
+
+// Helper function for runParallel: load the patients of every parts-th shard from a patients file
+// Each part reads all the records but only adds those of its own shards.
+void loadShardPart(int part, int parts, void *context) {
+    LoadJob *job = context;
+    for (int s = part; s < STORE_SHARDS; s += parts) {
+        int count = 0;
+        for (uint32_t i = 0; i < job->count; i++) {
+            count += shardOf(job->records[i].patientID) == s;
+        }
+        PatientStore *patients = &shards[s].patients;
+        if (reservePatientStore(patients, patients->count + count) != 0) {
+            job->failed = 1;
+            continue;
+        }
+        for (uint32_t i = 0; i < job->count; i++) {
+            if (shardOf(job->records[i].patientID) == s) {
+                insertCensusRecord(patients, &job->records[i]); // Duplicate IDs are skipped
+            }
+        }
+    }
+}
+
+// Helper function to pack census records into one chunk (see CensusChunkHeader)
+// The records are census rows [first, first + count) in row order (all of shard 0, then
+// shard 1, ...), or the patients ids[first..first + count) when ids is not NULL; places
+// maps their diagnosis codes to the file's diagnosis table (see encodeDiagnosisTable).
+// Returns the packed size; out needs room for count * CENSUS_RECORD_MAX bytes.
+size_t encodeCensusChunk(const int *ids, const int *places, int first, int count, unsigned char *out) {
+    uint32_t previousID = 0;
+    int shard = 0, row = first;
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        PatientStore *patients;
+        if (ids != NULL) {
+            patients = shardStore(ids[first + i]);
+            row = findPatientRow(patients, ids[first + i]);
+        } else {
+            while (row >= shards[shard].patients.count) {
+                row -= shards[shard].patients.count;
+                shard++;
+            }
+            patients = &shards[shard].patients;
+        }
+
+        uint32_t id = (uint32_t)patients->patientIDs[row], room = (uint32_t)patients->roomNumbers[row];
+        uint32_t delta = id - previousID;
+        previousID = id;
+        length += putVarint(out + length, (uint64_t)((delta << 1) ^ (0u - (delta >> 31))));
+        length += putVarint(out + length, (uint64_t)(uint32_t)patients->ages[row]);
+        length += putVarint(out + length, (uint64_t)((room << 1) ^ (0u - (room >> 31))));
+        size_t nameLength = strnlen(patients->names[row], NAME_MAX_LENGTH - 1);
+        length += putVarint(out + length, nameLength);
+        memcpy(out + length, patients->names[row], nameLength);
+        length += nameLength;
+        length += putVarint(out + length, (uint64_t)places[patients->diagnosisCodes[row]]);
+        row++;
+    }
+    while (length % 4 != 0) {
+        out[length++] = 0;
+    }
+    return length;
+}
+
+// Helper function to unpack one chunk into chunk->recordCount records
+// codes holds the dictionary code of each of the codeCount places in the file's diagnosis
+// table; with codes NULL the chunk is from a file with no table, and its texts are interned.
+// Returns 1 if the chunk is damaged (checksum, cut short or malformed) or memory runs out.
+int decodeCensusChunk(const CensusChunkHeader *chunk, const unsigned char *data, const int *codes, uint32_t codeCount,
+                      CensusRecord *records) {
+    if (fileChecksum(data, chunk->size) != chunk->checksum) {
+        return 1;
+    }
+    const unsigned char *cursor = data, *end = data + chunk->size;
+    uint32_t previousID = 0;
+    memset(records, 0, (size_t)chunk->recordCount * sizeof(CensusRecord));
+    for (uint32_t i = 0; i < chunk->recordCount; i++) {
+        uint64_t delta, age, room, length;
+        if (getVarint(&cursor, end, &delta) || getVarint(&cursor, end, &age) || getVarint(&cursor, end, &room) ||
+            getVarint(&cursor, end, &length) || length >= NAME_MAX_LENGTH || (uint64_t)(end - cursor) < length) {
+            return 1;
+        }
+        previousID += (uint32_t)((delta >> 1) ^ (0 - (delta & 1)));
+        records[i].patientID = (int32_t)previousID;
+        records[i].age = (int32_t)(uint32_t)age;
+        records[i].roomNumber = (int32_t)(uint32_t)((room >> 1) ^ (0 - (room & 1)));
+        memcpy(records[i].name, cursor, (size_t)length);
+        cursor += length;
+
+        if (getVarint(&cursor, end, &length)) {
+            return 1;
+        }
+        if (codes != NULL) {
+            if (length >= codeCount) {
+                return 1;
+            }
+            records[i].diagnosisCode = codes[length];
+        } else if (length >= DIAGNOSIS_MAX_LENGTH) {
+            uint64_t distance = length - (DIAGNOSIS_MAX_LENGTH - 1);
+            if (distance > i) {
+                return 1;
+            }
+            records[i].diagnosisCode = records[i - distance].diagnosisCode;
+        } else {
+            char diagnosis[DIAGNOSIS_MAX_LENGTH];
+            if ((uint64_t)(end - cursor) < length) {
+                return 1;
+            }
+            memcpy(diagnosis, cursor, (size_t)length);
+            diagnosis[length] = 0;
+            cursor += length;
+            if ((records[i].diagnosisCode = internDiagnosisText(diagnosis)) < 0) {
+                return 1;
+            }
+        }
+    }
+    // Only the zero padding may follow the last record
+    if (end - cursor >= 4) {
+        return 1;
+    }
+    while (cursor < end) {
+        if (*cursor++ != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to build the diagnosis table (see CensusChunkHeader) for the records
+// writeCensusChunks writes: each distinct diagnosis among them once, in order of first use.
+// Only diagnoses still in use are written, so the dictionary a load builds holds no others.
+// *placesOut maps every dictionary code to its place in the table (caller frees it and the
+// packed table returned); NULL if out of memory.
+unsigned char *encodeDiagnosisTable(const int *ids, int total, int **placesOut, CensusChunkHeader *table) {
+    acquireLock(&diagnosisLock, 0);
+    int codes = diagnosisDictionary.count;
+    releaseLock(&diagnosisLock, 0);
+    int *places = malloc((size_t)(codes ? codes : 1) * sizeof(int));
+    int *used = malloc((size_t)(codes ? codes : 1) * sizeof(int));
+    if (places == NULL || used == NULL) {
+        free(places);
+        free(used);
+        return NULL;
+    }
+    memset(places, 0xff, (size_t)codes * sizeof(int));
+
+    int count = 0;
+    size_t size = 0;
+    for (int i = 0, shard = 0, row = 0; i < total; i++, row++) {
+        PatientStore *patients;
+        if (ids != NULL) {
+            patients = shardStore(ids[i]);
+            row = findPatientRow(patients, ids[i]);
+        } else {
+            while (row >= shards[shard].patients.count) {
+                row -= shards[shard].patients.count;
+                shard++;
+            }
+            patients = &shards[shard].patients;
+        }
+        int code = patients->diagnosisCodes[row];
+        if (places[code] < 0) {
+            places[code] = count;
+            used[count++] = code;
+            size += 1 + strlen(diagnosisText(code)); // Texts are under 128 bytes: one length byte
+        }
+    }
+
+    unsigned char *out = malloc(size + 4);
+    if (out == NULL) {
+        free(places);
+        free(used);
+        return NULL;
+    }
+    size_t length = 0;
+    for (int place = 0; place < count; place++) {
+        const char *text = diagnosisText(used[place]);
+        size_t textLength = strlen(text);
+        length += putVarint(out + length, textLength);
+        memcpy(out + length, text, textLength);
+        length += textLength;
+    }
+    while (length % 4 != 0) {
+        out[length++] = 0;
+    }
+    table->recordCount = (uint32_t)count;
+    table->size = (uint32_t)length;
+    table->checksum = fileChecksum(out, length);
+    free(used);
+    *placesOut = places;
+    return out;
+}
+
+// Helper function to unpack a diagnosis table, interning each text
+// *codesOut gets the dictionary code of each place (caller frees).
+// Returns 1 if the table is damaged or memory runs out.
+int decodeDiagnosisTable(const CensusChunkHeader *table, const unsigned char *data, int **codesOut) {
+    *codesOut = NULL;
+    if (fileChecksum(data, table->size) != table->checksum || table->recordCount > table->size) {
+        return 1;
+    }
+    int *codes = malloc((size_t)(table->recordCount ? table->recordCount : 1) * sizeof(int));
+    if (codes == NULL) {
+        return 1;
+    }
+    const unsigned char *cursor = data, *end = data + table->size;
+    for (uint32_t place = 0; place < table->recordCount; place++) {
+        char text[DIAGNOSIS_MAX_LENGTH];
+        uint64_t length;
+        if (getVarint(&cursor, end, &length) || length >= DIAGNOSIS_MAX_LENGTH || (uint64_t)(end - cursor) < length) {
+            free(codes);
+            return 1;
+        }
+        memcpy(text, cursor, (size_t)length);
+        text[length] = 0;
+        cursor += length;
+        if ((codes[place] = internDiagnosisText(text)) < 0) {
+            free(codes);
+            return 1;
+        }
+    }
+    // Only the zero padding may follow the last text
+    int padded = end - cursor < 4;
+    while (padded && cursor < end) {
+        padded = *cursor++ == 0;
+    }
+    if (!padded) {
+        free(codes);
+        return 1;
+    }
+    *codesOut = codes;
+    return 0;
+}
+
+// Helper function for runParallel: pack every parts-th chunk of a round
+void encodeRoundPart(int part, int parts, void *context) {
+    CensusRound *round = context;
+    for (int c = part; c < round->chunks; c += parts) {
+        int first = (round->firstChunk + c) * CENSUS_CHUNK_RECORDS;
+        int count = round->total - first < CENSUS_CHUNK_RECORDS ? round->total - first : CENSUS_CHUNK_RECORDS;
+        size_t size = encodeCensusChunk(round->ids, round->places, first, count, round->data[c]);
+        round->headers[c].recordCount = (uint32_t)count;
+        round->headers[c].size = (uint32_t)size;
+        round->headers[c].checksum = fileChecksum(round->data[c], size);
+    }
+}
+
+// Helper function to write the packed chunks of a round (run on the writer thread)
+void *writeRound(void *argument) {
+    CensusRound *round = argument;
+    for (int c = 0; c < round->chunks; c++) {
+        fwrite(&round->headers[c], sizeof(CensusChunkHeader), 1, round->file);
+        fwrite(round->data[c], 1, round->headers[c].size, round->file);
+    }
+    return NULL;
+}
+
+// Function to write census records to a file as a diagnosis table and chunks (see CensusChunkHeader)
+// Writes the whole census in row order, or the patients ids[0..total) when ids is not NULL.
+// The chunks go in rounds: while a writer thread writes one round, the next is packed in
+// parallel. The table and chunk headers are added to *checksum. Returns 1 if out of memory.
+int writeCensusChunks(FILE *file, const int *ids, int total, ChecksumState *checksum) {
+    CensusChunkHeader table;
+    int *places;
+    unsigned char *tableData = encodeDiagnosisTable(ids, total, &places, &table);
+    if (tableData == NULL) {
+        return 1;
+    }
+    checksumUpdate(checksum, &table, sizeof(table));
+    fwrite(&table, sizeof(table), 1, file);
+    fwrite(tableData, 1, table.size, file);
+    free(tableData);
+
+    int chunks = (total + CENSUS_CHUNK_RECORDS - 1) / CENSUS_CHUNK_RECORDS;
+    if (chunks == 0) {
+        free(places);
+        return 0;
+    }
+    int perRound = chunks < CENSUS_ROUND_CHUNKS ? chunks : CENSUS_ROUND_CHUNKS;
+    size_t bufferSize = (size_t)(total < CENSUS_CHUNK_RECORDS ? total : CENSUS_CHUNK_RECORDS) * CENSUS_RECORD_MAX;
+    CensusRound rounds[2] = {{0}};
+    int failed = 0;
+    for (int r = 0; r < (chunks > perRound ? 2 : 1); r++) {
+        rounds[r].ids = ids;
+        rounds[r].places = places;
+        rounds[r].total = total;
+        rounds[r].file = file;
+        for (int c = 0; c < perRound; c++) {
+            failed |= (rounds[r].data[c] = malloc(bufferSize)) == NULL;
+        }
+    }
+
+    CensusRound *current = &rounds[0], *next = &rounds[1];
+    current->chunks = perRound;
+    if (!failed) {
+        runParallel(encodeRoundPart, current, perRound * CENSUS_CHUNK_RECORDS, perRound);
+    }
+    for (int done = 0; !failed && done < chunks; ) {
+        for (int c = 0; c < current->chunks; c++) {
+            checksumUpdate(checksum, &current->headers[c], sizeof(CensusChunkHeader));
+        }
+        done += current->chunks;
+        if (done == chunks) {
+            writeRound(current);
+            break;
+        }
+
+        WorkerThread writer;
+        int started = startWorker(&writer, writeRound, current) == 0;
+        if (!started) {
+            writeRound(current);
+        }
+        next->firstChunk = done;
+        next->chunks = chunks - done < perRound ? chunks - done : perRound;
+        runParallel(encodeRoundPart, next, next->chunks * CENSUS_CHUNK_RECORDS, next->chunks);
+        if (started) {
+            joinWorker(writer);
+        }
+        CensusRound *written = current;
+        current = next;
+        next = written;
+    }
+
+    for (int r = 0; r < 2; r++) {
+        for (int c = 0; c < CENSUS_ROUND_CHUNKS; c++) {
+            free(rounds[r].data[c]);
+        }
+    }
+    free(places);
+    return failed;
+}
+
+// Helper function for runParallel: decode every parts-th chunk of a patients file
+void decodeChunkPart(int part, int parts, void *context) {
+    DecodeJob *job = context;
+    for (int c = part; c < job->chunks; c += parts) {
+        CensusChunkHeader chunk;
+        memcpy(&chunk, job->data + job->offsets[c], sizeof(chunk));
+        if (decodeCensusChunk(&chunk, job->data + job->offsets[c] + sizeof(chunk), job->codes, job->codeCount,
+                              job->records + (size_t)c * CENSUS_CHUNK_RECORDS) != 0) {
+            job->failed = 1;
+        }
+    }
+}
+
+// Function to load a census of count records stored as chunks in data[0..size),
+// after a diagnosis table if hasTable is set (files from before the table have none)
+// The table and chunk headers are walked and checked against checksum first, then the
+// chunks are decoded on worker threads and every shard loads its own patients on its own thread.
+// Returns 1 (with nothing added) if any of it is damaged.
+int loadCensusChunks(const unsigned char *data, size_t size, uint32_t count, uint32_t checksum, int hasTable) {
+    if ((uint64_t)count * CENSUS_RECORD_MIN > size) {
+        return 1;
+    }
+    int chunks = (int)((count + CENSUS_CHUNK_RECORDS - 1) / CENSUS_CHUNK_RECORDS);
+    size_t *offsets = malloc((size_t)(chunks ? chunks : 1) * sizeof(size_t));
+    CensusRecord *records = malloc((size_t)(count ? count : 1) * sizeof(CensusRecord));
+    int failed = offsets == NULL || records == NULL;
+
+    ChecksumState headers = {0};
+    CensusChunkHeader table = {0};
+    size_t offset = 0;
+    if (hasTable && !failed) {
+        failed = size < sizeof(table);
+        if (!failed) {
+            memcpy(&table, data, sizeof(table));
+            failed = table.size % 4 != 0 || table.size > size - sizeof(table);
+            checksumUpdate(&headers, &table, sizeof(table));
+            offset = sizeof(table) + table.size;
+        }
+    }
+    for (int c = 0; !failed && c < chunks; c++) {
+        uint32_t expected = count - (uint32_t)c * CENSUS_CHUNK_RECORDS;
+        CensusChunkHeader chunk;
+        failed = size - offset < sizeof(chunk);
+        if (!failed) {
+            memcpy(&chunk, data + offset, sizeof(chunk));
+            failed = chunk.recordCount != (expected < CENSUS_CHUNK_RECORDS ? expected : CENSUS_CHUNK_RECORDS) ||
+                     chunk.size % 4 != 0 || chunk.size > size - offset - sizeof(chunk);
+            checksumUpdate(&headers, &chunk, sizeof(chunk));
+            offsets[c] = offset;
+            offset += sizeof(chunk) + chunk.size;
+        }
+    }
+    failed = failed || offset != size || checksumFinish(&headers) != checksum;
+
+    int *codes = NULL;
+    if (!failed && hasTable) {
+        failed = decodeDiagnosisTable(&table, data + sizeof(table), &codes);
+    }
+    if (!failed) {
+        DecodeJob job = {data, offsets, chunks, codes, table.recordCount, records, 0};
+        runParallel(decodeChunkPart, &job, (int)count, MAX_WORKERS);
+        failed = job.failed;
+    }
+    free(codes);
+    if (!failed) {
+        LoadJob job = {records, count, 0};
+        runParallel(loadShardPart, &job, (int)count, STORE_SHARDS);
+        failed = job.failed;
+    }
+    free(offsets);
+    free(records);
+    return failed;
+}
+
+// Helper function to encode one row of the store as a file record
+void patientToRecord(const PatientStore *patients, int row, PatientRecord *record) {
+    record->patientID = patients->patientIDs[row];
+    record->age = patients->ages[row];
+    record->roomNumber = patients->roomNumbers[row];
+    memcpy(record->name, patients->names[row], NAME_MAX_LENGTH);
+    strcpy(record->diagnosis, diagnosisText(patients->diagnosisCodes[row]));
+}
+
+// Helper function to decode a file record into a Patient
+void recordToPatient(const PatientRecord *record, Patient *patient) {
+    patient->patientID = record->patientID;
+    patient->age = record->age;
+    patient->roomNumber = record->roomNumber;
+    memcpy(patient->name, record->name, NAME_MAX_LENGTH);
+    memcpy(patient->diagnosis, record->diagnosis, DIAGNOSIS_MAX_LENGTH);
+    patient->next = NULL;
+}
+
+// Helper function to decode a file record into a CensusRecord, interning its diagnosis
+// Returns 1 if memory runs out.
+int recordToCensus(const PatientRecord *record, CensusRecord *census) {
+    char diagnosis[DIAGNOSIS_MAX_LENGTH];
+    memcpy(diagnosis, record->diagnosis, DIAGNOSIS_MAX_LENGTH);
+    diagnosis[DIAGNOSIS_MAX_LENGTH - 1] = 0;
+    census->patientID = record->patientID;
+    census->age = record->age;
+    census->roomNumber = record->roomNumber;
+    memcpy(census->name, record->name, NAME_MAX_LENGTH);
+    census->diagnosisCode = internDiagnosisText(diagnosis);
+    return census->diagnosisCode < 0;
+}
+
+// Helper function to move a finished temp file over the real one in one step
+int replaceFile(const char *tempPath, const char *path) {
+#ifdef _WIN32
+    return MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : 1;
+#else
+    return rename(tempPath, path) != 0;
+#endif
+}
+
+// Function to write a full snapshot (patients.dat and schedule.dat)
+// Each file is written beside the old one, synced and renamed over it, so a crash keeps the old snapshot.
+int writeSnapshot() {
+    if (writePatientFile(PATIENT_FILE ".tmp") != 0 || replaceFile(PATIENT_FILE ".tmp", PATIENT_FILE) != 0) {
+        remove(PATIENT_FILE ".tmp");
+        return 1;
+    }
+
+    if (writeScheduleFile(SCHEDULE_FILE ".tmp") != 0 || replaceFile(SCHEDULE_FILE ".tmp", SCHEDULE_FILE) != 0) {
+        remove(SCHEDULE_FILE ".tmp");
+        return 1;
+    }
+    return 0;
+}
+
+// Function to write the roster to a schedule file (see ScheduleFileHeader)
+int writeScheduleFile(const char *path) {
+    RosterRecord *records;
+    int count = rosterToRecords(&records);
+    if (count < 0) {
+        return 1;
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        free(records);
+        return 1;
+    }
+
+    ScheduleFileHeader header = {0};
+    memcpy(header.magic, SCHEDULE_FILE_MAGIC, sizeof(header.magic));
+    header.version = SCHEDULE_FILE_VERSION;
+    header.recordCount = (uint32_t)count;
+    header.recordSize = sizeof(RosterRecord);
+    header.checksum = fileChecksum(records, (size_t)count * sizeof(RosterRecord));
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(records, sizeof(RosterRecord), (size_t)count, file);
+    free(records);
+    metricsCount(METRIC_BYTES_WRITTEN, sizeof(header) + (size_t)count * sizeof(RosterRecord));
+
+    int failed = ferror(file) | syncFile(file);
+    failed |= fclose(file);
+    return failed != 0;
+}
+
+// Function to load the roster from schedule.dat
+// A missing file is an empty roster; an old weekly schedule becomes this week's roster.
+// Returns 1 if the file is damaged.
+int readScheduleFile() {
+    MappedFile mapped;
+    if (mapFile(SCHEDULE_FILE, &mapped) != 0) {
+        return 0;
+    }
+    metricsCount(METRIC_BYTES_READ, mapped.size);
+
+    int result = 1;
+    ScheduleFileHeader header;
+    if (mapped.size >= sizeof(header) && memcmp(mapped.data, SCHEDULE_FILE_MAGIC, sizeof(header.magic)) == 0) {
+        memcpy(&header, mapped.data, sizeof(header));
+        const unsigned char *records = mapped.data + sizeof(header);
+        if (header.version == SCHEDULE_FILE_VERSION && header.recordSize == sizeof(RosterRecord) &&
+            header.recordCount <= INT32_MAX / sizeof(RosterRecord) &&
+            mapped.size == sizeof(header) + (size_t)header.recordCount * sizeof(RosterRecord) &&
+            fileChecksum(records, (size_t)header.recordCount * sizeof(RosterRecord)) == header.checksum) {
+            loadRosterRecords((const RosterRecord *)records, (int)header.recordCount);
+            result = 0;
+        }
+    } else if (mapped.size == DAYS_IN_WEEK * SHIFTS_IN_DAY * sizeof(DoctorSchedule) || mapped.size == 0) {
+        DoctorSchedule names[DAYS_IN_WEEK][SHIFTS_IN_DAY];
+        RosterRecord *records;
+        memset(names, 0, sizeof(names));
+        if (mapped.size > 0) {
+            memcpy(names, mapped.data, sizeof(names));
+        }
+        int count = weeklyToRoster(names, &records);
+        if (count >= 0) {
+            loadRosterRecords(records, count);
+            free(records);
+            result = 0;
+        }
+    }
+
+    unmapFile(&mapped);
+    return result;
+}
+
+// Function to apply the journal on top of the loaded snapshot
+// Stops at the first entry that is cut short or fails its checksum.
+// Returns 1 if such an entry was found, 0 if the whole journal replayed.
+int replayJournal() {
+    MappedFile mapped;
+    if (mapFile(JOURNAL_FILE, &mapped) != 0) {
+        return 0;
+    }
+    metricsCount(METRIC_BYTES_READ, mapped.size);
+
+    size_t offset = sizeof(JOURNAL_MAGIC);
+    int damaged = mapped.size > 0 &&
+                  (mapped.size < offset || memcmp(mapped.data, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0);
+
+    while (!damaged && offset < mapped.size) {
+        JournalEntryHeader header;
+        if (mapped.size - offset < sizeof(header)) {
+            damaged = 1;
+            break;
+        }
+        memcpy(&header, mapped.data + offset, sizeof(header));
+        const unsigned char *payload = mapped.data + offset + sizeof(header);
+        if (mapped.size - offset - sizeof(header) < header.size ||
+            fileChecksum(payload, header.size) != header.checksum) {
+            damaged = 1;
+            break;
+        }
+
+        if (header.type == JOURNAL_ADD && header.size == sizeof(PatientRecord)) {
+            PatientRecord record;
+            Patient patient;
+            memcpy(&record, payload, sizeof(record));
+            recordToPatient(&record, &patient);
+            insertPatient(shardStore(patient.patientID), &patient);
+        } else if (header.type == JOURNAL_DISCHARGE && header.size == sizeof(int32_t)) {
+            int32_t patientID;
+            memcpy(&patientID, payload, sizeof(patientID));
+            removePatient(shardStore(patientID), patientID);
+        } else if ((header.type == JOURNAL_ROSTER_ADD || header.type == JOURNAL_ROSTER_REMOVE) &&
+                   header.size == sizeof(RosterRecord)) {
+            RosterRecord record;
+            memcpy(&record, payload, sizeof(record));
+            record.doctorName[NAME_MAX_LENGTH - 1] = 0;
+            int doctorID = findDoctor(record.doctorName, header.type == JOURNAL_ROSTER_ADD);
+            if (doctorID > NO_DOCTOR && validRosterDay(record.day) && record.shift >= 0 &&
+                record.shift < SHIFTS_IN_DAY && record.ward >= 1 && record.ward <= WARD_COUNT) {
+                if (header.type == JOURNAL_ROSTER_ADD) {
+                    rosterAdd(record.day, record.shift, record.ward, doctorID);
+                } else {
+                    rosterRemove(record.day, record.shift, record.ward, doctorID);
+                }
+            }
+        } else if (header.type == JOURNAL_ASSIGN && header.size == sizeof(JournalAssign)) {
+            // Old weekly schedule change: it replaced whoever had that shift (see weeklyToRoster)
+            JournalAssign assign;
+            memcpy(&assign, payload, sizeof(assign));
+            assign.doctorName[NAME_MAX_LENGTH - 1] = 0;
+            int today, shiftNow;
+            currentDayAndShift(&today, &shiftNow);
+            int day = weekStart(today) + assign.day;
+            int doctorID = findDoctor(assign.doctorName, 1);
+            if (assign.day >= 0 && assign.day < DAYS_IN_WEEK && assign.shift >= 0 && assign.shift < SHIFTS_IN_DAY &&
+                doctorID >= 0) {
+                for (int entry; (entry = rosterSlotFirst(day, assign.shift, 1)) >= 0; ) {
+                    rosterRemove(day, assign.shift, 1, roster.assignments[entry].doctorID);
+                }
+                if (doctorID != NO_DOCTOR) {
+                    rosterAdd(day, assign.shift, 1, doctorID);
+                }
+            }
+        }
+        offset += sizeof(header) + header.size;
+        journalEntries++;
+    }
+
+    unmapFile(&mapped);
+    return damaged;
+}
+
+// Function to open the journal for appending (creating it if needed)
+void openJournal() {
+    journalFile = fopen(JOURNAL_FILE, "ab");
+    if (journalFile == NULL) {
+        printf("Warning: cannot open %s, changes are only kept until Save.\n", JOURNAL_FILE);
+        return;
+    }
+    if (ftell(journalFile) == 0) {
+        fwrite(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC), 1, journalFile);
+        fflush(journalFile);
+    }
+}
+
+// Function to close the journal
+void closeJournal() {
+    if (journalFile != NULL) {
+        fclose(journalFile);
+        journalFile = NULL;
+    }
+}
+
+// Function to start an empty journal once a snapshot has been written
+void compactJournal() {
+    closeJournal();
+    remove(JOURNAL_FILE);
+    journalEntries = 0;
+    snapshotPatients = patientCount();
+    openJournal();
+}
+
+// Function to append one entry to the journal (logLock held when commands run on threads)
+// Each entry is flushed straight away so it survives the program crashing.
+// Once the journal outgrows the census of the last snapshot a new snapshot is due, keeping
+// replay short. That size only changes between commands, so it is safe to read here with
+// just one shard locked (unlike the shards' live counts).
+// Returns 1 if the entry could not be written (full disk, I/O error): the caller undoes its
+// change, and a snapshot is asked for so the files catch up without the journal's torn tail.
+int journalAppend(uint32_t type, const void *payload, uint32_t size) {
+    if (journalFile == NULL) {
+        return 0;
+    }
+    JournalEntryHeader header = {type, size, fileChecksum(payload, size)};
+    if (fwrite(&header, sizeof(header), 1, journalFile) != 1 || fwrite(payload, size, 1, journalFile) != 1 ||
+        (!batchMode && fflush(journalFile) != 0)) {
+        fprintf(stderr, "Error: cannot write to %s, the change was undone.\n", JOURNAL_FILE);
+        clearerr(journalFile);
+        metricsCount(METRIC_JOURNAL_ERRORS, 1);
+        atomic_store(&journalCompactDue, 1);
+        return 1;
+    }
+    metricsCount(METRIC_BYTES_WRITTEN, sizeof(header) + size);
+
+    journalEntries++;
+    if (journalEntries >= JOURNAL_COMPACT_MIN && journalEntries >= snapshotPatients) {
+        atomic_store(&journalCompactDue, 1);
+    }
+    return 0;
+}
+
+// Function to take the snapshot journalAppend asked for
+// It reads every shard, so it runs between commands (with storeLock held alone when
+// commands run on threads), never in the middle of a change.
+void compactJournalIfDue() {
+    if (atomic_exchange(&journalCompactDue, 0)) {
+        uint64_t started = metricsStart();
+        if (writeSnapshot() == 0) {
+            compactJournal();
+        }
+        sweepDiagnosisDictionary();
+        metricsObserve(METRIC_SNAPSHOT, started);
+    }
+}
+
+// Functions to journal each kind of change (1 if it could not be written, see journalAppend)
+int journalAddPatient(const Patient *patient) {
+    PatientRecord record = {0};
+    record.patientID = patient->patientID;
+    record.age = patient->age;
+    record.roomNumber = patient->roomNumber;
+    memcpy(record.name, patient->name, NAME_MAX_LENGTH);
+    memcpy(record.diagnosis, patient->diagnosis, DIAGNOSIS_MAX_LENGTH);
+    return journalAppend(JOURNAL_ADD, &record, sizeof(record));
+}
+
+int journalDischarge(int patientID) {
+    int32_t id = patientID;
+    return journalAppend(JOURNAL_DISCHARGE, &id, sizeof(id));
+}
+
+int journalRoster(uint32_t type, int day, int shift, int ward, const char *doctorName) {
+    RosterRecord record = {0};
+    record.day = day;
+    record.shift = shift;
+    record.ward = ward;
+    size_t length = strlen(doctorName);
+    memcpy(record.doctorName, doctorName, length < NAME_MAX_LENGTH ? length : NAME_MAX_LENGTH - 1);
+    return journalAppend(type, &record, sizeof(record));
+}
+
+// Function to add a patient and record the change (journal and next backup)
+// The caller holds the patient's shard lock alone when commands run on threads.
+// Returns 1 if the patient could not be added (duplicate ID, out of memory), 2 if the
+// journal could not be written, in which case the patient is taken out again.
+int admitPatient(const Patient *patient) {
+    uint64_t started = metricsStart();
+    StoreShard *shard = &shards[shardOf(patient->patientID)];
+    beginStoreChange(shard);
+    int failed = insertPatient(&shard->patients, patient);
+    endStoreChange(shard);
+    if (!failed) {
+        acquireLock(&logLock, 1);
+        if (journalAddPatient(patient) != 0) {
+            failed = 2;
+        } else {
+            noteBackupChange(patient->patientID);
+        }
+        releaseLock(&logLock, 1);
+    }
+    if (failed == 2) {
+        beginStoreChange(shard);
+        removePatient(&shard->patients, patient->patientID);
+        endStoreChange(shard);
+    }
+    metricsObserve(METRIC_ADD, started);
+    return failed;
+}
+
+// Function to discharge a patient and record the change (journal and next backup)
+// and keep the patient's record in the discharge archive.
+// Returns 1 if the ID is not on file, 2 if the journal could not be written, in which case
+// the patient is put back.
+int dischargePatientByID(int patientID) {
+    uint64_t started = metricsStart();
+    StoreShard *shard = &shards[shardOf(patientID)];
+    int row = findPatientRow(&shard->patients, patientID);
+    int failed = row < 0;
+    if (row >= 0) {
+        Patient patient;
+        getPatient(&shard->patients, row, &patient);
+        beginStoreChange(shard);
+        removePatient(&shard->patients, patientID);
+        endStoreChange(shard);
+        acquireLock(&logLock, 1);
+        if (journalDischarge(patientID) != 0) {
+            failed = 2;
+        } else {
+            noteBackupChange(patientID);
+            archiveDischarge(&patient);
+        }
+        releaseLock(&logLock, 1);
+        if (failed) {
+            beginStoreChange(shard);
+            insertPatient(&shard->patients, &patient);
+            endStoreChange(shard);
+        }
+    }
+    metricsObserve(METRIC_DISCHARGE, started);
+    return failed;
+}
+
+// Function to put a doctor on the roster and journal the change
+// Returns 0 if added, 1 if the doctor already works that shift, 2 if out of memory,
+// 3 if the journal could not be written (the doctor is taken off again).
+int scheduleDoctor(int day, int shift, int ward, const char *name) {
+    int doctorID = findDoctor(name, 1);
+    if (doctorID <= NO_DOCTOR) {
+        return 2;
+    }
+    int result = rosterAdd(day, shift, ward, doctorID);
+    if (result == 0 && journalRoster(JOURNAL_ROSTER_ADD, day, shift, ward, name) != 0) {
+        rosterRemove(day, shift, ward, doctorID);
+        result = 3;
+    }
+    return result;
+}
+
+// Function to take a doctor off the roster and journal the change
+// Returns 1 if the doctor is not on that shift, 2 if the journal could not be written
+// (the doctor is put back).
+int unscheduleDoctor(int day, int shift, int ward, const char *name) {
+    int doctorID = findDoctor(name, 0);
+    if (doctorID <= NO_DOCTOR || rosterRemove(day, shift, ward, doctorID) != 0) {
+        return 1;
+    }
+    if (journalRoster(JOURNAL_ROSTER_REMOVE, day, shift, ward, name) != 0) {
+        rosterAdd(day, shift, ward, doctorID);
+        return 2;
+    }
+    return 0;
+}
+
+// Helper function to compare ints for qsort
+int compareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Helper function to push a file's data all the way to disk before it is renamed
+int syncFile(FILE *file) {
+    if (fflush(file) != 0) {
+        return 1;
+    }
+    metricsCount(METRIC_FSYNCS, 1);
+#ifdef _WIN32
+    return _commit(_fileno(file)) != 0;
+#else
+    return fsync(fileno(file)) != 0;
+#endif
+}
+
+// Helper function to build the file name of a backup in the chain
+void backupPath(int sequence, char *path, size_t size) {
+    if (sequence == 0) {
+        snprintf(path, size, "%s", BACKUP_FILE);
+    } else {
+        snprintf(path, size, "%s.%d", BACKUP_FILE, sequence);
+    }
+}
+
+// Function to read just the header of a backup
+// Returns 1 if the backup does not exist. An old headerless backup.dat reads as a full backup.
+int readBackupHeader(int sequence, BackupFileHeader *header) {
+    char path[64];
+    backupPath(sequence, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 1;
+    }
+    memset(header, 0, sizeof(*header));
+    size_t got = fread(header, 1, sizeof(*header), file);
+    fclose(file);
+    if (got != sizeof(*header) || memcmp(header->magic, BACKUP_MAGIC, sizeof(header->magic)) != 0) {
+        memset(header, 0, sizeof(*header));
+        if (sequence != 0) {
+            return 1;
+        }
+        header->kind = BACKUP_FULL; // Old format, it cannot be extended (chainID 0)
+    }
+    return 0;
+}
+
+// Function to write one backup of the chain
+// BACKUP_FULL writes the whole census; BACKUP_DELTA writes the patients in ids[0..kept)
+// and the discharged IDs in ids[kept..kept+discharged). The file is written beside the
+// old one, synced and renamed into place, so the previous good backup survives a crash.
+int writeBackupFile(int sequence, uint32_t kind, uint32_t chainID, const int *ids, int kept, int discharged) {
+    char path[64], tempPath[72];
+    backupPath(sequence, path, sizeof(path));
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+
+    FILE *file = fopen(tempPath, "wb");
+    if (file == NULL) {
+        return 1;
+    }
+
+    int records = kind == BACKUP_FULL ? patientCount() : kept;
+    BackupFileHeader header = {0};
+    memcpy(header.magic, BACKUP_MAGIC, sizeof(header.magic));
+    header.version = BACKUP_VERSION;
+    header.kind = kind;
+    header.sequence = (uint32_t)sequence;
+    header.chainID = chainID;
+    header.recordCount = (uint32_t)records;
+    header.dischargeCount = kind == BACKUP_FULL ? 0 : (uint32_t)discharged;
+    header.recordSize = sizeof(PatientRecord);
+    fwrite(&header, sizeof(header), 1, file);
+
+    ChecksumState checksum = {0};
+    if (writeCensusChunks(file, kind == BACKUP_FULL ? NULL : ids, records, &checksum) != 0) {
+        fclose(file);
+        remove(tempPath);
+        return 1;
+    }
+    if (header.dischargeCount > 0) {
+        for (int i = 0; i < discharged; i++) {
+            int32_t id = ids[kept + i];
+            checksumUpdate(&checksum, &id, sizeof(id));
+            fwrite(&id, sizeof(id), 1, file);
+        }
+    }
+    RosterRecord *rosterRecords;
+    int rosterCount = rosterToRecords(&rosterRecords);
+    if (rosterCount < 0) {
+        fclose(file);
+        remove(tempPath);
+        return 1;
+    }
+    uint32_t rosterSize = (uint32_t)rosterCount;
+    checksumUpdate(&checksum, &rosterSize, sizeof(rosterSize));
+    checksumUpdate(&checksum, rosterRecords, (size_t)rosterCount * sizeof(RosterRecord));
+    fwrite(&rosterSize, sizeof(rosterSize), 1, file);
+    fwrite(rosterRecords, sizeof(RosterRecord), (size_t)rosterCount, file);
+    free(rosterRecords);
+
+    header.checksum = checksumFinish(&checksum);
+    metricsCount(METRIC_BYTES_WRITTEN, (uint64_t)ftell(file));
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+
+    int failed = ferror(file) | syncFile(file);
+    failed |= fclose(file);
+    if (failed || replaceFile(tempPath, path) != 0) {
+        remove(tempPath);
+        return 1;
+    }
+
+    // A new base makes the old incremental backups useless
+    if (kind == BACKUP_FULL) {
+        for (int n = 1;; n++) {
+            backupPath(n, path, sizeof(path));
+            if (remove(path) != 0) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Helper function to read a block of a backup and add it to the running checksum
+int readBackupBlock(FILE *file, void *buffer, size_t size, ChecksumState *checksum) {
+    if (fread(buffer, 1, size, file) != size) {
+        return 1;
+    }
+    if (checksum != NULL) {
+        checksumUpdate(checksum, buffer, size);
+    }
+    return 0;
+}
+
+// Function to stream one backup of the chain into restore shards (STORE_SHARDS stores)
+// The file length must fit its counts up front, and it is read sequentially: the diagnosis
+// table, then one census chunk (or, before version 3, one block of records) at a time.
+// The checksum is only known at the end, so the caller throws the restore shards away if
+// this returns 1. Each backup holds the whole roster, which replaces *restoredRoster
+// (the caller frees it).
+int loadBackupFile(int sequence, uint32_t chainID, PatientStore *targets, RosterRecord **restoredRoster, int *restoredRosterCount) {
+    char path[64];
+    backupPath(sequence, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 1;
+    }
+    setvbuf(file, NULL, _IONBF, 0); // Every read below is already a big block
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    metricsCount(METRIC_BYTES_READ, (uint64_t)fileSize);
+
+    PatientRecord *chunk = malloc(RESTORE_CHUNK_RECORDS * sizeof(PatientRecord));
+    CensusRecord *census = malloc(CENSUS_CHUNK_RECORDS * sizeof(CensusRecord));
+    unsigned char *packed = malloc(CENSUS_CHUNK_RECORDS * CENSUS_RECORD_MAX);
+    if (chunk == NULL || census == NULL || packed == NULL || fileSize < (long)sizeof(int)) {
+        free(chunk);
+        free(census);
+        free(packed);
+        fclose(file);
+        return 1;
+    }
+
+    int result = 1;
+    BackupFileHeader header;
+    size_t got = fread(&header, 1, sizeof(header), file);
+    if (got == sizeof(header) && memcmp(header.magic, BACKUP_MAGIC, sizeof(header.magic)) == 0) {
+        // Chunked records are at least CENSUS_RECORD_MIN bytes each
+        size_t recordBytes = (size_t)header.recordCount * (header.version >= 3 ? CENSUS_RECORD_MIN : sizeof(PatientRecord));
+        size_t dischargeBytes = (size_t)header.dischargeCount * sizeof(int32_t);
+        ChecksumState checksum = {0};
+        Patient patient;
+
+        size_t scheduleBytes = header.version == 1 ? DAYS_IN_WEEK * SHIFTS_IN_DAY * sizeof(DoctorSchedule) : sizeof(uint32_t);
+        int ok = header.version >= 1 && header.version <= BACKUP_VERSION && header.chainID == chainID &&
+                 header.recordSize == sizeof(PatientRecord) &&
+                 header.recordCount <= INT32_MAX / 2 && header.dischargeCount <= INT32_MAX / 4 &&
+                 (header.version == 1 ? (size_t)fileSize == sizeof(header) + recordBytes + dischargeBytes + scheduleBytes
+                                      : (size_t)fileSize >= sizeof(header) + recordBytes + dischargeBytes + scheduleBytes);
+        for (int s = 0; ok && s < STORE_SHARDS; s++) {
+            ok = reservePatientStore(&targets[s], targets[s].count + (int)(header.recordCount / STORE_SHARDS)) == 0;
+        }
+
+        // Like a chunk, the table header is in the running checksum and its bytes have their own
+        int *codes = NULL;
+        uint32_t codeCount = 0;
+        if (ok && header.version >= 4) {
+            CensusChunkHeader table;
+            unsigned char *tableData = NULL;
+            ok = readBackupBlock(file, &table, sizeof(table), &checksum) == 0 && table.size % 4 == 0 &&
+                 table.size <= (size_t)(fileSize - ftell(file)) &&
+                 (tableData = malloc(table.size ? table.size : 1)) != NULL &&
+                 readBackupBlock(file, tableData, table.size, NULL) == 0 &&
+                 decodeDiagnosisTable(&table, tableData, &codes) == 0;
+            codeCount = table.recordCount;
+            free(tableData);
+        }
+
+        for (uint32_t done = 0; ok && done < header.recordCount; ) {
+            uint32_t n = header.recordCount - done;
+            if (header.version >= 3) {
+                // The chunk header is in the running checksum, the packed bytes have their own
+                CensusChunkHeader chunkHeader;
+                n = n < CENSUS_CHUNK_RECORDS ? n : CENSUS_CHUNK_RECORDS;
+                ok = readBackupBlock(file, &chunkHeader, sizeof(chunkHeader), &checksum) == 0 &&
+                     chunkHeader.recordCount == n && chunkHeader.size % 4 == 0 &&
+                     chunkHeader.size <= CENSUS_CHUNK_RECORDS * CENSUS_RECORD_MAX &&
+                     readBackupBlock(file, packed, chunkHeader.size, NULL) == 0 &&
+                     decodeCensusChunk(&chunkHeader, packed, codes, codeCount, census) == 0;
+                for (uint32_t i = 0; ok && i < n; i++) {
+                    PatientStore *target = &targets[shardOf(census[i].patientID)];
+                    if (header.kind == BACKUP_DELTA) {
+                        removePatient(target, census[i].patientID); // A delta replaces the older copy
+                    }
+                    insertCensusRecord(target, &census[i]);
+                }
+            } else {
+                n = n < RESTORE_CHUNK_RECORDS ? n : RESTORE_CHUNK_RECORDS;
+                ok = readBackupBlock(file, chunk, n * sizeof(PatientRecord), &checksum) == 0;
+                for (uint32_t i = 0; ok && i < n; i++) {
+                    recordToPatient(&chunk[i], &patient);
+                    PatientStore *target = &targets[shardOf(patient.patientID)];
+                    if (header.kind == BACKUP_DELTA) {
+                        removePatient(target, patient.patientID);
+                    }
+                    insertPatient(target, &patient);
+                }
+            }
+            done += n;
+        }
+        free(codes);
+
+        int32_t *ids = (int32_t *)chunk;
+        uint32_t idsPerChunk = RESTORE_CHUNK_RECORDS * sizeof(PatientRecord) / sizeof(int32_t);
+        for (uint32_t done = 0; ok && done < header.dischargeCount; ) {
+            uint32_t n = header.dischargeCount - done < idsPerChunk ? header.dischargeCount - done : idsPerChunk;
+            ok = readBackupBlock(file, ids, n * sizeof(int32_t), &checksum) == 0;
+            for (uint32_t i = 0; ok && i < n; i++) {
+                removePatient(&targets[shardOf(ids[i])], ids[i]);
+            }
+            done += n;
+        }
+
+        RosterRecord *records = NULL;
+        int rosterCount = -1;
+        if (ok && header.version == 1) {
+            DoctorSchedule names[DAYS_IN_WEEK][SHIFTS_IN_DAY];
+            if (readBackupBlock(file, names, sizeof(names), &checksum) == 0) {
+                rosterCount = weeklyToRoster(names, &records);
+            }
+        } else if (ok) {
+            uint32_t rosterSize;
+            if (readBackupBlock(file, &rosterSize, sizeof(rosterSize), &checksum) == 0 &&
+                rosterSize <= INT32_MAX / sizeof(RosterRecord) &&
+                (size_t)(fileSize - ftell(file)) == rosterSize * sizeof(RosterRecord) &&
+                (records = malloc((rosterSize ? rosterSize : 1) * sizeof(RosterRecord))) != NULL &&
+                readBackupBlock(file, records, rosterSize * sizeof(RosterRecord), &checksum) == 0) {
+                rosterCount = (int)rosterSize;
+            }
+        }
+        if (rosterCount >= 0 && checksumFinish(&checksum) == header.checksum) {
+            free(*restoredRoster);
+            *restoredRoster = records;
+            *restoredRosterCount = rosterCount;
+            records = NULL;
+            result = 0;
+        }
+        free(records);
+    } else if (sequence == 0) {
+        // Old format: int count, count Patient structs, then the schedule
+        int count;
+        memcpy(&count, &header, sizeof(int));
+        fseek(file, sizeof(int), SEEK_SET);
+        int ok = count >= 0 && (size_t)count <= (size_t)fileSize / sizeof(Patient) &&
+                 (size_t)fileSize == sizeof(int) + (size_t)count * sizeof(Patient) + DAYS_IN_WEEK * SHIFTS_IN_DAY * sizeof(DoctorSchedule);
+
+        Patient *patients = (Patient *)chunk;
+        int perChunk = (int)(RESTORE_CHUNK_RECORDS * sizeof(PatientRecord) / sizeof(Patient));
+        for (int done = 0; ok && done < count; ) {
+            int n = count - done < perChunk ? count - done : perChunk;
+            ok = readBackupBlock(file, patients, (size_t)n * sizeof(Patient), NULL) == 0;
+            for (int i = 0; ok && i < n; i++) {
+                insertPatient(&targets[shardOf(patients[i].patientID)], &patients[i]);
+            }
+            done += n;
+        }
+        DoctorSchedule names[DAYS_IN_WEEK][SHIFTS_IN_DAY];
+        RosterRecord *records;
+        int rosterCount;
+        if (ok && readBackupBlock(file, names, sizeof(names), NULL) == 0 &&
+            (rosterCount = weeklyToRoster(names, &records)) >= 0) {
+            free(*restoredRoster);
+            *restoredRoster = records;
+            *restoredRosterCount = rosterCount;
+            result = 0;
+        }
+    }
+
+    free(chunk);
+    free(census);
+    free(packed);
+    fclose(file);
+    return result;
+}
+
+// Function to load the IDs changed since the last backup
+// Without backup.pending there is no chain to extend, so the next backup is a full one.
+void openBackupPending() {
+    MappedFile mapped;
+    if (mapFile(BACKUP_PENDING_FILE, &mapped) != 0) {
+        return;
+    }
+    int count = (int)(mapped.size / sizeof(int32_t));
+    backupChangeCapacity = count > PATIENT_STORE_MIN_CAPACITY ? count : PATIENT_STORE_MIN_CAPACITY;
+    backupChanges = malloc((size_t)backupChangeCapacity * sizeof(int));
+    if (backupChanges == NULL) {
+        backupChangeCapacity = 0;
+        unmapFile(&mapped);
+        return;
+    }
+    if (count > 0) {
+        memcpy(backupChanges, mapped.data, (size_t)count * sizeof(int32_t));
+    }
+    backupChangeCount = count;
+    unmapFile(&mapped);
+    backupPendingFile = fopen(BACKUP_PENDING_FILE, "ab");
+}
+
+// Function to start an empty change list after a backup
+void resetBackupPending() {
+    if (backupPendingFile != NULL) {
+        fclose(backupPendingFile);
+    }
+    backupPendingFile = fopen(BACKUP_PENDING_FILE, "wb");
+    backupChangeCount = 0;
+}
+
+// Function to remember that a patient changed since the last backup
+void noteBackupChange(int patientID) {
+    if (backupPendingFile == NULL) {
+        return; // The next backup is a full one anyway
+    }
+    if (backupChangeCount == backupChangeCapacity) {
+        int newCapacity = backupChangeCapacity ? backupChangeCapacity * 2 : PATIENT_STORE_MIN_CAPACITY;
+        int *changes = realloc(backupChanges, (size_t)newCapacity * sizeof(int));
+        if (changes == NULL) {
+            // Cannot track it, so force the next backup to be a full one
+            fclose(backupPendingFile);
+            backupPendingFile = NULL;
+            remove(BACKUP_PENDING_FILE);
+            return;
+        }
+        backupChanges = changes;
+        backupChangeCapacity = newCapacity;
+    }
+    backupChanges[backupChangeCount++] = patientID;
+
+    int32_t id = patientID;
+    fwrite(&id, sizeof(id), 1, backupPendingFile);
+    metricsCount(METRIC_BYTES_WRITTEN, sizeof(id));
+    if (!batchMode) {
+        fflush(backupPendingFile);
+    }
+}
+
+// Function to write a slice of the census as a table
+// Rows [offset, offset + limit) of the chosen order are written (limit 0 = to the end).
+// Unsorted, rows run through the shards in order. Sorted, the shards' ordered indexes are
+// merged as rows are written, so nothing is sorted per listing.
+// Everything goes through one big buffer instead of a printf per patient.
+void renderPatients(FILE *stream, int offset, int limit, int sortBy) {
+    uint64_t started = metricsStart();
+    int total = patientCount();
+    if (offset < 0) offset = 0;
+    int end = limit > 0 && limit < total - offset ? offset + limit : total;
+
+    OrderCursor cursor;
+    OrderBound open = {1, 0, NULL};
+    if (sortBy != SORT_NONE && offset < end && startOrderCursor(&cursor, sortBy, &open, &open) != 0) {
+        sortBy = SORT_NONE; // Fall back to store order rather than failing
+    }
+
+    // Each call has its own buffer, so listings can run on several threads at once
+    OutputBuffer *out = malloc(sizeof(OutputBuffer));
+    if (out == NULL) {
+        fprintf(stream, "Error: Out of memory.\n");
+        return;
+    }
+    out->stream = stream;
+    out->length = 0;
+    outputText(out, "Patient ID", 12);
+    outputText(out, "Name", 20);
+    outputText(out, "Age", 6);
+    outputText(out, "Diagnosis", 30);
+    outputText(out, "Room Number", 12);
+    out->data[out->length - 1] = '\n';
+
+    int shard = 0, position = offset; // Unsorted: row within the current shard
+    for (int i = sortBy != SORT_NONE ? 0 : offset; i < end; i++) {
+        const PatientStore *patients;
+        int row;
+        if (sortBy != SORT_NONE) {
+            PatientRef ref;
+            nextOrderRow(&cursor, &ref);
+            if (i < offset) {
+                continue;
+            }
+            patients = &shards[ref.shard].patients;
+            row = ref.row;
+        } else {
+            while (position >= shards[shard].patients.count) {
+                position -= shards[shard].patients.count;
+                shard++;
+            }
+            patients = &shards[shard].patients;
+            row = position++;
+        }
+        // Same layout as "%-12d %-20s %-6d %-30s %-12d\n"
+        outputInt(out, patients->patientIDs[row], 12);
+        outputText(out, patients->names[row], 20);
+        outputInt(out, patients->ages[row], 6);
+        outputText(out, diagnosisText(patients->diagnosisCodes[row]), 30);
+        outputInt(out, patients->roomNumbers[row], 12);
+        out->data[out->length - 1] = '\n';
+    }
+
+    outputFlush(out);
+    free(out);
+    metricsCount(METRIC_ROWS_VISITED, (uint64_t)(sortBy != SORT_NONE ? end : end > offset ? end - offset : 0));
+    metricsObserve(METRIC_VIEW, started);
+}
+
+// Helper function to write out whatever is buffered
+void outputFlush(OutputBuffer *out) {
+    if (out->length > 0) {
+        fwrite(out->data, 1, (size_t)out->length, out->stream);
+        out->length = 0;
+    }
+}
+
+// Helper function to append a left-aligned text column padded to width plus a separator
+// Like %-*s, longer text is written in full rather than cut.
+void outputText(OutputBuffer *out, const char *text, int width) {
+    int length = (int)strlen(text);
+    int columns = (length > width ? length : width) + 1;
+    if (out->length + columns > OUTPUT_BUFFER_SIZE) {
+        outputFlush(out);
+    }
+    memcpy(out->data + out->length, text, (size_t)length);
+    memset(out->data + out->length + length, ' ', (size_t)(columns - length));
+    out->length += columns;
+}
+
+// Helper function to append a left-aligned int column padded to width plus a separator
+void outputInt(OutputBuffer *out, int value, int width) {
+    char digits[12];
+    int length = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        digits[sizeof(digits) - 1 - length++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        digits[sizeof(digits) - 1 - length++] = '-';
+    }
+
+    int columns = (length > width ? length : width) + 1;
+    if (out->length + columns > OUTPUT_BUFFER_SIZE) {
+        outputFlush(out);
+    }
+    memcpy(out->data + out->length, digits + sizeof(digits) - length, (size_t)length);
+    memset(out->data + out->length + length, ' ', (size_t)(columns - length));
+    out->length += columns;
+}
+
+// Helper function to read a sort order name ("id", "name", "age" or "room", anything else keeps store order)
+int parseSortOrder(const char *name) {
+    if (strcmp(name, "id") == 0) return SORT_BY_ID;
+    if (strcmp(name, "room") == 0) return SORT_BY_ROOM;
+    if (strcmp(name, "name") == 0) return SORT_BY_NAME;
+    if (strcmp(name, "age") == 0) return SORT_BY_AGE;
+    return SORT_NONE;
+}
+
+// Function to filter a block of ages to [minAge, maxAge] and count them by decade (see AgeFilter)
+// Plain C; the SIMD versions below use it for the rows left over after their last full vector.
+int filterAgesScalar(const int *ages, int count, int minAge, int maxAge, unsigned char *passed, int *decades) {
+    int matched = 0;
+    for (int i = 0; i < count; i++) {
+        if ((i & 7) == 0) {
+            passed[i / 8] = 0;
+        }
+        int age = ages[i];
+        if (age >= minAge && age <= maxAge) {
+            int decade = age < 0 ? 0 : age / 10;
+            decades[decade < ANALYTICS_DECADES - 1 ? decade : ANALYTICS_DECADES - 1]++;
+            passed[i / 8] |= (unsigned char)(1 << (i & 7));
+            matched++;
+        }
+    }
+    return matched;
+}
+
+#ifdef ANALYTICS_TARGET
+// SSE2 version: 4 ages per compare. Per lane it counts the rows dropped and, for every decade
+// boundary, the rows kept at or above it; the decade counts are the differences.
+// A row is dropped if minAge > age or age > maxAge, which holds for any bounds (minAge - 1
+// or maxAge + 1 would overflow at INT_MIN or INT_MAX).
+ANALYTICS_TARGET("sse2")
+int filterAgesSSE2(const int *ages, int count, int minAge, int maxAge, unsigned char *passed, int *decades) {
+    __m128i low = _mm_set1_epi32(minAge), high = _mm_set1_epi32(maxAge);
+    __m128i dropped = _mm_setzero_si128();
+    __m128i bounds[ANALYTICS_DECADES - 1], atLeast[ANALYTICS_DECADES - 1];
+    for (int k = 0; k < ANALYTICS_DECADES - 1; k++) {
+        bounds[k] = _mm_set1_epi32(10 * (k + 1) - 1);
+        atLeast[k] = _mm_setzero_si128();
+    }
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i age0 = _mm_loadu_si128((const __m128i *)(ages + i));
+        __m128i age1 = _mm_loadu_si128((const __m128i *)(ages + i + 4));
+        __m128i out0 = _mm_or_si128(_mm_cmpgt_epi32(low, age0), _mm_cmpgt_epi32(age0, high));
+        __m128i out1 = _mm_or_si128(_mm_cmpgt_epi32(low, age1), _mm_cmpgt_epi32(age1, high));
+        passed[i / 8] = (unsigned char)~(_mm_movemask_ps(_mm_castsi128_ps(out0)) |
+                                         _mm_movemask_ps(_mm_castsi128_ps(out1)) << 4);
+        dropped = _mm_sub_epi32(dropped, _mm_add_epi32(out0, out1)); // A dropped lane is -1
+        for (int k = 0; k < ANALYTICS_DECADES - 1; k++) {
+            __m128i above = _mm_add_epi32(_mm_andnot_si128(out0, _mm_cmpgt_epi32(age0, bounds[k])),
+                                          _mm_andnot_si128(out1, _mm_cmpgt_epi32(age1, bounds[k])));
+            atLeast[k] = _mm_sub_epi32(atLeast[k], above);
+        }
+    }
+
+    int lanes[4], matched, counts[ANALYTICS_DECADES - 1];
+    _mm_storeu_si128((__m128i *)lanes, dropped);
+    matched = i - (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    for (int k = 0; k < ANALYTICS_DECADES - 1; k++) {
+        _mm_storeu_si128((__m128i *)lanes, atLeast[k]);
+        counts[k] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    decades[0] += matched - counts[0];
+    for (int k = 1; k < ANALYTICS_DECADES - 1; k++) {
+        decades[k] += counts[k - 1] - counts[k];
+    }
+    decades[ANALYTICS_DECADES - 1] += counts[ANALYTICS_DECADES - 2];
+    return matched + filterAgesScalar(ages + i, count - i, minAge, maxAge, passed + i / 8, decades);
+}
+
+// AVX2 version: the same with 8 ages per compare
+ANALYTICS_TARGET("avx2")
+int filterAgesAVX2(const int *ages, int count, int minAge, int maxAge, unsigned char *passed, int *decades) {
+    __m256i low = _mm256_set1_epi32(minAge), high = _mm256_set1_epi32(maxAge);
+    __m256i dropped = _mm256_setzero_si256();
+    __m256i bounds[ANALYTICS_DECADES - 1], atLeast[ANALYTICS_DECADES - 1];
+    for (int k = 0; k < ANALYTICS_DECADES - 1; k++) {
+        bounds[k] = _mm256_set1_epi32(10 * (k + 1) - 1);
+        atLeast[k] = _mm256_setzero_si256();
+    }
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i age = _mm256_loadu_si256((const __m256i *)(ages + i));
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(low, age), _mm256_cmpgt_epi32(age, high));
+        passed[i / 8] = (unsigned char)~_mm256_movemask_ps(_mm256_castsi256_ps(out));
+        dropped = _mm256_sub_epi32(dropped, out);
+        for (int k = 0; k < ANALYTICS_DECADES - 1; k++) {
+            atLeast[k] = _mm256_sub_epi32(atLeast[k], _mm256_andnot_si256(out, _mm256_cmpgt_epi32(age, bounds[k])));
+        }
+    }
+
+    int lanes[8], matched = i, counts[ANALYTICS_DECADES - 1];
+    _mm256_storeu_si256((__m256i *)lanes, dropped);
+    for (int l = 0; l < 8; l++) {
+        matched -= lanes[l];
+    }
+    for (int k = 0; k < ANALYTICS_DECADES - 1; k++) {
+        _mm256_storeu_si256((__m256i *)lanes, atLeast[k]);
+        counts[k] = 0;
+        for (int l = 0; l < 8; l++) {
+            counts[k] += lanes[l];
+        }
+    }
+    decades[0] += matched - counts[0];
+    for (int k = 1; k < ANALYTICS_DECADES - 1; k++) {
+        decades[k] += counts[k - 1] - counts[k];
+    }
+    decades[ANALYTICS_DECADES - 1] += counts[ANALYTICS_DECADES - 2];
+    return matched + filterAgesScalar(ages + i, count - i, minAge, maxAge, passed + i / 8, decades);
+}
+#endif
+
+// Helper function to pick the widest age filter this CPU runs, and its name
+AgeFilter pickAgeFilter(const char **name) {
+#ifdef ANALYTICS_TARGET
+    if (ANALYTICS_HAS_AVX2()) {
+        *name = "avx2";
+        return filterAgesAVX2;
+    }
+    if (ANALYTICS_HAS_SSE2()) {
+        *name = "sse2";
+        return filterAgesSSE2;
+    }
+#endif
+    *name = "scalar";
+    return filterAgesScalar;
+}
+
+// Helper function for runParallel: analyze every parts-th shard into this part's CensusStats
+// Ages are filtered a block at a time by the SIMD kernel; only the rows it kept are then
+// counted by room and diagnosis, straight from the column arrays.
+void analyzeCensusPart(int part, int parts, void *context) {
+    AnalyticsJob *job = context;
+    CensusStats *stats = &job->parts[part];
+    unsigned char passed[ANALYTICS_BLOCK_ROWS / 8];
+    for (int s = part; s < STORE_SHARDS; s += parts) {
+        const PatientStore *patients = &shards[s].patients;
+        for (int first = 0; first < patients->count; first += ANALYTICS_BLOCK_ROWS) {
+            int rows = patients->count - first < ANALYTICS_BLOCK_ROWS ? patients->count - first : ANALYTICS_BLOCK_ROWS;
+            stats->matched += job->filter(patients->ages + first, rows, job->minAge, job->maxAge, passed, stats->decades);
+            for (int i = 0; i < rows; i += 8) {
+                for (unsigned int bits = passed[i / 8], row = (unsigned int)(first + i); bits != 0; bits >>= 1, row++) {
+                    if (bits & 1) {
+                        int room = patients->roomNumbers[row];
+                        if (room >= FIRST_ROOM_NUMBER && room <= LAST_ROOM_NUMBER) {
+                            stats->rooms[room - FIRST_ROOM_NUMBER]++;
+                        } else {
+                            stats->otherRooms++;
+                        }
+                        stats->diagnoses[patients->diagnosisCodes[row]]++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Function to count the patients aged minAge to maxAge by decade, room and diagnosis
+// A pass over the age, room and diagnosis code columns, one part of the shards per thread;
+// the parts' counts are added up at the end. Callers hold the shard locks (shared).
+// Returns 1 if memory runs out; otherwise the caller frees stats with freeCensusStats.
+int analyzeCensus(int minAge, int maxAge, CensusStats *stats) {
+    uint64_t started = metricsStart();
+    const char *kernel;
+    AnalyticsJob *job = calloc(1, sizeof(AnalyticsJob));
+    if (job == NULL) {
+        return 1;
+    }
+    job->minAge = minAge;
+    job->maxAge = maxAge;
+    job->filter = pickAgeFilter(&kernel);
+    acquireLock(&diagnosisLock, 0);
+    int diagnosisCount = diagnosisDictionary.count;
+    releaseLock(&diagnosisLock, 0);
+
+    int failed = 0;
+    int roomCount = LAST_ROOM_NUMBER - FIRST_ROOM_NUMBER + 1;
+    for (int p = 0; p < STORE_SHARDS && !failed; p++) {
+        job->parts[p].rooms = calloc((size_t)roomCount, sizeof(int));
+        job->parts[p].diagnoses = calloc((size_t)(diagnosisCount > 0 ? diagnosisCount : 1), sizeof(int));
+        job->parts[p].diagnosisCount = diagnosisCount;
+        failed = job->parts[p].rooms == NULL || job->parts[p].diagnoses == NULL;
+    }
+    if (!failed) {
+        runParallel(analyzeCensusPart, job, patientCount(), STORE_SHARDS);
+        *stats = job->parts[0];
+        for (int p = 1; p < STORE_SHARDS; p++) {
+            const CensusStats *part = &job->parts[p];
+            stats->matched += part->matched;
+            stats->otherRooms += part->otherRooms;
+            for (int k = 0; k < ANALYTICS_DECADES; k++) {
+                stats->decades[k] += part->decades[k];
+            }
+            for (int r = 0; r < roomCount; r++) {
+                stats->rooms[r] += part->rooms[r];
+            }
+            for (int code = 0; code < diagnosisCount; code++) {
+                stats->diagnoses[code] += part->diagnoses[code];
+            }
+        }
+    }
+    for (int p = failed ? 0 : 1; p < STORE_SHARDS; p++) {
+        freeCensusStats(&job->parts[p]);
+    }
+    free(job);
+    metricsCount(METRIC_ROWS_VISITED, (uint64_t)patientCount());
+    metricsObserve(METRIC_ANALYTICS, started);
+    return failed;
+}
+
+// Function to release the counts of an analyzeCensus result
+void freeCensusStats(CensusStats *stats) {
+    free(stats->rooms);
+    free(stats->diagnoses);
+    stats->rooms = NULL;
+    stats->diagnoses = NULL;
+}
+
+// Helper function to find the (at most) limit biggest non-zero counts, biggest first
+// Ties go to the lower index. Returns how many were found, their indexes in top.
+int topCounts(const int *counts, int count, int *top, int limit) {
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        if (counts[i] <= 0 || (found == limit && counts[i] <= counts[top[found - 1]])) {
+            continue;
+        }
+        int at = found < limit ? found++ : found - 1;
+        while (at > 0 && counts[top[at - 1]] < counts[i]) {
+            top[at] = top[at - 1];
+            at--;
+        }
+        top[at] = i;
+    }
+    return found;
+}
+
+// Function to print the census analytics report: patients by decade of age, the busiest
+// rooms and the most common diagnoses, for every patient or for an age range
+void printCensusAnalytics() {
+    char line[64];
+    int minAge = PATIENT_MIN_AGE, maxAge = PATIENT_MAX_AGE;
+    printf("Enter an age range (e.g. 65 125), or press Enter for all ages: ");
+    if (fgets(line, sizeof(line), stdin) != NULL) {
+        sscanf(line, "%d %d", &minAge, &maxAge);
+    }
+
+    const char *kernel;
+    pickAgeFilter(&kernel);
+    CensusStats stats;
+    if (analyzeCensus(minAge, maxAge, &stats) != 0) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
+    printf("Patients aged %d to %d: %d of %d (%s)\n", minAge, maxAge, stats.matched, patientCount(), kernel);
+    for (int k = 0; k < ANALYTICS_DECADES; k++) {
+        if (k < ANALYTICS_DECADES - 1) {
+            printf("  Ages %3d-%-3d %d\n", 10 * k, 10 * k + 9, stats.decades[k]);
+        } else {
+            printf("  Ages %3d+    %d\n", 10 * k, stats.decades[k]);
+        }
+    }
+
+    int top[ANALYTICS_TOP];
+    int found = topCounts(stats.rooms, LAST_ROOM_NUMBER - FIRST_ROOM_NUMBER + 1, top, ANALYTICS_TOP);
+    printf("Busiest rooms:");
+    for (int i = 0; i < found; i++) {
+        printf("%s %d (%d)", i ? "," : "", top[i] + FIRST_ROOM_NUMBER, stats.rooms[top[i]]);
+    }
+    printf(found ? "\n" : " none\n");
+    if (stats.otherRooms > 0) {
+        printf("In rooms outside %d-%d: %d\n", FIRST_ROOM_NUMBER, LAST_ROOM_NUMBER, stats.otherRooms);
+    }
+
+    found = topCounts(stats.diagnoses, stats.diagnosisCount, top, ANALYTICS_TOP);
+    printf("Most common diagnoses:\n");
+    for (int i = 0; i < found; i++) {
+        printf("  %-30s %d\n", diagnosisText(top[i]), stats.diagnoses[top[i]]);
+    }
+    printf("\n");
+    freeCensusStats(&stats);
+}
+
+// Function to close every data file kept open while the program runs
+void closeDataFiles() {
+    closeJournal();
+    if (backupPendingFile != NULL) {
+        fclose(backupPendingFile);
+        backupPendingFile = NULL;
+    }
+    if (archiveFile != NULL) {
+        fclose(archiveFile);
+        archiveFile = NULL;
+    }
+    if (archiveIndexFile != NULL) {
+        fclose(archiveIndexFile);
+        archiveIndexFile = NULL;
+    }
+}
+
+// Helper function to cut a file opened for writing back to size bytes
+int truncateFile(FILE *file, long size) {
+    fflush(file);
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), size) != 0;
+#else
+    return ftruncate(fileno(file), (off_t)size) != 0;
+#endif
+}
+
+// Helper functions for the archive's variable-length integers (7 bits per byte, low bits first)
+size_t putVarint(unsigned char *out, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char)value;
+    return length;
+}
+
+int getVarint(const unsigned char **cursor, const unsigned char *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *cursor < end; shift += 7) {
+        unsigned char byte = *(*cursor)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Helper function to decode the archive record at *cursor
+// previousTime is the time of the record before (0 at the start of a block).
+// Returns 1 if the record is cut short or malformed.
+int decodeArchiveRecord(const unsigned char **cursor, const unsigned char *end, int64_t previousTime, ArchiveRecord *record) {
+    uint64_t delta, id, age, room, length;
+    memset(record, 0, sizeof(*record));
+    if (getVarint(cursor, end, &delta) || getVarint(cursor, end, &id) || getVarint(cursor, end, &age) ||
+        getVarint(cursor, end, &room) || getVarint(cursor, end, &length) ||
+        length >= NAME_MAX_LENGTH || (uint64_t)(end - *cursor) < length) {
+        return 1;
+    }
+    record->dischargeTime = previousTime + (int64_t)delta;
+    record->patient.patientID = (int)((id >> 1) ^ (0 - (id & 1)));
+    record->patient.age = (int)age;
+    record->patient.roomNumber = (int)((room >> 1) ^ (0 - (room & 1)));
+    memcpy(record->patient.name, *cursor, (size_t)length);
+    *cursor += length;
+
+    if (getVarint(cursor, end, &length) || length >= DIAGNOSIS_MAX_LENGTH || (uint64_t)(end - *cursor) < length) {
+        return 1;
+    }
+    memcpy(record->patient.diagnosis, *cursor, (size_t)length);
+    *cursor += length;
+    return 0;
+}
+
+// Function to open the discharge archive for appending
+// The newest block is scanned to find where appending resumes; a record cut short by a
+// crash is cut off, and index entries that did not make it to disk are written again.
+void openArchive() {
+    archiveFile = fopen(ARCHIVE_FILE, "r+b");
+    if (archiveFile == NULL) {
+        archiveFile = fopen(ARCHIVE_FILE, "w+b");
+    }
+    archiveIndexFile = fopen(ARCHIVE_INDEX_FILE, "r+b");
+    if (archiveIndexFile == NULL) {
+        archiveIndexFile = fopen(ARCHIVE_INDEX_FILE, "w+b");
+    }
+    if (archiveFile == NULL || archiveIndexFile == NULL) {
+        printf("Warning: cannot open %s, discharges will not be archived.\n", ARCHIVE_FILE);
+        closeDataFiles();
+        return;
+    }
+
+    MappedFile archive, index;
+    if (mapFile(ARCHIVE_FILE, &archive) != 0) {
+        memset(&archive, 0, sizeof(archive));
+    }
+    if (mapFile(ARCHIVE_INDEX_FILE, &index) != 0) {
+        memset(&index, 0, sizeof(index));
+    }
+
+    if (archive.size < sizeof(ARCHIVE_MAGIC) || memcmp(archive.data, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) {
+        // New (or unreadable) archive: start it over
+        unmapFile(&archive);
+        unmapFile(&index);
+        truncateFile(archiveFile, 0);
+        truncateFile(archiveIndexFile, 0);
+        fseek(archiveFile, 0, SEEK_SET);
+        fwrite(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC), 1, archiveFile);
+        fflush(archiveFile);
+        archiveBlockRecords = ARCHIVE_BLOCK_RECORDS;
+        return;
+    }
+
+    // Resume from the last block the index knows about (or the start of the archive)
+    const ArchiveIndexEntry *entries = (const ArchiveIndexEntry *)index.data;
+    long entryCount = (long)(index.size / sizeof(ArchiveIndexEntry));
+    while (entryCount > 0 && entries[entryCount - 1].offset >= archive.size) {
+        entryCount--;
+    }
+    size_t offset = entryCount > 0 ? (size_t)entries[entryCount - 1].offset : sizeof(ARCHIVE_MAGIC);
+    int blockRecords = entryCount > 0 ? 0 : ARCHIVE_BLOCK_RECORDS;
+    int64_t lastTime = entryCount > 0 ? entries[entryCount - 1].firstTime : 0;
+    unmapFile(&index);
+    truncateFile(archiveIndexFile, entryCount * (long)sizeof(ArchiveIndexEntry));
+    fseek(archiveIndexFile, 0, SEEK_END);
+
+    const unsigned char *end = archive.data + archive.size;
+    while (offset < archive.size) {
+        const unsigned char *cursor = archive.data + offset;
+        ArchiveRecord record;
+        int blockStart = blockRecords == 0 || blockRecords == ARCHIVE_BLOCK_RECORDS;
+        if (decodeArchiveRecord(&cursor, end, blockStart ? 0 : lastTime, &record) != 0) {
+            break;
+        }
+        if (blockRecords == ARCHIVE_BLOCK_RECORDS) {
+            ArchiveIndexEntry entry = {record.dischargeTime, (uint64_t)offset};
+            fwrite(&entry, sizeof(entry), 1, archiveIndexFile);
+            blockRecords = 0;
+        }
+        blockRecords++;
+        lastTime = record.dischargeTime;
+        offset = (size_t)(cursor - archive.data);
+    }
+    size_t size = archive.size;
+    unmapFile(&archive);
+
+    if (offset < size) {
+        truncateFile(archiveFile, (long)offset);
+    }
+    fseek(archiveFile, 0, SEEK_END);
+    fflush(archiveIndexFile);
+    archiveLastTime = lastTime;
+    archiveBlockRecords = blockRecords;
+}
+
+// Function to append a discharged patient to the archive
+// The record goes in before its index entry, so the index never points past the data.
+void archiveDischarge(const Patient *patient) {
+    if (archiveFile == NULL) {
+        return;
+    }
+    int64_t now = (int64_t)time(NULL);
+    if (now < archiveLastTime) {
+        now = archiveLastTime; // Keep the archive in time order even if the clock steps back
+    }
+
+    int newBlock = archiveBlockRecords == ARCHIVE_BLOCK_RECORDS;
+    unsigned char buffer[ARCHIVE_RECORD_MAX];
+    size_t length = putVarint(buffer, (uint64_t)(newBlock ? now : now - archiveLastTime));
+    uint32_t id = (uint32_t)patient->patientID, room = (uint32_t)patient->roomNumber;
+    length += putVarint(buffer + length, (uint64_t)((id << 1) ^ (0u - (id >> 31))));
+    length += putVarint(buffer + length, (uint64_t)(uint32_t)patient->age);
+    length += putVarint(buffer + length, (uint64_t)((room << 1) ^ (0u - (room >> 31))));
+    size_t nameLength = strnlen(patient->name, NAME_MAX_LENGTH - 1);
+    length += putVarint(buffer + length, nameLength);
+    memcpy(buffer + length, patient->name, nameLength);
+    length += nameLength;
+    size_t diagnosisLength = strnlen(patient->diagnosis, DIAGNOSIS_MAX_LENGTH - 1);
+    length += putVarint(buffer + length, diagnosisLength);
+    memcpy(buffer + length, patient->diagnosis, diagnosisLength);
+    length += diagnosisLength;
+
+    ArchiveIndexEntry entry = {now, (uint64_t)ftell(archiveFile)};
+    fwrite(buffer, 1, length, archiveFile);
+    metricsCount(METRIC_BYTES_WRITTEN, length + (newBlock ? sizeof(entry) : 0));
+    if (!batchMode) {
+        fflush(archiveFile);
+    }
+    if (newBlock) {
+        fwrite(&entry, sizeof(entry), 1, archiveIndexFile);
+        if (!batchMode) {
+            fflush(archiveIndexFile);
+        }
+        archiveBlockRecords = 0;
+    }
+    archiveBlockRecords++;
+    archiveLastTime = now;
+}
+
+// Helper function to read a date (YYYY-MM-DD) as local time, at the start or end of that day
+// An empty text means no limit. Returns 1 if the text is not a date.
+int parseDate(const char *text, int endOfDay, time_t *when) {
+    int year, month, day;
+    if (text[0] == 0) {
+        *when = endOfDay ? (time_t)INT64_MAX : 0;
+        if (endOfDay && *when < 0) *when = (time_t)INT32_MAX; // 32-bit time_t
+        return 0;
+    }
+    if (sscanf(text, "%d-%d-%d", &year, &month, &day) != 3) {
+        return 1;
+    }
+    struct tm date = {0};
+    date.tm_year = year - 1900;
+    date.tm_mon = month - 1;
+    date.tm_mday = day;
+    date.tm_hour = endOfDay ? 23 : 0;
+    date.tm_min = endOfDay ? 59 : 0;
+    date.tm_sec = endOfDay ? 59 : 0;
+    date.tm_isdst = -1;
+    *when = mktime(&date);
+    return *when == (time_t)-1;
+}
+
+// Function to ask for a date range and list the patients discharged in it (report option 2)
+void printDischargeReport() {
+    char fromText[32], toText[32];
+    time_t from, to;
+    printf("Enter start date (YYYY-MM-DD, Enter for the beginning): ");
+    if (fgets(fromText, sizeof(fromText), stdin) == NULL) return;
+    fromText[strcspn(fromText, "\n")] = 0;
+    printf("Enter end date (YYYY-MM-DD, Enter for today): ");
+    if (fgets(toText, sizeof(toText), stdin) == NULL) return;
+    toText[strcspn(toText, "\n")] = 0;
+    if (parseDate(fromText, 0, &from) != 0 || parseDate(toText, 1, &to) != 0) {
+        printf("Error: Dates must look like 2025-01-29.\n\n");
+        return;
+    }
+    printDischargesBetween(from, to);
+}
+
+// Function to list the patients discharged between from and to
+// Binary search on the block index finds the first block of the range; only the records
+// from there to the end of the range are decoded, however long the archive is.
+void printDischargesBetween(time_t from, time_t to) {
+    if (archiveFile != NULL) fflush(archiveFile);
+    if (archiveIndexFile != NULL) fflush(archiveIndexFile);
+    MappedFile archive, index;
+    if (mapFile(ARCHIVE_FILE, &archive) != 0) {
+        printf("No discharged patients on record.\n\n");
+        return;
+    }
+    if (mapFile(ARCHIVE_INDEX_FILE, &index) != 0) {
+        memset(&index, 0, sizeof(index));
+    }
+
+    // Last block starting at or before the range start
+    const ArchiveIndexEntry *entries = (const ArchiveIndexEntry *)index.data;
+    size_t low = 0, high = index.size / sizeof(ArchiveIndexEntry);
+    while (low + 1 < high) {
+        size_t middle = (low + high) / 2;
+        if (entries[middle].firstTime <= (int64_t)from) low = middle; else high = middle;
+    }
+
+    static OutputBuffer out;
+    out.stream = stdout;
+    out.length = 0;
+    outputText(&out, "Discharged", 16);
+    outputText(&out, "Patient ID", 12);
+    outputText(&out, "Name", 20);
+    outputText(&out, "Age", 6);
+    outputText(&out, "Diagnosis", 30);
+    outputText(&out, "Room Number", 12);
+    out.data[out.length - 1] = '\n';
+
+    int listed = 0;
+    if (high > 0 && entries[low].offset < archive.size) {
+        const unsigned char *cursor = archive.data + entries[low].offset;
+        const unsigned char *end = archive.data + archive.size;
+        int64_t lastTime = 0;
+        int blockRecords = 0;
+        ArchiveRecord record;
+        while (cursor < end && decodeArchiveRecord(&cursor, end, blockRecords == 0 ? 0 : lastTime, &record) == 0) {
+            if (record.dischargeTime > (int64_t)to) {
+                break;
+            }
+            if (++blockRecords == ARCHIVE_BLOCK_RECORDS) {
+                blockRecords = 0;
+            }
+            lastTime = record.dischargeTime;
+            if (record.dischargeTime < (int64_t)from) {
+                continue;
+            }
+
+            char when[32];
+            struct tm local;
+            localTime((time_t)record.dischargeTime, &local);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &local);
+            outputText(&out, when, 16);
+            outputInt(&out, record.patient.patientID, 12);
+            outputText(&out, record.patient.name, 20);
+            outputInt(&out, record.patient.age, 6);
+            outputText(&out, record.patient.diagnosis, 30);
+            outputInt(&out, record.patient.roomNumber, 12);
+            out.data[out.length - 1] = '\n';
+            listed++;
+        }
+    }
+    outputFlush(&out);
+    printf("%d discharged patient(s) listed.\n\n", listed);
+
+    unmapFile(&index);
+    unmapFile(&archive);
+}
+
+// Function to run a batch of commands without any prompts
+// One command per line; see runCommand for the commands. Blank lines and lines
+// starting with # are skipped. Bad lines are reported on stderr and skipped.
+// Returns the number of bad lines.
+int runBatch(FILE *input) {
+    char line[BATCH_LINE_MAX];
+    int lineNumber = 0, errors = 0;
+    CommandTotals totals = {0};
+    clock_t start = clock();
+
+    batchMode = 1;
+    while (fgets(line, sizeof(line), input) != NULL) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '#') {
+            continue;
+        }
+        if (runCommand(line, stdout, &totals) != 0) {
+            fprintf(stderr, "Line %d skipped: %s\n", lineNumber, line);
+            errors++;
+        }
+    }
+    batchMode = 0;
+    if (journalFile != NULL && fflush(journalFile) != 0) {
+        // Entries were only buffered during the batch: the snapshot asked for here covers them
+        fprintf(stderr, "Error: cannot write to %s, a snapshot will be taken instead.\n", JOURNAL_FILE);
+        clearerr(journalFile);
+        metricsCount(METRIC_JOURNAL_ERRORS, 1);
+        atomic_store(&journalCompactDue, 1);
+        compactJournalIfDue();
+    }
+    if (backupPendingFile != NULL) fflush(backupPendingFile);
+
+    printf("Batch complete: %d lines, %d added, %d discharged, %d searched (%d found), %d shifts assigned, %d skipped.\n",
+           lineNumber, totals.added, totals.discharged, totals.searched, totals.found, totals.assigned, errors);
+    printf("Current patients: %d. Time: %.3f seconds.\n", patientCount(), (double)(clock() - start) / CLOCKS_PER_SEC);
+    return errors;
+}
+
+// Function to run one command line (batch files and server clients)
+// Comma-separated, fields may be "quoted":
+//   add,<id>,<name>,<age>,<diagnosis>,<room>
+//   discharge,<id>
+//   search,<id>                  (prints id,"name",age,"diagnosis",room when found)
+//   search,name,<name>[,icase|prefix]  (same, for every patient with that name)
+//   search,diagnosis,<words>     (same, in ID order, for every patient whose diagnosis has all the
+//                                words; "OR" separates alternatives, "word*" matches a prefix)
+//   room,<number>                (prints every patient in that room)
+//   range,<id|name|age|room>,<from>,<to>  (same, for every patient in that range, in order;
+//                                an empty end is open, a name end matches names starting with it)
+//   view[,<offset>,<limit>[,id|name|age|room]]  (prints the patient table, limit 0 = all)
+//   assign,<YYYY-MM-DD>,<shift>,<ward>,<doctor name>
+//   unassign,<YYYY-MM-DD>,<shift>,<ward>,<doctor name>
+//   assign,<day 0-6>,<shift>,<doctor name>  (old weekly form: ward 1 of this week)
+//   autoschedule,<YYYY-MM-DD>,<days>,<wards>,<doctors per shift>,<max shifts per week>[,<availability file>]
+//   onduty[,<YYYY-MM-DD>,<shift>]  (prints ward,"doctor" for that shift, default now)
+//   free,<doctor name>,<YYYY-MM-DD>,<shift>  (prints free or working)
+//   metrics                      (prints the metrics in the Prometheus text format)
+//   stats[,<min age>,<max age>]  (prints patients,<count>, then age,<decade>,<count>,
+//                                room,<number>,<count> (room,other,<count> outside the ward rooms)
+//                                and diagnosis,"diagnosis",<count> lines)
+// Output goes to out. Commands from several threads can run at once:
+//  - add and discharge share storeLock and hold their patient's shard lock alone;
+//  - other lookups share storeLock and every shard lock; search by ID takes no lock at all;
+//  - roster changes hold storeLock alone.
+// Returns 1 for a bad command.
+int runCommand(char *line, FILE *out, CommandTotals *totals) {
+    uint64_t started = metricsStart();
+    char *fields[BATCH_MAX_FIELDS];
+    int count = splitBatchLine(line, fields, BATCH_MAX_FIELDS);
+    const char *command = fields[0];
+    int id, age, room, day, shift, ward;
+    int ok = 0;
+
+    int lookup = strcmp(command, "search") == 0 || strcmp(command, "room") == 0 || strcmp(command, "view") == 0 ||
+                 strcmp(command, "range") == 0 ||
+                 strcmp(command, "onduty") == 0 || strcmp(command, "free") == 0 || strcmp(command, "metrics") == 0 ||
+                 strcmp(command, "stats") == 0;
+    int lockFree = strcmp(command, "search") == 0 && count == 2; // ID lookups use lookupPatient
+    int shard = -1; // Shard of the patient an add or discharge changes
+    if ((strcmp(command, "add") == 0 || strcmp(command, "discharge") == 0) && count >= 2 &&
+        parseBatchInt(fields[1], &id) == 0) {
+        shard = shardOf(id);
+    }
+    if (!lockFree) {
+        lockStore(!lookup && shard < 0);
+        if (shard >= 0) {
+            acquireLock(&shards[shard].lock, 1);
+        } else if (lookup) {
+            lockShards(0);
+        }
+    }
+
+    if (strcmp(command, "add") == 0 && count == 6 &&
+        parseBatchInt(fields[1], &id) == 0 && parseBatchInt(fields[3], &age) == 0 &&
+        parseBatchInt(fields[5], &room) == 0 &&
+        age >= PATIENT_MIN_AGE && age <= PATIENT_MAX_AGE) {
+        Patient patient = {0};
+        patient.patientID = id;
+        patient.age = age;
+        patient.roomNumber = room;
+        copyBatchText(patient.name, fields[2], NAME_MAX_LENGTH);
+        copyBatchText(patient.diagnosis, fields[4], DIAGNOSIS_MAX_LENGTH);
+        ok = admitPatient(&patient) == 0; // Fails on a duplicate ID
+        totals->added += ok;
+    } else if (strcmp(command, "discharge") == 0 && count == 2 && parseBatchInt(fields[1], &id) == 0) {
+        ok = dischargePatientByID(id) == 0;
+        totals->discharged += ok;
+    } else if (strcmp(command, "search") == 0 && count == 2 && parseBatchInt(fields[1], &id) == 0) {
+        Patient patient;
+        uint64_t searchStarted = metricsStart();
+        int missing = lookupPatient(id, &patient);
+        metricsObserve(METRIC_SEARCH_ID, searchStarted);
+        if (!missing) {
+            fprintf(out, "%d,\"%s\",%d,\"%s\",%d\n",
+                    patient.patientID, patient.name, patient.age, patient.diagnosis, patient.roomNumber);
+            totals->found++;
+        }
+        totals->searched++;
+        ok = 1;
+    } else if (strcmp(command, "search") == 0 && (count == 3 || count == 4) && strcmp(fields[1], "name") == 0) {
+        int mode = count == 3 ? NAME_EXACT : strcmp(fields[3], "icase") == 0 ? NAME_IGNORE_CASE :
+                   strcmp(fields[3], "prefix") == 0 ? NAME_PREFIX : 0;
+        PatientRef *refs = NULL;
+        int matches = mode != 0 ? findPatientsInShards(fields[2], mode, &refs) : -1;
+        for (int i = 0; i < matches; i++) {
+            printBatchRow(out, &shards[refs[i].shard].patients, refs[i].row);
+        }
+        free(refs);
+        if (matches >= 0) {
+            totals->found += matches > 0;
+            totals->searched++;
+            ok = 1;
+        }
+    } else if (strcmp(command, "search") == 0 && count == 3 && strcmp(fields[1], "diagnosis") == 0) {
+        PatientRef *refs = NULL;
+        int matches = findPatientsByDiagnosis(fields[2], &refs);
+        for (int i = 0; i < matches; i++) {
+            printBatchRow(out, &shards[refs[i].shard].patients, refs[i].row);
+        }
+        free(refs);
+        if (matches >= 0) {
+            totals->found += matches > 0;
+            totals->searched++;
+            ok = 1;
+        }
+    } else if (strcmp(command, "room") == 0 && count == 2 && parseBatchInt(fields[1], &room) == 0) {
+        uint64_t searchStarted = metricsStart();
+        int occupants = 0;
+        for (int s = 0; s < STORE_SHARDS; s++) {
+            PatientStore *patients = &shards[s].patients;
+            int entry = findRoomEntry(patients, room, 0);
+            for (int row = entry >= 0 ? patients->rooms[entry].firstRow : -1; row >= 0; row = patients->roomNext[row]) {
+                printBatchRow(out, patients, row);
+            }
+            occupants += entry >= 0 ? patients->rooms[entry].occupants : 0;
+        }
+        metricsCount(METRIC_ROWS_VISITED, (uint64_t)occupants);
+        metricsObserve(METRIC_SEARCH_ROOM, searchStarted);
+        totals->found += occupants > 0;
+        totals->searched++;
+        ok = 1;
+    } else if (strcmp(command, "range") == 0 && count == 4 && parseSortOrder(fields[1]) != SORT_NONE) {
+        int sortBy = parseSortOrder(fields[1]);
+        OrderBound from, to;
+        PatientRef *refs = NULL;
+        int matches = parseOrderBound(sortBy, fields[2], &from) == 0 && parseOrderBound(sortBy, fields[3], &to) == 0 ?
+                      findPatientsInRange(sortBy, &from, &to, &refs) : -1;
+        for (int i = 0; i < matches; i++) {
+            printBatchRow(out, &shards[refs[i].shard].patients, refs[i].row);
+        }
+        free(refs);
+        if (matches >= 0) {
+            totals->found += matches > 0;
+            totals->searched++;
+            ok = 1;
+        }
+    } else if (strcmp(command, "view") == 0 && (count == 1 || count == 3 || count == 4)) {
+        int offset = 0, limit = 0;
+        if (count == 1 || (parseBatchInt(fields[1], &offset) == 0 && parseBatchInt(fields[2], &limit) == 0)) {
+            renderPatients(out, offset, limit, count == 4 ? parseSortOrder(fields[3]) : SORT_NONE);
+            ok = 1;
+        }
+    } else if ((strcmp(command, "onduty") == 0 && (count == 1 || count == 3)) ||
+               (strcmp(command, "free") == 0 && count == 4)) {
+        int dated = count > 1;
+        currentDayAndShift(&day, &shift);
+        if (!dated || (parseDay(fields[count - 2], &day) == 0 && parseBatchInt(fields[count - 1], &shift) == 0 &&
+                       shift >= 0 && shift < SHIFTS_IN_DAY)) {
+            if (command[0] == 'o') {
+                for (ward = 1; ward <= WARD_COUNT; ward++) {
+                    for (int entry = rosterSlotFirst(day, shift, ward); entry >= 0; entry = roster.assignments[entry].next) {
+                        fprintf(out, "%d,\"%s\"\n", ward, doctorName(roster.assignments[entry].doctorID));
+                    }
+                }
+            } else {
+                int doctorID = findDoctor(fields[1], 0);
+                fprintf(out, "%s\n", doctorID > NO_DOCTOR && rosterDoctorBusy(doctorID, day, shift) ? "working" : "free");
+            }
+            ok = 1;
+        }
+    } else if ((strcmp(command, "assign") == 0 || strcmp(command, "unassign") == 0) && count == 5 &&
+               parseDay(fields[1], &day) == 0 && parseBatchInt(fields[2], &shift) == 0 &&
+               parseBatchInt(fields[3], &ward) == 0 &&
+               shift >= 0 && shift < SHIFTS_IN_DAY && ward >= 1 && ward <= WARD_COUNT) {
+        char name[NAME_MAX_LENGTH];
+        copyBatchText(name, fields[4], NAME_MAX_LENGTH);
+        if (command[0] == 'a') {
+            ok = name[0] != 0 && scheduleDoctor(day, shift, ward, name) == 0;
+            totals->assigned += ok;
+        } else {
+            ok = unscheduleDoctor(day, shift, ward, name) == 0;
+        }
+    } else if (strcmp(command, "autoschedule") == 0 && (count == 6 || count == 7)) {
+        AutoScheduleRequest request;
+        int missing, filled;
+        if (parseDay(fields[1], &request.firstDay) == 0 && parseBatchInt(fields[2], &request.days) == 0 &&
+            parseBatchInt(fields[3], &request.wards) == 0 && parseBatchInt(fields[4], &request.perShift) == 0 &&
+            parseBatchInt(fields[5], &request.maxPerWeek) == 0 &&
+            autoScheduleRoster(&request, count == 7 ? fields[6] : "", &filled, &missing, out) == 0) {
+            fprintf(out, "autoschedule: %d assigned, %d still needed\n", filled, missing);
+            totals->assigned += filled;
+            ok = 1;
+        }
+    } else if (strcmp(command, "assign") == 0 && count == 4 &&
+               parseBatchInt(fields[1], &day) == 0 && parseBatchInt(fields[2], &shift) == 0 &&
+               day >= 0 && day < DAYS_IN_WEEK && shift >= 0 && shift < SHIFTS_IN_DAY) {
+        // Old weekly form: the doctor takes over ward 1 for that day of this week
+        char name[NAME_MAX_LENGTH];
+        int today, shiftNow;
+        copyBatchText(name, fields[3], NAME_MAX_LENGTH);
+        currentDayAndShift(&today, &shiftNow);
+        day += weekStart(today);
+        for (int entry; (entry = rosterSlotFirst(day, shift, 1)) >= 0; ) {
+            unscheduleDoctor(day, shift, 1, doctorName(roster.assignments[entry].doctorID));
+        }
+        ok = name[0] == 0 || scheduleDoctor(day, shift, 1, name) == 0;
+        totals->assigned += ok;
+    } else if (strcmp(command, "metrics") == 0 && count == 1) {
+        writeMetrics(out);
+        ok = 1;
+    } else if (strcmp(command, "stats") == 0 && (count == 1 || count == 3)) {
+        int minAge = PATIENT_MIN_AGE, maxAge = PATIENT_MAX_AGE;
+        CensusStats stats;
+        if ((count == 1 || (parseBatchInt(fields[1], &minAge) == 0 && parseBatchInt(fields[2], &maxAge) == 0)) &&
+            analyzeCensus(minAge, maxAge, &stats) == 0) {
+            fprintf(out, "patients,%d\n", stats.matched);
+            for (int k = 0; k < ANALYTICS_DECADES; k++) {
+                if (k < ANALYTICS_DECADES - 1) {
+                    fprintf(out, "age,%d-%d,%d\n", 10 * k, 10 * k + 9, stats.decades[k]);
+                } else {
+                    fprintf(out, "age,%d+,%d\n", 10 * k, stats.decades[k]);
+                }
+            }
+            for (int r = 0; r <= LAST_ROOM_NUMBER - FIRST_ROOM_NUMBER; r++) {
+                if (stats.rooms[r] > 0) {
+                    fprintf(out, "room,%d,%d\n", r + FIRST_ROOM_NUMBER, stats.rooms[r]);
+                }
+            }
+            if (stats.otherRooms > 0) {
+                fprintf(out, "room,other,%d\n", stats.otherRooms);
+            }
+            for (int code = 0; code < stats.diagnosisCount; code++) {
+                if (stats.diagnoses[code] > 0) {
+                    fprintf(out, "diagnosis,\"%s\",%d\n", diagnosisText(code), stats.diagnoses[code]);
+                }
+            }
+            freeCensusStats(&stats);
+            ok = 1;
+        }
+    }
+
+    if (!lockFree) {
+        if (shard >= 0) {
+            releaseLock(&shards[shard].lock, 1);
+        } else if (lookup) {
+            unlockShards(0);
+        }
+        unlockStore(!lookup && shard < 0);
+    }
+    if (atomic_load(&journalCompactDue) && !journalCompactHeld) {
+        lockStore(1);
+        compactJournalIfDue();
+        unlockStore(1);
+    }
+    if (!ok) {
+        metricsCount(METRIC_COMMAND_ERRORS, 1);
+    }
+    metricsObserve(METRIC_COMMAND, started);
+    dumpMetricsIfDue();
+    return !ok;
+}
+
+// Helper functions to take and release a lock (shared for lookups, exclusive for changes)
+void acquireLock(StoreLock *lock, int exclusive) {
+#ifdef _WIN32
+    if (exclusive) AcquireSRWLockExclusive(lock); else AcquireSRWLockShared(lock);
+#else
+    if (exclusive) pthread_rwlock_wrlock(lock); else pthread_rwlock_rdlock(lock);
+#endif
+}
+
+void releaseLock(StoreLock *lock, int exclusive) {
+#ifdef _WIN32
+    if (exclusive) ReleaseSRWLockExclusive(lock); else ReleaseSRWLockShared(lock);
+#else
+    (void)exclusive;
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+void lockStore(int exclusive) {
+    acquireLock(&storeLock, exclusive);
+}
+
+void unlockStore(int exclusive) {
+    releaseLock(&storeLock, exclusive);
+}
+
+// Helper functions to take and release every shard lock (in shard order, see StoreShard)
+void lockShards(int exclusive) {
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        acquireLock(&shards[s].lock, exclusive);
+    }
+}
+
+void unlockShards(int exclusive) {
+    for (int s = STORE_SHARDS - 1; s >= 0; s--) {
+        releaseLock(&shards[s].lock, exclusive);
+    }
+}
+
+// Function to mark the start of a shard change for lock-free readers (shard lock held alone)
+void beginStoreChange(StoreShard *shard) {
+    atomic_fetch_add(&shard->sequence, 1); // Odd: rows may be half written
+    atomic_thread_fence(memory_order_release); // A reader that sees any of the writes below sees the odd sequence
+}
+
+// Function to mark the end of a shard change
+// Publishes the arrays the change may have replaced, then frees whatever no reader can still see.
+void endStoreChange(StoreShard *shard) {
+    publishStoreView(shard);
+    atomic_fetch_add(&shard->sequence, 1);
+    reclaimMemory(0);
+}
+
+// The columns and index slots a lookup reads are written while lookups may be copying them,
+// so both sides use these relaxed atomic accesses rather than plain ones (which would be a
+// data race under C11, even though the sequence check throws a torn copy away).
+_Static_assert(sizeof(atomic_int) == sizeof(int) && _Alignof(atomic_int) == _Alignof(int),
+               "shared columns are accessed as atomic_int");
+_Static_assert(sizeof(atomic_char) == sizeof(char), "shared names are accessed as atomic_char");
+
+void storeShared(int *slot, int value) {
+    atomic_store_explicit((atomic_int *)slot, value, memory_order_relaxed);
+}
+
+int loadShared(const int *slot) {
+    return atomic_load_explicit((const atomic_int *)slot, memory_order_relaxed);
+}
+
+// Copies size bytes; either side may be the shared one
+void copyShared(char *to, const char *from, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        atomic_store_explicit((atomic_char *)&to[i], atomic_load_explicit((const atomic_char *)&from[i], memory_order_relaxed),
+                              memory_order_relaxed);
+    }
+}
+
+// Helper function to publish a shard's current arrays as one StoreView for lock-free lookups
+// The old view is retired like any other replaced array.
+void publishStoreView(StoreShard *shard) {
+    const PatientStore *patients = &shard->patients;
+    acquireLock(&retireLock, 1);
+    StoreView *view = poolAlloc(&viewPool);
+    releaseLock(&retireLock, 1);
+    if (view != NULL) {
+        view->index = patients->index;
+        view->indexCapacity = patients->indexCapacity;
+        view->patientIDs = patients->patientIDs;
+        view->ages = patients->ages;
+        view->roomNumbers = patients->roomNumbers;
+        view->names = (const char (*)[NAME_MAX_LENGTH])patients->names;
+        view->diagnosisCodes = patients->diagnosisCodes;
+        view->capacity = patients->capacity;
+    }
+    // With no view, lookups fall back to the shard lock until the next change publishes one
+    retireBlock(&viewPool, atomic_exchange(&shard->view, view));
+    atomic_fetch_add(&globalEpoch, 1);
+}
+
+// Helper function to hand memory a lock-free reader may still be using to reclaimMemory
+void retireMemory(void *memory) {
+    retireBlock(NULL, memory);
+}
+
+// Same for a block of a BlockPool, which goes back to the pool instead of being freed
+void retireBlock(BlockPool *pool, void *memory) {
+    if (memory == NULL) {
+        return;
+    }
+    acquireLock(&retireLock, 1);
+    if (retiredCount == retiredCapacity) {
+        int newCapacity = retiredCapacity ? retiredCapacity * 2 : 16;
+        RetiredMemory *grown = realloc(retiredMemory, (size_t)newCapacity * sizeof(RetiredMemory));
+        if (grown == NULL) {
+            // No room to defer it: the safe choice is to leak it
+            releaseLock(&retireLock, 1);
+            return;
+        }
+        retiredMemory = grown;
+        retiredCapacity = newCapacity;
+    }
+    retiredMemory[retiredCount].memory = memory;
+    retiredMemory[retiredCount].pool = pool;
+    retiredMemory[retiredCount].epoch = atomic_load(&globalEpoch);
+    retiredCount++;
+    releaseLock(&retireLock, 1);
+}
+
+// Helper function to free retired memory that no reader can still be using
+// Memory retired in epoch e is free once every reader inside a lookup entered after e.
+// With all set, everything is freed (only at exit, when no reader is left).
+void reclaimMemory(int all) {
+    acquireLock(&retireLock, 1);
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < MAX_READERS && !all; i++) {
+        uint64_t epoch = atomic_load(&readerSlots[i].epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    int kept = 0;
+    for (int i = 0; i < retiredCount; i++) {
+        if (all || retiredMemory[i].epoch < oldest) {
+            if (retiredMemory[i].pool != NULL) {
+                poolFree(retiredMemory[i].pool, retiredMemory[i].memory);
+            } else {
+                free(retiredMemory[i].memory);
+            }
+        } else {
+            retiredMemory[kept++] = retiredMemory[i];
+        }
+    }
+    retiredCount = kept;
+    if (all) {
+        free(retiredMemory);
+        retiredMemory = NULL;
+        retiredCapacity = 0;
+        poolDestroy(&viewPool);
+    }
+    releaseLock(&retireLock, 1);
+}
+
+// Function to take a block from a pool, NULL if memory runs out
+// Freed blocks come first, then the rest of the newest slab, then a new slab.
+void *poolAlloc(BlockPool *pool) {
+    PoolBlock *block = pool->freeList;
+    if (block != NULL) {
+        pool->freeList = block->next;
+        return block;
+    }
+    if (pool->slabCount == 0 || pool->carved == pool->blocksPerSlab) {
+        unsigned char *slab = malloc(pool->blockSize * (size_t)pool->blocksPerSlab);
+        if (slab == NULL ||
+            growArray((void **)&pool->slabs, &pool->slabCapacity, pool->slabCount + 1, sizeof(unsigned char *)) != 0) {
+            free(slab);
+            return NULL;
+        }
+        pool->slabs[pool->slabCount++] = slab;
+        pool->carved = 0;
+    }
+    return pool->slabs[pool->slabCount - 1] + pool->blockSize * (size_t)pool->carved++;
+}
+
+// Function to give a block back to its pool
+void poolFree(BlockPool *pool, void *memory) {
+    PoolBlock *block = memory;
+    block->next = pool->freeList;
+    pool->freeList = block;
+}
+
+// Function to release every slab of a pool at once (its blocks must no longer be in use)
+void poolDestroy(BlockPool *pool) {
+    for (int i = 0; i < pool->slabCount; i++) {
+        free(pool->slabs[i]);
+    }
+    free(pool->slabs);
+    pool->slabs = NULL;
+    pool->slabCount = 0;
+    pool->slabCapacity = 0;
+    pool->carved = 0;
+    pool->freeList = NULL;
+}
+
+// Helper function to announce a lock-free reader, returns its slot or -1 if all slots are taken
+int enterReader() {
+    if (readerSlot < 0) {
+        for (int i = 0; i < MAX_READERS; i++) {
+            int expected = 0;
+            if (atomic_compare_exchange_strong(&readerSlots[i].taken, &expected, 1)) {
+                readerSlot = i;
+                break;
+            }
+        }
+        if (readerSlot < 0) {
+            return -1;
+        }
+    }
+    atomic_store(&readerSlots[readerSlot].epoch, atomic_load(&globalEpoch));
+    return readerSlot;
+}
+
+void exitReader(int slot) {
+    atomic_store(&readerSlots[slot].epoch, 0);
+}
+
+// Function to give back this thread's reader slot (when a server thread ends)
+void releaseReaderSlot() {
+    if (readerSlot >= 0) {
+        atomic_store(&readerSlots[readerSlot].epoch, 0);
+        atomic_store(&readerSlots[readerSlot].taken, 0);
+        readerSlot = -1;
+    }
+}
+
+// Function to look up a patient by ID without taking a lock
+// Copies the patient to out; returns 1 if the ID is not on file. A copy that raced a
+// change is read again; after LOOKUP_RETRIES tries (a long run of changes) it falls
+// back to the shard lock so the lookup always finishes.
+int lookupPatient(int patientID, Patient *out) {
+    StoreShard *shard = &shards[shardOf(patientID)];
+    int slot = enterReader();
+    for (int attempt = 0; slot >= 0 && attempt < LOOKUP_RETRIES; attempt++) {
+        unsigned int sequence = atomic_load_explicit(&shard->sequence, memory_order_acquire);
+        const StoreView *view = atomic_load(&shard->view);
+        if (view == NULL) {
+            break;
+        }
+        if (sequence & 1) {
+            continue;
+        }
+
+        // Same probe as findIndexSlot, bounded because a racing change may leave no empty slot in sight
+        unsigned int mask = (unsigned int)view->indexCapacity - 1;
+        unsigned int i = hashPatientID(patientID) & mask;
+        int row = -1, probes = 0;
+        for (; probes < view->indexCapacity && loadShared(&view->index[i].row) >= 0; probes++) {
+            if (loadShared(&view->index[i].patientID) == patientID) {
+                row = loadShared(&view->index[i].row);
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        metricsCount(METRIC_INDEX_PROBES, (uint64_t)probes + 1);
+        int code = 0;
+        if (row >= 0 && row < view->capacity) {
+            out->patientID = loadShared(&view->patientIDs[row]);
+            out->age = loadShared(&view->ages[row]);
+            out->roomNumber = loadShared(&view->roomNumbers[row]);
+            copyShared(out->name, view->names[row], NAME_MAX_LENGTH);
+            code = loadShared(&view->diagnosisCodes[row]);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shard->sequence, memory_order_relaxed) != sequence) {
+            continue;
+        }
+        if (row < 0 || out->patientID != patientID) {
+            exitReader(slot);
+            return 1;
+        }
+        // The text only once the copy checked out (a torn code is no code). A code is reused
+        // only after its last patient left, so if the shard is still unchanged after the text
+        // is copied, the text was not rewritten under the copy.
+        copyShared(out->diagnosis, diagnosisText(code), DIAGNOSIS_MAX_LENGTH);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shard->sequence, memory_order_relaxed) == sequence) {
+            exitReader(slot);
+            out->name[NAME_MAX_LENGTH - 1] = 0;
+            out->diagnosis[DIAGNOSIS_MAX_LENGTH - 1] = 0;
+            return 0;
+        }
+    }
+    if (slot >= 0) {
+        exitReader(slot);
+    }
+
+    acquireLock(&shard->lock, 0);
+    int row = findPatientRow(&shard->patients, patientID);
+    if (row >= 0) {
+        getPatient(&shard->patients, row, out);
+    }
+    releaseLock(&shard->lock, 0);
+    return row < 0;
+}
+
+#ifndef _WIN32
+// Helper function for SIGINT/SIGTERM while serving
+void stopServer(int signalNumber) {
+    (void)signalNumber;
+    atomic_store(&serverStopping, 1);
+}
+
+// Helper function to send a whole buffer to a socket
+int sendAll(int socketFD, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = write(socketFD, data, size);
+        if (sent <= 0) {
+            return 1;
+        }
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Function to serve one client connection (runs on its own thread)
+// Each line is a command (see runCommand); its output is sent back followed by a line
+// "OK" or "ERR". The output is built in memory first, so a slow client never holds
+// storeLock. "quit" ends the connection.
+void *serveClient(void *argument) {
+    int socketFD = (int)(intptr_t)argument;
+    FILE *input = fdopen(socketFD, "r");
+    if (input == NULL) {
+        close(socketFD);
+        return NULL;
+    }
+
+    char line[BATCH_LINE_MAX];
+    CommandTotals totals = {0};
+    while (!atomic_load(&serverStopping) && fgets(line, sizeof(line), input) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (strcmp(line, "quit") == 0) {
+            break;
+        }
+        char *reply = NULL;
+        size_t replySize = 0;
+        FILE *out = open_memstream(&reply, &replySize);
+        if (out == NULL) {
+            break;
+        }
+        int failed = line[0] == 0 || runCommand(line, out, &totals) != 0;
+        fputs(failed ? "ERR\n" : "OK\n", out);
+        fclose(out);
+        int sendFailed = sendAll(socketFD, reply, replySize);
+        free(reply);
+        if (sendFailed) {
+            break;
+        }
+    }
+    fclose(input); // Also closes the socket
+    releaseReaderSlot();
+    return NULL;
+}
+#endif
+
+// Function to serve commands to many clients at once over a Unix socket
+// Every client gets a thread; lookups run side by side, changes one at a time.
+// Runs until SIGINT or SIGTERM. Returns 1 if the socket cannot be set up.
+int runServer(const char *path) {
+#ifdef _WIN32
+    (void)path;
+    printf("Error: Server mode needs Unix sockets and is not available on Windows.\n");
+    return 1;
+#else
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Error: Socket path %s is too long.\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // A socket left behind by an earlier run
+    if (listenFD < 0 || bind(listenFD, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listenFD, SERVER_BACKLOG) != 0) {
+        printf("Error: Cannot listen on %s.\n", path);
+        if (listenFD >= 0) close(listenFD);
+        return 1;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = stopServer; // No SA_RESTART, so accept() returns when a signal arrives
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);       // A client hanging up must not kill the server
+
+    printf("Serving on %s (Ctrl+C to stop).\n", path);
+    fflush(stdout);
+    while (!atomic_load(&serverStopping)) {
+        int clientFD = accept(listenFD, NULL, NULL);
+        if (clientFD < 0) {
+            continue;
+        }
+        // Client threads start with the stop signals blocked, so they always reach this thread
+        sigset_t stopSignals, previous;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, &previous);
+        pthread_t thread;
+        int started = pthread_create(&thread, NULL, serveClient, (void *)(intptr_t)clientFD) == 0;
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        if (!started) {
+            close(clientFD);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listenFD);
+    unlink(path);
+    lockStore(1); // Wait for the command in progress; clients are cut off when the process ends
+    printf("Server stopped.\n");
+    return 0;
+#endif
+}
+
+// Function to measure read throughput: clients threads each send requests lookups
+// ("search,<id>") to a running server and wait for every reply.
+int runLoadTest(const char *path, int clients, int requests) {
+#ifdef _WIN32
+    (void)path;
+    (void)clients;
+    (void)requests;
+    printf("Error: The load test needs Unix sockets and is not available on Windows.\n");
+    return 1;
+#else
+    if (clients < 1 || clients > MAX_WORKERS || requests < 1) {
+        printf("Error: Use 1 to %d clients and at least one request.\n", MAX_WORKERS);
+        return 1;
+    }
+    LoadTestClient loadClients[MAX_WORKERS];
+    WorkerThread threads[MAX_WORKERS];
+    uint64_t start = monotonicNanoseconds();
+    int running = 0;
+    for (int i = 0; i < clients; i++) {
+        loadClients[i].path = path;
+        loadClients[i].requests = requests;
+        loadClients[i].seed = i + 1;
+        loadClients[i].completed = 0;
+        if (startWorker(&threads[i], runLoadTestClient, &loadClients[i]) != 0) {
+            break;
+        }
+        running++;
+    }
+    long total = 0;
+    for (int i = 0; i < running; i++) {
+        joinWorker(threads[i]);
+        total += loadClients[i].completed;
+    }
+    double seconds = (double)(monotonicNanoseconds() - start) / 1e9;
+    printf("Load test: %d clients, %ld lookups in %.3f seconds (%.0f lookups/second).\n",
+           running, total, seconds, seconds > 0 ? (double)total / seconds : 0.0);
+    return total != (long)clients * requests;
+#endif
+}
+
+#ifndef _WIN32
+// Function to run one load test client (on its own thread)
+void *runLoadTestClient(void *argument) {
+    LoadTestClient *client = argument;
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, client->path, sizeof(address.sun_path) - 1);
+    int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0 || connect(socketFD, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        if (socketFD >= 0) close(socketFD);
+        return NULL;
+    }
+    FILE *replies = fdopen(socketFD, "r");
+    if (replies == NULL) {
+        close(socketFD);
+        return NULL;
+    }
+
+    unsigned int state = (unsigned int)client->seed * 2654435769u;
+    char request[32], reply[BATCH_LINE_MAX];
+    for (int i = 0; i < client->requests; i++) {
+        state = state * 1103515245u + 12345u;
+        int length = snprintf(request, sizeof(request), "search,%u\n", (state >> 8) % 100000 + 1);
+        if (sendAll(socketFD, request, (size_t)length) != 0) {
+            break;
+        }
+        int done = 0;
+        while (!done && fgets(reply, sizeof(reply), replies) != NULL) {
+            done = strcmp(reply, "OK\n") == 0 || strcmp(reply, "ERR\n") == 0;
+        }
+        if (!done) {
+            break;
+        }
+        client->completed++;
+    }
+    sendAll(socketFD, "quit\n", 5);
+    fclose(replies);
+    return NULL;
+}
+#endif
+
+// Helper function to print one patient as a CSV line
+void printBatchRow(FILE *out, const PatientStore *patients, int row) {
+    fprintf(out, "%d,\"%s\",%d,\"%s\",%d\n",
+           patients->patientIDs[row],
+           patients->names[row],
+           patients->ages[row],
+           diagnosisText(patients->diagnosisCodes[row]),
+           patients->roomNumbers[row]);
+}
+
+// Helper function to split a batch line into comma-separated fields in place
+// A field may be wrapped in double quotes to hold commas ("" is a literal quote).
+// Returns the number of fields found (at most maxFields).
+int splitBatchLine(char *line, char **fields, int maxFields) {
+    int count = 0;
+    char *read = line;
+    while (count < maxFields) {
+        char *write = read;
+        fields[count++] = write;
+        if (*read == '"') {
+            read++;
+            while (*read != 0) {
+                if (*read == '"' && read[1] == '"') {
+                    *write++ = '"';
+                    read += 2;
+                } else if (*read == '"') {
+                    read++;
+                    break;
+                } else {
+                    *write++ = *read++;
+                }
+            }
+        }
+        while (*read != 0 && *read != ',') {
+            *write++ = *read++;
+        }
+        int more = *read == ',';
+        *write = 0;
+        if (!more) {
+            break;
+        }
+        read++;
+    }
+    return count;
+}
+
+// Helper function to parse a whole field as an int
+int parseBatchInt(const char *text, int *value) {
+    char *end;
+    long number = strtol(text, &end, 10);
+    if (end == text || *end != 0 || number < INT32_MIN || number > INT32_MAX) {
+        return 1;
+    }
+    *value = (int)number;
+    return 0;
+}
+
+// Helper function to copy a field into a fixed-size string, cutting it if needed
+void copyBatchText(char *destination, const char *text, size_t size) {
+    size_t length = strlen(text);
+    if (length >= size) {
+        length = size - 1;
+    }
+    memcpy(destination, text, length);
+    destination[length] = 0;
+}
+
+void generateReports() {
+    int choice;
+    printf("REPORTING MENU: \n");
+    printf("1. Total number of patients\n");
+    printf("2. List of discharged patients\n");
+    printf("3. Total shifts covered by each doctor (whole roster)\n");
+    printf("4. Room usage report\n");
+    printf("5. Census analytics (ages, rooms, diagnoses)\n");
+    printf("6. Back to main menu\n");
+    scanf("%d", &choice);
+    getchar();
+    printReport(choice);
+}
+
+// Function to print one report of the reporting menu
+void printReport(int choice) {
+    switch (choice) {
+        case 1:
+            printf("Total number of current patients: %d\n", patientCount());
+        break;
+
+        case 3: {
+            // Shift counts are kept by rosterAdd and rosterRemove, so this only reads the registry
+            printf("Doctor shift Summary:\n");
+            for (int id = 1; id < doctorRegistry.count; id++) {
+                if (doctorRegistry.doctors[id].shifts > 0) {
+                    printf("%s: %d shift\n", doctorRegistry.doctors[id].name, doctorRegistry.doctors[id].shifts);
+                }
+            }
+            break;
+        }
+        case 2:
+            printDischargeReport();
+            break;
+
+        case 4:
+            printRoomUsageReport();
+            break;
+
+        case 5:
+            printCensusAnalytics();
+            break;
+
+        case 6:
+            break;
+
+        default:
+            printf("Feature not implemented yet or invalid choice.\n");
+        break;
+    }
+}
+
+// Function to list who is in a room (room index lookup, no census scan)
+// Each shard has its own room index, so the room is looked up in every shard.
+void showRoomOccupants(int roomNumber) {
+    uint64_t started = metricsStart();
+    int entries[STORE_SHARDS];
+    int occupants = 0;
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        entries[s] = findRoomEntry(&shards[s].patients, roomNumber, 0);
+        occupants += entries[s] >= 0 ? shards[s].patients.rooms[entries[s]].occupants : 0;
+    }
+    metricsCount(METRIC_ROWS_VISITED, (uint64_t)occupants);
+    if (occupants == 0) {
+        printf("Room %d is empty.\n\n", roomNumber);
+        metricsObserve(METRIC_SEARCH_ROOM, started);
+        return;
+    }
+    printf("Room %d has %d patient(s):\n", roomNumber, occupants);
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        const PatientStore *patients = &shards[s].patients;
+        for (int row = entries[s] >= 0 ? patients->rooms[entries[s]].firstRow : -1; row >= 0; row = patients->roomNext[row]) {
+            printf("Patient ID: %d, Name: %s, Age: %d, Diagnosis: %s\n",
+                   patients->patientIDs[row],
+                   patients->names[row],
+                   patients->ages[row],
+                   diagnosisText(patients->diagnosisCodes[row]));
+        }
+    }
+    printf("\n");
+    metricsObserve(METRIC_SEARCH_ROOM, started);
+}
+
+// Helper function to compare room entries by room number for qsort
+int compareRoomEntries(const void *a, const void *b) {
+    int x = ((const RoomEntry *)a)->roomNumber, y = ((const RoomEntry *)b)->roomNumber;
+    return (x > y) - (x < y);
+}
+
+// Function to print occupancy per room, free rooms and over-capacity rooms
+// Works from the room indexes only, so its cost depends on the number of rooms, not patients.
+// A room can have patients in several shards; its entries are added up after sorting.
+void printRoomUsageReport() {
+    int roomCount = 0;
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        roomCount += shards[s].patients.roomCount;
+    }
+    RoomEntry *rooms = malloc((size_t)(roomCount ? roomCount : 1) * sizeof(RoomEntry));
+    if (rooms == NULL) {
+        printf("Memory allocation failed!\n");
+        return;
+    }
+    int used = 0;
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        const PatientStore *patients = &shards[s].patients;
+        for (int i = 0; i < patients->roomCount; i++) {
+            if (patients->rooms[i].occupants > 0) {
+                rooms[used++] = patients->rooms[i];
+            }
+        }
+    }
+    qsort(rooms, (size_t)used, sizeof(RoomEntry), compareRoomEntries);
+    int merged = 0;
+    for (int i = 0; i < used; i++) {
+        if (merged > 0 && rooms[merged - 1].roomNumber == rooms[i].roomNumber) {
+            rooms[merged - 1].occupants += rooms[i].occupants;
+        } else {
+            rooms[merged++] = rooms[i];
+        }
+    }
+    used = merged;
+
+    printf("Room usage report (rooms %d-%d, %d beds each):\n", FIRST_ROOM_NUMBER, LAST_ROOM_NUMBER, ROOM_CAPACITY);
+    printf("%-12s %-10s %-10s\n", "Room", "Patients", "Status");
+    int overCapacity = 0, outsideRange = 0, occupiedInRange = 0;
+    for (int i = 0; i < used; i++) {
+        const char *status = "";
+        if (rooms[i].roomNumber < FIRST_ROOM_NUMBER || rooms[i].roomNumber > LAST_ROOM_NUMBER) {
+            status = "Unknown room";
+            outsideRange++;
+        } else {
+            occupiedInRange++;
+            if (rooms[i].occupants > ROOM_CAPACITY) {
+                status = "Over capacity";
+                overCapacity++;
+            } else if (rooms[i].occupants == ROOM_CAPACITY) {
+                status = "Full";
+            }
+        }
+        printf("%-12d %-10d %-10s\n", rooms[i].roomNumber, rooms[i].occupants, status);
+    }
+
+    // Free rooms are the gaps between occupied rooms, printed as ranges
+    printf("Free rooms:");
+    int next = FIRST_ROOM_NUMBER, ranges = 0;
+    for (int i = 0; i <= used; i++) {
+        int stop = i < used ? rooms[i].roomNumber : LAST_ROOM_NUMBER + 1;
+        if (stop < FIRST_ROOM_NUMBER) continue;
+        if (stop > LAST_ROOM_NUMBER + 1) stop = LAST_ROOM_NUMBER + 1;
+        if (stop > next) {
+            printf(ranges++ ? ", " : " ");
+            if (stop - 1 == next) printf("%d", next);
+            else printf("%d-%d", next, stop - 1);
+        }
+        if (stop + 1 > next) next = stop + 1;
+    }
+    printf(ranges ? "\n" : " none\n");
+
+    printf("Occupied rooms: %d, free rooms: %d, over capacity: %d",
+           occupiedInRange, LAST_ROOM_NUMBER - FIRST_ROOM_NUMBER + 1 - occupiedInRange, overCapacity);
+    if (outsideRange > 0) {
+        printf(", outside %d-%d: %d", FIRST_ROOM_NUMBER, LAST_ROOM_NUMBER, outsideRange);
+    }
+    printf("\n\n");
+    free(rooms);
+}
+
+// Helper function to read a monotonic clock in nanoseconds
+uint64_t monotonicNanoseconds() {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Helper function to start timing an operation for the metrics (0 when they are compiled out)
+uint64_t metricsStart() {
+#ifdef HOSPITAL_NO_METRICS
+    return 0;
+#else
+    return monotonicNanoseconds();
+#endif
+}
+
+#ifndef HOSPITAL_NO_METRICS
+// Helper function to find this thread's metrics stripe (threads are dealt stripes in turn)
+MetricsStripe *metricsLocal() {
+    if (metricsStripe < 0) {
+        metricsStripe = atomic_fetch_add(&metricsNextStripe, 1) % METRICS_STRIPES;
+    }
+    return &metricsStripes[metricsStripe];
+}
+#endif
+
+// Function to record how long an operation took, from the metricsStart() value it began at
+void metricsObserve(int operation, uint64_t started) {
+#ifdef HOSPITAL_NO_METRICS
+    (void)operation;
+    (void)started;
+#else
+    uint64_t elapsed = metricsStart() - started;
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && elapsed > (uint64_t)1000 << bucket) {
+        bucket++;
+    }
+    MetricsStripe *stripe = metricsLocal();
+    atomic_fetch_add_explicit(&stripe->buckets[operation][bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stripe->nanoseconds[operation], elapsed, memory_order_relaxed);
+#endif
+}
+
+// Function to add to one of the metrics counters
+void metricsCount(int counter, uint64_t amount) {
+#ifdef HOSPITAL_NO_METRICS
+    (void)counter;
+    (void)amount;
+#else
+    atomic_fetch_add_explicit(&metricsLocal()->counters[counter], amount, memory_order_relaxed);
+#endif
+}
+
+// Function to write the metrics in the Prometheus text format
+// Latency histograms and counters since the program started, then gauges of the census,
+// roster and journal as they are now (the caller keeps them from changing, see runCommand).
+void writeMetrics(FILE *out) {
+#ifdef HOSPITAL_NO_METRICS
+    fprintf(out, "# Metrics were left out of this build (HOSPITAL_NO_METRICS).\n");
+#else
+    static const char *const operations[METRIC_OPERATIONS] = {
+        "load", "save", "snapshot", "backup", "restore", "add", "discharge",
+        "search_id", "search_name", "search_room", "search_range", "search_diagnosis", "view", "analytics",
+        "command",
+    };
+    static const char *const counters[METRIC_COUNTERS][2] = {
+        {"hospital_bytes_read_total", "Bytes read from data files and backups."},
+        {"hospital_bytes_written_total", "Bytes written to data files, the journal, the archive and backups."},
+        {"hospital_fsyncs_total", "Files synced to disk."},
+        {"hospital_index_probes_total", "Patient ID index slots probed."},
+        {"hospital_rows_visited_total", "Patient rows walked by name and room searches and listings."},
+        {"hospital_command_errors_total", "Batch and server commands that failed."},
+        {"hospital_journal_errors_total", "Journal entries that could not be written (the change was undone)."},
+    };
+
+    fprintf(out, "# HELP hospital_operation_seconds Time taken by each kind of operation.\n");
+    fprintf(out, "# TYPE hospital_operation_seconds histogram\n");
+    for (int op = 0; op < METRIC_OPERATIONS; op++) {
+        uint64_t count = 0, nanoseconds = 0;
+        for (int s = 0; s < METRICS_STRIPES; s++) {
+            nanoseconds += atomic_load_explicit(&metricsStripes[s].nanoseconds[op], memory_order_relaxed);
+        }
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            for (int s = 0; s < METRICS_STRIPES; s++) {
+                count += atomic_load_explicit(&metricsStripes[s].buckets[op][b], memory_order_relaxed);
+            }
+            if (b < METRICS_BUCKETS - 1) {
+                fprintf(out, "hospital_operation_seconds_bucket{operation=\"%s\",le=\"%g\"} %llu\n",
+                        operations[op], 1e-6 * (double)((uint64_t)1 << b), (unsigned long long)count);
+            } else {
+                fprintf(out, "hospital_operation_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n",
+                        operations[op], (unsigned long long)count);
+            }
+        }
+        fprintf(out, "hospital_operation_seconds_sum{operation=\"%s\"} %.9f\n", operations[op], (double)nanoseconds / 1e9);
+        fprintf(out, "hospital_operation_seconds_count{operation=\"%s\"} %llu\n", operations[op], (unsigned long long)count);
+    }
+
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        uint64_t total = 0;
+        for (int s = 0; s < METRICS_STRIPES; s++) {
+            total += atomic_load_explicit(&metricsStripes[s].counters[c], memory_order_relaxed);
+        }
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                counters[c][0], counters[c][1], counters[c][0], counters[c][0], (unsigned long long)total);
+    }
+
+    long capacity = 0;
+    fprintf(out, "# HELP hospital_shard_patients Patients on file in each shard of the store.\n");
+    fprintf(out, "# TYPE hospital_shard_patients gauge\n");
+    for (int s = 0; s < STORE_SHARDS; s++) {
+        fprintf(out, "hospital_shard_patients{shard=\"%d\"} %d\n", s, shards[s].patients.count);
+        capacity += shards[s].patients.capacity;
+    }
+    acquireLock(&logLock, 1);
+    int journal = journalEntries, pending = backupChangeCount;
+    releaseLock(&logLock, 1);
+    fprintf(out, "# HELP hospital_patients Patients on file.\n# TYPE hospital_patients gauge\nhospital_patients %d\n",
+            patientCount());
+    fprintf(out, "# HELP hospital_store_capacity_rows Rows the store has room for without growing.\n"
+                 "# TYPE hospital_store_capacity_rows gauge\nhospital_store_capacity_rows %ld\n", capacity);
+    fprintf(out, "# HELP hospital_doctors Doctors known to the registry.\n# TYPE hospital_doctors gauge\nhospital_doctors %d\n",
+            doctorRegistry.count > 0 ? doctorRegistry.count - 1 : 0);
+    fprintf(out, "# HELP hospital_roster_assignments Doctor shifts on the roster.\n"
+                 "# TYPE hospital_roster_assignments gauge\nhospital_roster_assignments %d\n", roster.liveCount);
+    fprintf(out, "# HELP hospital_journal_entries Journal entries since the last snapshot.\n"
+                 "# TYPE hospital_journal_entries gauge\nhospital_journal_entries %d\n", journal);
+    fprintf(out, "# HELP hospital_backup_pending_changes Patients changed since the last backup.\n"
+                 "# TYPE hospital_backup_pending_changes gauge\nhospital_backup_pending_changes %d\n", pending);
+#endif
+}
+
+// Function to write the metrics to metrics.prom (for a Prometheus textfile collector)
+// Written beside the old file and renamed over it, so a reader never sees half a file.
+int writeMetricsFile() {
+#ifdef HOSPITAL_NO_METRICS
+    return 0;
+#else
+    FILE *file = fopen(METRICS_FILE ".tmp", "w");
+    if (file == NULL) {
+        return 1;
+    }
+    writeMetrics(file);
+    int failed = ferror(file);
+    failed |= fclose(file);
+    if (failed || replaceFile(METRICS_FILE ".tmp", METRICS_FILE) != 0) {
+        remove(METRICS_FILE ".tmp");
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+// Function to rewrite metrics.prom once METRICS_DUMP_SECONDS have passed since the last time
+// Called between commands; the census is locked (shared) only while the file is written.
+void dumpMetricsIfDue() {
+#ifndef HOSPITAL_NO_METRICS
+    int64_t now = (int64_t)time(NULL);
+    int64_t last = atomic_load(&metricsLastDump);
+    if (now - last >= METRICS_DUMP_SECONDS && atomic_compare_exchange_strong(&metricsLastDump, &last, now)) {
+        lockStore(0);
+        lockShards(0);
+        writeMetricsFile();
+        unlockShards(0);
+        unlockStore(0);
+    }
+#endif
+}
+
+#ifdef HOSPITAL_BENCHMARK
+// Function to check the SIMD age filters this CPU runs against filterAgesScalar
+// The ages and the bounds include both ends of int, where comparing with minAge - 1 or
+// maxAge + 1 would overflow. Returns 1 if any kernel's rows or decade counts differ.
+int checkAgeFilters() {
+#ifdef ANALYTICS_TARGET
+    static const int bounds[] = {INT32_MIN, INT32_MIN + 1, -1, 0, 1, 9, 10, 65, 125, 126, INT32_MAX - 1, INT32_MAX};
+    int boundCount = (int)(sizeof(bounds) / sizeof(bounds[0]));
+    int ages[BENCHMARK_CHECK_AGES];
+    for (int i = 0; i < BENCHMARK_CHECK_AGES; i++) {
+        ages[i] = i < boundCount ? bounds[i] : i * 7 % 140 - 5;
+    }
+    struct {
+        const char *name;
+        AgeFilter filter;
+        int available;
+    } kernels[] = {
+        {"sse2", filterAgesSSE2, ANALYTICS_HAS_SSE2()},
+        {"avx2", filterAgesAVX2, ANALYTICS_HAS_AVX2()},
+    };
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        for (int low = 0; kernels[k].available && low < boundCount; low++) {
+            for (int high = 0; high < boundCount; high++) {
+                unsigned char expected[(BENCHMARK_CHECK_AGES + 7) / 8], passed[(BENCHMARK_CHECK_AGES + 7) / 8];
+                int expectedDecades[ANALYTICS_DECADES] = {0}, decades[ANALYTICS_DECADES] = {0};
+                int expectedCount = filterAgesScalar(ages, BENCHMARK_CHECK_AGES, bounds[low], bounds[high], expected,
+                                                     expectedDecades);
+                int count = kernels[k].filter(ages, BENCHMARK_CHECK_AGES, bounds[low], bounds[high], passed, decades);
+                if (count != expectedCount || memcmp(passed, expected, sizeof(passed)) != 0 ||
+                    memcmp(decades, expectedDecades, sizeof(decades)) != 0) {
+                    printf("Error: the %s age filter disagrees with the scalar one for ages %d to %d.\n",
+                           kernels[k].name, bounds[low], bounds[high]);
+                    return 1;
+                }
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+// Function to benchmark the core operations at each census size in sizes ("1000,10000,...")
+// Every size starts from empty files in the scratch directory BENCHMARK_DIR, which is
+// removed at the end. Results go to stdout as CSV, one row per operation and size;
+// everything the operations print themselves goes to the null device.
+// The age filters are checked first (see checkAgeFilters), so a wrong kernel is not timed.
+int runBenchmark(const char *sizes) {
+    if (checkAgeFilters() != 0) {
+        return 1;
+    }
+#ifdef _WIN32
+    const char *nullDevice = "NUL";
+    int made = _mkdir(BENCHMARK_DIR) == 0 && _chdir(BENCHMARK_DIR) == 0;
+#else
+    const char *nullDevice = "/dev/null";
+    int made = mkdir(BENCHMARK_DIR, 0700) == 0 && chdir(BENCHMARK_DIR) == 0;
+#endif
+    if (!made) {
+        printf("Error: cannot create the scratch directory %s (remove it if a benchmark was cut short).\n", BENCHMARK_DIR);
+        return 1;
+    }
+
+    // Results keep the real stdout; stdout itself is pointed at the null device
+    fflush(stdout);
+#ifdef _WIN32
+    FILE *results = _fdopen(_dup(_fileno(stdout)), "w");
+#else
+    FILE *results = fdopen(dup(fileno(stdout)), "w");
+#endif
+    benchmarkSink = fopen(nullDevice, "w");
+    if (results == NULL || benchmarkSink == NULL || freopen(nullDevice, "w", stdout) == NULL) {
+        fprintf(stderr, "Error: cannot set up the benchmark output.\n");
+        return 1;
+    }
+    fprintf(results, "patients,operation,count,seconds,ops_per_second,p50_us,p99_us\n");
+
+    int failed = 0;
+    batchMode = 1; // Bulk work, like --batch: the journal is not flushed after every entry
+    journalCompactHeld = 1;
+    for (const char *size = sizes; *size != 0 && !failed; ) {
+        char *end;
+        long patients = strtol(size, &end, 10);
+        if (end == size || (*end != ',' && *end != 0) || patients < 1 || patients > BENCHMARK_MAX_PATIENTS) {
+            fprintf(stderr, "Error: census sizes must be 1 to %d, separated by commas.\n", BENCHMARK_MAX_PATIENTS);
+            failed = 1;
+            break;
+        }
+        size = *end == ',' ? end + 1 : end;
+        long samples = patients > BENCHMARK_ID_SEARCHES ? patients : BENCHMARK_ID_SEARCHES;
+        double *latencies = malloc((size_t)samples * sizeof(double));
+        if (latencies == NULL) {
+            fprintf(stderr, "Error: not enough memory for %ld patients.\n", patients);
+            failed = 1;
+            break;
+        }
+        runBenchmarkSize(results, (int)patients, latencies);
+        free(latencies);
+    }
+    batchMode = 0;
+    journalCompactHeld = 0;
+
+    clearBenchmarkFiles();
+    fclose(benchmarkSink);
+    fclose(results);
+#ifdef _WIN32
+    if (_chdir("..") == 0) _rmdir(BENCHMARK_DIR);
+#else
+    if (chdir("..") == 0) rmdir(BENCHMARK_DIR);
+#endif
+    return failed;
+}
+
+// Function to run every benchmarked operation on a generated census of the given size
+// The steps run in order on the same census: it is built by the adds, a tenth of it is
+// discharged (so the discharge report has an archive to read), then it is saved,
+// reloaded, backed up (always a full backup) and restored.
+void runBenchmarkSize(FILE *results, int patients, double *latencies) {
+    clearBenchmarkFiles();
+    journalEntries = 0;
+    snapshotPatients = 0;
+    atomic_store(&journalCompactDue, 0);
+    openJournal();
+    openArchive();
+    benchmarkPatients = patients;
+    int idSearches = patients < BENCHMARK_ID_SEARCHES ? patients : BENCHMARK_ID_SEARCHES;
+    int nameSearches = patients < BENCHMARK_NAME_SEARCHES ? patients : BENCHMARK_NAME_SEARCHES;
+
+    BenchmarkStep census[] = {
+        {"add", patients, prepareBenchmarkAdd, runBenchmarkCommand},
+        {"search_id", idSearches, prepareBenchmarkSearchID, runBenchmarkCommand},
+        {"search_name", nameSearches, prepareBenchmarkSearchName, runBenchmarkCommand},
+        {"view", BENCHMARK_REPEATS, prepareBenchmarkView, runBenchmarkCommand},
+        {"view_by_name", BENCHMARK_REPEATS, prepareBenchmarkSortedView, runBenchmarkCommand},
+        {"range_age", BENCHMARK_REPEATS, prepareBenchmarkRange, runBenchmarkCommand},
+        {"stats", BENCHMARK_REPEATS, prepareBenchmarkStats, runBenchmarkCommand},
+        {"search_diagnosis", BENCHMARK_REPEATS, prepareBenchmarkSearchDiagnosis, runBenchmarkCommand},
+        {"discharge", (patients + 9) / 10, prepareBenchmarkDischarge, runBenchmarkCommand},
+    };
+    for (size_t i = 0; i < sizeof(census) / sizeof(census[0]); i++) {
+        runBenchmarkStep(results, &census[i], latencies);
+    }
+
+    // A month of roster for the shifts report (not timed)
+    int today, shift;
+    currentDayAndShift(&today, &shift);
+    char doctor[NAME_MAX_LENGTH];
+    for (int day = 0; day < BENCHMARK_ROSTER_DAYS; day++) {
+        for (shift = 0; shift < SHIFTS_IN_DAY; shift++) {
+            for (int ward = 1; ward <= WARD_COUNT; ward++) {
+                snprintf(doctor, sizeof(doctor), "Dr %d", (day * SHIFTS_IN_DAY * WARD_COUNT + shift * WARD_COUNT + ward) % BENCHMARK_DOCTORS);
+                scheduleDoctor(today + day, shift, ward, doctor);
+            }
+        }
+    }
+
+    BenchmarkStep files[] = {
+        {"report_total", BENCHMARK_REPEATS, NULL, runBenchmarkTotalReport},
+        {"report_discharged", BENCHMARK_REPEATS, NULL, runBenchmarkDischargeReport},
+        {"report_shifts", BENCHMARK_REPEATS, NULL, runBenchmarkShiftsReport},
+        {"report_rooms", BENCHMARK_REPEATS, NULL, runBenchmarkRoomsReport},
+        {"save", BENCHMARK_REPEATS, NULL, runBenchmarkSave},
+        {"load", BENCHMARK_REPEATS, NULL, runBenchmarkLoad},
+        {"backup", BENCHMARK_REPEATS, prepareBenchmarkBackup, runBenchmarkBackup},
+        {"restore", BENCHMARK_REPEATS, NULL, runBenchmarkRestore},
+    };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        runBenchmarkStep(results, &files[i], latencies);
+    }
+}
+
+// Function to time one operation and write its CSV row
+// Throughput is over the whole run; the percentiles are of the single operations.
+void runBenchmarkStep(FILE *results, const BenchmarkStep *step, double *latencies) {
+    char line[BATCH_LINE_MAX] = "";
+    double total = 0;
+    for (int i = 0; i < step->count; i++) {
+        if (step->prepare != NULL) {
+            step->prepare(i, line);
+        }
+        uint64_t start = monotonicNanoseconds();
+        step->run(i, line);
+        latencies[i] = (double)(monotonicNanoseconds() - start) / 1e9;
+        total += latencies[i];
+        compactJournalIfDue(); // A snapshot the journal asked for is not part of the operation
+    }
+    qsort(latencies, (size_t)step->count, sizeof(double), compareDoubles);
+    fprintf(results, "%d,%s,%d,%.6f,%.1f,%.3f,%.3f\n", benchmarkPatients, step->name, step->count, total,
+            total > 0 ? step->count / total : 0.0,
+            latencies[(step->count - 1) * 50 / 100] * 1e6, latencies[(step->count - 1) * 99 / 100] * 1e6);
+    fflush(results);
+}
+
+// Function to drop the census, the roster and every data file in the scratch directory
+void clearBenchmarkFiles() {
+    static const char *const names[] = {
+        PATIENT_FILE, PATIENT_FILE ".tmp", SCHEDULE_FILE, SCHEDULE_FILE ".tmp", JOURNAL_FILE,
+        BACKUP_FILE, BACKUP_FILE ".tmp", BACKUP_PENDING_FILE, ARCHIVE_FILE, ARCHIVE_INDEX_FILE,
+        METRICS_FILE, METRICS_FILE ".tmp",
+    };
+    closeDataFiles();
+    freeAllPatients();
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        remove(names[i]);
+    }
+    char path[64];
+    for (int n = 1;; n++) {
+        backupPath(n, path, sizeof(path));
+        if (remove(path) != 0) {
+            break;
+        }
+    }
+}
+
+// Helper function to compare doubles for qsort
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Helper functions to generate the census: patient i gets a distinct ID in a scattered
+// order (a multiplicative hash modulo the prime 2^31 - 1), and other patients are picked
+// pseudo-randomly from step i
+int benchmarkPatientID(int i) {
+    return (int)((uint64_t)(i + 1) * 48271u % 2147483647u);
+}
+
+int benchmarkPick(int i, int count) {
+    return (int)((uint32_t)(i + 1) * 2654435761u % (uint32_t)count);
+}
+
+void prepareBenchmarkAdd(int i, char *line) {
+    uint32_t mix = (uint32_t)benchmarkPatientID(i) * 2246822519u;
+    snprintf(line, BATCH_LINE_MAX, "add,%d,\"N%u\",%u,\"Diag %u\",%u", benchmarkPatientID(i),
+             (mix >> 8) % (uint32_t)(benchmarkPatients / 4 + 1), PATIENT_MIN_AGE + mix % 110, (mix >> 4) % 64,
+             FIRST_ROOM_NUMBER + (mix >> 12) % (LAST_ROOM_NUMBER - FIRST_ROOM_NUMBER + 1));
+}
+
+void prepareBenchmarkSearchID(int i, char *line) {
+    snprintf(line, BATCH_LINE_MAX, "search,%d", benchmarkPatientID(benchmarkPick(i, benchmarkPatients)));
+}
+
+void prepareBenchmarkSearchName(int i, char *line) {
+    uint32_t mix = (uint32_t)benchmarkPatientID(benchmarkPick(i, benchmarkPatients)) * 2246822519u;
+    snprintf(line, BATCH_LINE_MAX, "search,name,N%u", (mix >> 8) % (uint32_t)(benchmarkPatients / 4 + 1));
+}
+
+void prepareBenchmarkDischarge(int i, char *line) {
+    snprintf(line, BATCH_LINE_MAX, "discharge,%d", benchmarkPatientID(i * 10));
+}
+
+void prepareBenchmarkView(int i, char *line) {
+    (void)i;
+    snprintf(line, BATCH_LINE_MAX, "view");
+}
+
+// The first sorted view also builds the name index; the later ones only walk it
+void prepareBenchmarkSortedView(int i, char *line) {
+    (void)i;
+    snprintf(line, BATCH_LINE_MAX, "view,0,0,name");
+}
+
+void prepareBenchmarkRange(int i, char *line) {
+    (void)i;
+    snprintf(line, BATCH_LINE_MAX, "range,age,65,");
+}
+
+void prepareBenchmarkStats(int i, char *line) {
+    (void)i;
+    snprintf(line, BATCH_LINE_MAX, "stats,65,125");
+}
+
+void prepareBenchmarkSearchDiagnosis(int i, char *line) {
+    (void)i;
+    snprintf(line, BATCH_LINE_MAX, "search,diagnosis,diag 7 OR diag 4*");
+}
+
+void prepareBenchmarkBackup(int i, char *line) {
+    (void)i;
+    (void)line;
+    // With no backup.pending there is no chain to extend, so backupData writes a full backup
+    if (backupPendingFile != NULL) {
+        fclose(backupPendingFile);
+        backupPendingFile = NULL;
+    }
+    remove(BACKUP_PENDING_FILE);
+}
+
+// Helper functions for the timed part of each step
+void runBenchmarkCommand(int i, char *line) {
+    (void)i;
+    runCommand(line, benchmarkSink, &benchmarkTotals);
+}
+
+void runBenchmarkTotalReport(int i, char *line) {
+    (void)i;
+    (void)line;
+    printReport(1);
+}
+
+void runBenchmarkDischargeReport(int i, char *line) {
+    (void)i;
+    (void)line;
+    printDischargesBetween(0, time(NULL));
+}
+
+void runBenchmarkShiftsReport(int i, char *line) {
+    (void)i;
+    (void)line;
+    printReport(3);
+}
+
+void runBenchmarkRoomsReport(int i, char *line) {
+    (void)i;
+    (void)line;
+    printReport(4);
+}
+
+void runBenchmarkSave(int i, char *line) {
+    (void)i;
+    (void)line;
+    saveDataToFile();
+}
+
+void runBenchmarkLoad(int i, char *line) {
+    (void)i;
+    (void)line;
+    freeAllPatients();
+    loadDataFromFile();
+}
+
+void runBenchmarkBackup(int i, char *line) {
+    (void)i;
+    (void)line;
+    backupData();
+}
+
+void runBenchmarkRestore(int i, char *line) {
+    (void)i;
+    (void)line;
+    restoreData();
+}
+#endif